@@ -0,0 +1,284 @@
+/*
+  This file is part of ESFS, a FUSE-based filesystem that supports snapshots.
+  ESFS is Copyright (C) 2013 Elod Csirmaz
+  <http://www.epcsirmaz.com/> <https://github.com/csirmaz>.
+
+  ESFS is based on Big Brother File System (fuse-tutorial)
+  Copyright (C) 2012 Joseph J. Pfeiffer, Jr., Ph.D. <pfeiffer@cs.nmsu.edu>,
+  and was forked from it on 21 August 2013.
+  Big Brother File System can be distributed under the terms of
+  the GNU GPLv3. See the file COPYING.
+  See also <http://www.cs.nmsu.edu/~pfeiffer/fuse-tutorial/>.
+
+  Big Brother File System was derived from function prototypes found in
+  /usr/include/fuse/fuse.h
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+  fuse.h is licensed under the LGPLv2.
+
+  ESFS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  ESFS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * NOTE: A Perl script is used to replace $ with esfs_ and $$ with ESFS_
+ * in this file. To write $, use \$.
+ */
+
+/* This file contains the block cache shared by all files read in the snapshots.
+ *
+ * Block cache
+ * ===========
+ *
+ * Blocks saved in dat files never change once their pointers have been
+ * written into the map file, so they can be cached without any invalidation
+ * while the dat file exists. Blocks are identified by the device and inode
+ * number of the dat file, and the pointer. Blocks read from the main files
+ * are never cached.
+ *
+ * As inode numbers can be reused once a snapshot is deleted, the key also
+ * contains a generation number, which is increased whenever a snapshot is
+ * deleted (see $bcache_invalidate). Handles opened before that keep using the
+ * old generation, and blocks cached under it are eventually evicted.
+ *
+ * The size of the cache is set when ESFS is started (see --cache-size);
+ * if it is 0, the cache is not used at all.
+ * To allow FUSE threads to use the cache in parallel, it is split into
+ * $$BCACHE_SHARDS shards, each with its own mutex, hash table, LRU list,
+ * and an equal share of the size limit.
+ */
+
+
+/** Selects the shard and the hash bucket for a key */
+static inline unsigned long $bcache_hash(const struct $bcache_key_t *key)
+{
+   unsigned long h;
+
+   h = (unsigned long)key->ino * 2654435761UL;
+   h ^= (unsigned long)key->dev + (h << 6) + (h >> 2);
+   h ^= (unsigned long)key->gen + (h << 6) + (h >> 2);
+   h ^= (unsigned long)key->pointer + (h << 6) + (h >> 2);
+   return h;
+}
+
+
+static inline int $bcache_key_eq(const struct $bcache_key_t *a, const struct $bcache_key_t *b)
+{
+   return (a->pointer == b->pointer && a->ino == b->ino && a->dev == b->dev && a->gen == b->gen);
+}
+
+
+/** Initialises the block cache based on fsdata->bcache_size
+ *
+ * Returns:
+ * * 0 on success
+ * * -errno on error
+ */
+static int $bcache_init(struct $fsdata_t *fsdata)
+{
+   int i;
+   size_t buckets;
+   struct $bcache_shard_t *shard;
+
+   fsdata->bcache = NULL;
+   fsdata->bcache_gen = 0;
+
+   if(fsdata->bcache_size == 0) { return 0; }
+
+   // Aim for one bucket per cached block
+   buckets = 16;
+   while(buckets * $$BL_S * $$BCACHE_SHARDS < fsdata->bcache_size) { buckets *= 2; }
+
+   fsdata->bcache = calloc($$BCACHE_SHARDS, sizeof(struct $bcache_shard_t));
+   if(fsdata->bcache == NULL) { return -ENOMEM; }
+
+   for(i = 0; i < $$BCACHE_SHARDS; i++) {
+      shard = &(fsdata->bcache[i]);
+      shard->hash = calloc(buckets, sizeof(struct $bcache_entry_t *));
+      if(shard->hash == NULL) {
+         for(i--; i >= 0; i--) { free(fsdata->bcache[i].hash); }
+         free(fsdata->bcache);
+         fsdata->bcache = NULL;
+         return -ENOMEM;
+      }
+      shard->buckets = buckets;
+      shard->limit = fsdata->bcache_size / $$BCACHE_SHARDS;
+      pthread_mutex_init(&(shard->mutex), NULL);
+   }
+
+   return 0;
+}
+
+
+/** Frees the block cache */
+static void $bcache_destroy(struct $fsdata_t *fsdata)
+{
+   int i;
+   struct $bcache_entry_t *entry;
+   struct $bcache_entry_t *next;
+
+   if(fsdata->bcache == NULL) { return; }
+
+   for(i = 0; i < $$BCACHE_SHARDS; i++) {
+      for(entry = fsdata->bcache[i].lru_first; entry != NULL; entry = next) {
+         next = entry->lru_next;
+         free(entry);
+      }
+      free(fsdata->bcache[i].hash);
+      pthread_mutex_destroy(&(fsdata->bcache[i].mutex));
+   }
+
+   free(fsdata->bcache);
+   fsdata->bcache = NULL;
+}
+
+
+/** Makes cached blocks unreachable from handles opened from now on
+ *
+ * Call this when dat files are deleted, as their inode numbers can be reused,
+ * and before slots of the deduplication store are freed (see $b_bckey).
+ */
+static inline void $bcache_invalidate(struct $fsdata_t *fsdata)
+{
+   __sync_fetch_and_add(&(fsdata->bcache_gen), 1);
+}
+
+
+/** Unlinks an entry from the LRU list of a shard. The mutex of the shard must be held. */
+static inline void $bcache_lru_unlink(struct $bcache_shard_t *shard, struct $bcache_entry_t *entry)
+{
+   if(entry->lru_prev != NULL) { entry->lru_prev->lru_next = entry->lru_next; } else { shard->lru_first = entry->lru_next; }
+   if(entry->lru_next != NULL) { entry->lru_next->lru_prev = entry->lru_prev; } else { shard->lru_last = entry->lru_prev; }
+}
+
+
+/** Adds an entry to the front of the LRU list of a shard. The mutex of the shard must be held. */
+static inline void $bcache_lru_push(struct $bcache_shard_t *shard, struct $bcache_entry_t *entry)
+{
+   entry->lru_prev = NULL;
+   entry->lru_next = shard->lru_first;
+   if(shard->lru_first != NULL) { shard->lru_first->lru_prev = entry; } else { shard->lru_last = entry; }
+   shard->lru_first = entry;
+}
+
+
+/** Copies a part of a cached block into buf
+ *
+ * Returns:
+ * * 1 - if the block was found in the cache
+ * * 0 - if it was not
+ */
+static inline int $bcache_get(
+   struct $fsdata_t *fsdata,
+   const struct $bcache_key_t *key,
+   char *buf,
+   size_t offset, /**< offset inside the block */
+   size_t length
+)
+{
+   unsigned long h;
+   struct $bcache_shard_t *shard;
+   struct $bcache_entry_t *entry;
+
+   h = $bcache_hash(key);
+   shard = &(fsdata->bcache[h % $$BCACHE_SHARDS]);
+
+   pthread_mutex_lock(&(shard->mutex));
+
+   for(entry = shard->hash[(h / $$BCACHE_SHARDS) & (shard->buckets - 1)]; entry != NULL; entry = entry->hash_next) {
+      if($bcache_key_eq(key, &(entry->key))) { break; }
+   }
+
+   if(entry == NULL || offset + length > entry->length) {
+      pthread_mutex_unlock(&(shard->mutex));
+      return 0;
+   }
+
+   memcpy(buf, entry->data + offset, length);
+
+   // Mark as most recently used
+   $bcache_lru_unlink(shard, entry);
+   $bcache_lru_push(shard, entry);
+
+   pthread_mutex_unlock(&(shard->mutex));
+   return 1;
+}
+
+
+/** Adds a block to the cache, evicting the least recently used blocks if necessary
+ *
+ * Failures are ignored as the cache is only an optimisation.
+ */
+static inline void $bcache_put(
+   struct $fsdata_t *fsdata,
+   const struct $bcache_key_t *key,
+   const char *data,
+   size_t length
+)
+{
+   unsigned long h;
+   struct $bcache_shard_t *shard;
+   struct $bcache_entry_t *entry;
+   struct $bcache_entry_t **bucket;
+   struct $bcache_entry_t **pp;
+   struct $bcache_entry_t *reuse = NULL;
+
+   h = $bcache_hash(key);
+   shard = &(fsdata->bcache[h % $$BCACHE_SHARDS]);
+
+   if(length > shard->limit) { return; }
+
+   pthread_mutex_lock(&(shard->mutex));
+
+   bucket = &(shard->hash[(h / $$BCACHE_SHARDS) & (shard->buckets - 1)]);
+   for(entry = *bucket; entry != NULL; entry = entry->hash_next) {
+      if($bcache_key_eq(key, &(entry->key))) { // already cached by another thread
+         pthread_mutex_unlock(&(shard->mutex));
+         return;
+      }
+   }
+
+   // Evict from the end of the LRU list
+   while(shard->used + length > shard->limit && shard->lru_last != NULL) {
+      entry = shard->lru_last;
+      $bcache_lru_unlink(shard, entry);
+      for(pp = &(shard->hash[($bcache_hash(&(entry->key)) / $$BCACHE_SHARDS) & (shard->buckets - 1)]); *pp != entry; pp = &((*pp)->hash_next)) { }
+      *pp = entry->hash_next;
+      shard->used -= entry->length;
+      // Keep the memory of an entry of the same size to save a free/malloc
+      if(reuse == NULL && entry->length == length) {
+         reuse = entry;
+      } else {
+         free(entry);
+      }
+   }
+
+   entry = reuse;
+   if(entry == NULL) {
+      entry = malloc(sizeof(struct $bcache_entry_t) + length);
+      if(entry == NULL) {
+         pthread_mutex_unlock(&(shard->mutex));
+         return;
+      }
+   }
+
+   memcpy(&(entry->key), key, sizeof(struct $bcache_key_t));
+   entry->length = length;
+   memcpy(entry->data, data, length);
+
+   entry->hash_next = *bucket;
+   *bucket = entry;
+   $bcache_lru_push(shard, entry);
+   shard->used += length;
+
+   pthread_mutex_unlock(&(shard->mutex));
+}
@@ -40,15 +40,39 @@
  * How blocks are saved
  * ====================
  *
- * This is done by splitting the main file into blocks of $$BL_S size.
+ * This is done by splitting the main file into blocks of $$BL_S size, or
+ * the blocksize recorded in the map file when it was created (see $$MAP_BL_SLOG).
  * For each block, there is a pointer of $$BLP_L size in the map file.
  * When a block is modified, the old block is appended to the dat file,
  * and its number is saved in the pointer, starting with 1.
+ * If possible, the kernel copies or clones the block (see $b_copy_run).
  * If the pointer is already non-0, that is, the block has already been
  * saved, it is not saved again.
+ * Blocks that are holes in the main file or only contain zeros are not
+ * appended to the dat file; $$BLP_ZERO is saved as their pointer instead.
+ * If the deduplication store is used, blocks are saved there instead of the
+ * dat file, and the pointer refers to the store (see dedup.c).
+ * If the map file was created with $$MAP_COMPRESSED, blocks are compressed
+ * using zlib, and appended to the dat file at any offset. The pointer then
+ * holds the offset and the length saved (see $$BLP_COMP). Blocks that cannot
+ * be compressed are saved as they are.
  * The map file might become a sparse file, but that's fine as
  * uninitalised parts will return 0.
  *
+ * If the map file was created with $$MAP_PAGES, blocks only partly overwritten
+ * are saved page by page. A whole block is reserved at the end of the dat file,
+ * but only the pages overwritten are written into it, and the pointer holds a
+ * bitmap of these (see $$BLP_PART). When all the pages have been saved, it
+ * becomes a normal pointer. Files in the snapshots are then read in pages,
+ * and pages not saved are looked up in the next snapshot.
+ *
+ * If the main file is removed or truncated to 0 before any of its blocks have
+ * been saved, it is moved into the snapshot as the dat file (see $$MAP_WHOLE).
+ *
+ * As the map files of a file in different snapshots can use different
+ * blocksizes, files in the snapshots are read in blocks of the smallest one
+ * (mfd->sn_bl_slog), and larger blocks saved are read in parts.
+ *
  * Useful information
  * ==================
  *
@@ -74,16 +98,434 @@
  * reaches (4), it will think it needs to save the block. However, the block in the
  * main file may be written by this thread before it reads it.
  *
+ * The lock is not taken for the whole file, but for groups of blocks
+ * (see $b_lock_label), so that parts of a file far apart can be saved in parallel.
+ * Reading the latest snapshot or the main file through a snapshot only needs
+ * the map and the main file not to change while a block is read, so readers
+ * share the lock, and only writers saving blocks hold it exclusively.
+ *
  * Also, appending to the dat file and getting where we wrote to are not atomic
- * operations.
+ * operations, and the blocks of different groups can be saved at the same time.
+ * The space is therefore reserved at the end of the dat file first
+ * (see $mfd_dat_reserve), and the blocks are then written into it.
+ */
+
+
+#define $$B_CALC_BLOCKS(blockoffset, blocknumber, byteoffset, bytesize, slog) \
+   blockoffset = (byteoffset >> (slog)); \
+   blocknumber = ((bytesize + (byteoffset & ((1 << (slog)) - 1)) - 1) >> (slog)) + 1;
+
+/** Number of pointers to read from a map file at once when building the block index */
+#define $$B_INDEX_CHUNK 4096
+
+/** Number of blocks saved at once by $b_write (these fit into a buffer from bufpool.c whatever the blocksize) */
+#define $$B_WRITE_RUN ($$BUFPOOL_BUFSIZE >> $$BL_SLOG)
+
+/** Builds the resolved block index of a file in a snapshot
+ *
+ * Snapshots older than the latest one are immutable, so their map files
+ * can be read once when the file is opened. For each block, we save the
+ * first snapshot step (going forward in time) that holds it, and the pointer
+ * found there, so that $b_read can find the block without reading the maps again.
+ * Blocks not held by any of these snapshots are left as 0, and need to be
+ * looked up in the latest snapshot and the main file, which can still change.
+ * The index has an entry for each block of mfd->sn_bl_slog; larger blocks
+ * in a snapshot fill several entries with the same pointer.
+ *
+ * Sets:
+ * * mfd->sn_index - left as NULL if the file is not in an immutable snapshot
+ * * mfd->sn_index_len
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $b_index_build(const struct $fsdata_t *fsdata, struct $mfd_t *mfd)
+{
+   $$BLP_T *pointers;
+   $$BLP_T blocks, stepblocks, chunkstart, chunklen, i, j, jend;
+   int sni, ret, shift;
+   int waserror = 0; // positive on error
+
+   mfd->sn_index = NULL;
+   mfd->sn_index_len = 0;
+
+   // Nothing to index if the latest snapshot or the main file is the first with the file,
+   // or if the file did not exist or was empty (see $b_read)
+   if(mfd->sn_first_file < 2 || mfd->mapheader.exists == 0 || mfd->mapheader.fstat.st_size == 0) { return 0; }
+
+   blocks = ((mfd->mapheader.fstat.st_size - 1) >> mfd->sn_bl_slog) + 1;
+
+   pointers = malloc($$BLP_S * $$B_INDEX_CHUNK);
+   if(unlikely(pointers == NULL)) { return -ENOMEM; }
+
+   mfd->sn_index = calloc(blocks, sizeof(struct $b_index_t));
+   if(unlikely(mfd->sn_index == NULL)) {
+      free(pointers);
+      return -ENOMEM;
+   }
+   mfd->sn_index_len = blocks;
+
+   for(sni = mfd->sn_first_file; sni > 1; sni--) {
+
+      if(mfd->sn_steps[sni].mapfd < 0) { continue; } // no map file in this snapshot
+
+      shift = mfd->sn_steps[sni].bl_slog - mfd->sn_bl_slog;
+      stepblocks = ((blocks - 1) >> shift) + 1;
+
+      if(mfd->sn_steps[sni].whole) { // the snapshot holds all the blocks
+         for(j = 0; j < blocks; j++) {
+            if(mfd->sn_index[j].sni == 0) {
+               mfd->sn_index[j].sni = sni;
+               mfd->sn_index[j].pointer = (j >> shift) + 1;
+            }
+         }
+         continue;
+      }
+
+      for(chunkstart = 0; chunkstart < stepblocks; chunkstart += $$B_INDEX_CHUNK) {
+
+         chunklen = stepblocks - chunkstart;
+         if(chunklen > $$B_INDEX_CHUNK) { chunklen = $$B_INDEX_CHUNK; }
+
+         if(unlikely((ret = $mfd_read_step_pointers(&(mfd->sn_steps[sni]), chunkstart, chunklen, pointers, fsdata)) != 0)) {
+            waserror = -ret;
+            $dlogi("ERROR b_index_build: reading map sni='%d' failed; err %d = %s\n", sni, waserror, strerror(waserror));
+            break;
+         }
+
+         for(i = 0; i < chunklen; i++) {
+            if(pointers[i] == 0) { continue; }
+            jend = ((chunkstart + i + 1) << shift);
+            if(jend > blocks) { jend = blocks; }
+            for(j = ((chunkstart + i) << shift); j < jend; j++) {
+               // The file is read in pages if there are partially saved blocks
+               if($$BLP_IS_PART(pointers[i]) && !($$BLP_PART_MASK(pointers[i]) & ((uint32_t)1 << (j - ((chunkstart + i) << shift))))) { continue; }
+               if(mfd->sn_index[j].sni == 0) {
+                  mfd->sn_index[j].sni = sni;
+                  mfd->sn_index[j].pointer = pointers[i];
+               }
+            }
+         }
+
+      }
+
+      if(waserror != 0) { break; }
+   }
+
+   free(pointers);
+
+   if(waserror != 0) {
+      free(mfd->sn_index);
+      mfd->sn_index = NULL;
+      return -waserror;
+   }
+
+   $dlogdbg("b_index_build: indexed %td blocks\n", blocks);
+   return 0;
+}
+
+
+/** Returns the label of the lock of the group of blocks holding a byte of a file
+ *
+ * Blocks are locked in groups of (1 << $$LOCK_GROUP_SLOG) bytes instead of
+ * locking the whole file, so that parts of a large file far from each other
+ * can be written in parallel. A block never straddles two groups, whatever
+ * the blocksize of the map file. The label of a group is that of the file
+ * with the number of the group in it, so that it differs from the label of the
+ * file itself, and holding the lock of a file does not block its groups.
+ */
+static inline $$LOCKLABEL_T $b_lock_label(const struct $mfd_t *mfd, off_t byteoffset)
+{
+   $$LOCKLABEL_T label;
+
+   label = mfd->locklabel;
+   label.part = (byteoffset >> $$LOCK_GROUP_SLOG) + 1;
+   return label;
+}
+
+
+/** Returned by $b_read_find for blocks that only contain zeros */
+#define $$B_FD_ZERO -1
+
+/** Finds where a block of a snapshot file can be read from
+ *
+ * blockoffset is in blocks of mfd->sn_bl_slog. If the block is part of a larger
+ * block saved in a snapshot, the whole saved block is located.
+ * Pages not saved in partially saved blocks are skipped (see $$BLP_PART).
+ *
+ * If the latest snapshot or the main file needs to be checked, the lock
+ * of the group of the block is acquired and left locked, as the block needs
+ * to be read before anyone could save and overwrite it (see $b_lock_label).
+ * The lock is shared, so readers only wait for threads saving blocks of the
+ * same group, and not for each other. The caller must release it.
+ *
+ * Sets:
+ * * *fd - the file to read the block from, or $$B_FD_ZERO
+ * * *from - the offset of the saved block in that file
+ * * *inner - the offset of the block inside the saved block
+ * * *foundsni - the step the block was found in (0 for the main file)
+ * * *complen - the length saved if the block needs to be read using $b_read_comp, otherwise 0
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static inline int $b_read_find(
+   struct $fsdata_t *fsdata,
+   const struct $mfd_t *mfd,
+   off_t blockoffset,
+   int *lock,
+   int *fd,
+   off_t *from,
+   off_t *inner,
+   int *foundsni,
+   size_t *complen
+)
+{
+   $$BLP_T pointer;
+   int sni, ret, shift;
+
+   *complen = 0;
+   *inner = 0;
+
+   // If the index says that an immutable snapshot holds the block, we start there;
+   // otherwise we only need to check the latest snapshot and the main file.
+   sni = mfd->sn_first_file;
+   if(mfd->sn_index != NULL) {
+      sni = mfd->sn_index[blockoffset].sni;
+      if(sni == 0) { sni = 1; }
+   }
+
+   for(; sni >= 0; sni--) {
+
+      $dlogdbg("b_read_find: trying snapshot='%d' = '%s'\n", sni, mfd->sn_steps[sni].path);
+
+      // Acquire the lock if we're reading the latest snapshot or the main file
+      if(sni <= 1 && *lock == -1) {
+         if(unlikely((*lock = $mflock_lock_shared(fsdata, $b_lock_label(mfd, blockoffset << mfd->sn_bl_slog))) < 0)) {
+            ret = *lock;
+            *lock = -1;
+            $dlogi("ERROR getting lock; err %d = %s\n", -ret, strerror(-ret));
+            return ret;
+         }
+         $dlogdbg("b_read_find: Got lock %d\n", *lock);
+      }
+
+      if(sni == 0) { // we are reading from the main file
+         $dlogdbg("b_read_find: reading block from main file\n");
+         *fd = mfd->sn_steps[0].datfd;
+         *from = (blockoffset << mfd->sn_bl_slog);
+         *foundsni = 0;
+         return 0;
+      }
+
+      if(mfd->sn_steps[sni].mapfd < 0) { continue; } // go the next snapshot if there is no map file here
+
+      shift = mfd->sn_steps[sni].bl_slog - mfd->sn_bl_slog;
+
+      if(mfd->sn_steps[sni].whole) { // the whole file has been moved here
+         $dlogdbg("b_read_find: block found in the whole file in snapshot '%d'\n", sni);
+         *fd = mfd->sn_steps[sni].datfd;
+         *from = ((blockoffset >> shift) << mfd->sn_steps[sni].bl_slog);
+         *inner = ((blockoffset & ((1 << shift) - 1)) << mfd->sn_bl_slog);
+         *foundsni = sni;
+         return 0;
+      }
+
+      if(sni > 1 && mfd->sn_index != NULL) { // the pointer has already been read into the index
+
+         pointer = mfd->sn_index[blockoffset].pointer;
+         $dlogdbg("b_read_find: pointer from index, pointer='%td'\n", pointer);
+
+      } else {
+
+         if(unlikely((ret = $mfd_read_step_pointers(&(mfd->sn_steps[sni]), (blockoffset >> shift), 1, &pointer, fsdata)) != 0)) {
+            $dlogi("ERROR b_read_find: reading map failed; err=%s\n", strerror(-ret));
+            return ret;
+         }
+         $dlogdbg("b_read_find: pointer read from map, pointer='%td'\n", pointer);
+
+      }
+
+      if(pointer == 0) { continue; } // go to next snapshot
+
+      // If the block is partially saved, the file is read in pages
+      if($$BLP_IS_PART(pointer) && !($$BLP_PART_MASK(pointer) & ((uint32_t)1 << (blockoffset & ((1 << shift) - 1))))) { continue; }
+
+      *foundsni = sni;
+      *inner = ((blockoffset & ((1 << shift) - 1)) << mfd->sn_bl_slog);
+
+      if(pointer == $$BLP_ZERO) {
+         $dlogdbg("b_read_find: zero block found in snapshot '%d'\n", sni);
+         *fd = $$B_FD_ZERO;
+         *from = 0;
+         return 0;
+      }
+
+      if(pointer <= $$DEDUP_POINTER(0)) {
+         if(unlikely(fsdata->dedup == NULL)) {
+            $dlogi("ERROR b_read_find: block in the deduplication store, but there is no store\n");
+            return -EIO;
+         }
+         $dlogdbg("b_read_find: block found in snapshot '%d' in the store at '%lld'\n", sni, (long long)$$DEDUP_SLOT(pointer));
+         *fd = fsdata->dedup->datfd;
+         *from = ($$DEDUP_SLOT(pointer) << $$BL_SLOG);
+         return 0;
+      }
+
+      if($$BLP_IS_COMP(pointer)) {
+         $dlogdbg("b_read_find: block found in snapshot '%d' at offset '%td' length '%zu'\n", sni, $$BLP_COMP_OFFSET(pointer), $$BLP_COMP_LENGTH(pointer));
+         *fd = mfd->sn_steps[sni].datfd;
+         *from = $$BLP_COMP_OFFSET(pointer);
+         *complen = $$BLP_COMP_LENGTH(pointer);
+         return 0;
+      }
+
+      if($$BLP_IS_PART(pointer)) {
+         $dlogdbg("b_read_find: page found in snapshot '%d' in block '%td'\n", sni, $$BLP_PART_INDEX(pointer));
+         *fd = mfd->sn_steps[sni].datfd;
+         *from = ($$BLP_PART_INDEX(pointer) << mfd->sn_steps[sni].bl_slog);
+         return 0;
+      }
+
+      $dlogdbg("b_read_find: block found in snapshot '%d' at '%td'\n", sni, pointer - 1);
+      *fd = mfd->sn_steps[sni].datfd;
+      *from = ((pointer - 1) << mfd->sn_steps[sni].bl_slog);
+      return 0;
+
+   }
+
+   return -EIO; // unreachable as the main file is always the last step
+}
+
+
+/** Whether blocks found in a step can be kept in the block cache.
+ * Partially saved blocks in the latest snapshot can still change (see $$BLP_PART).
+ */
+#define $$B_CACHEABLE(fsdata, mfd, sni) ((fsdata)->bcache != NULL && ((sni) > 1 || ((sni) == 1 && !(mfd)->sn_steps[1].pages)))
+
+/** Sets the key of a block in a dat file or the deduplication store for the block cache
+ *
+ * Blocks in the store are cached under the current generation, as slots
+ * freed when a snapshot is removed can be reused (see $bcache_invalidate).
+ * Blocks saved at any offset (see $$BLP_COMP) are identified by their offset,
+ * which is stored as a negative number so that it cannot clash with other pointers.
  */
+static inline void $b_bckey(
+   const struct $fsdata_t *fsdata,
+   const struct $mfd_t *mfd,
+   int sni, /**< the step the block was found in */
+   int fd, /**< the file the block is read from */
+   off_t from, /**< the offset of the saved block in the file */
+   size_t complen, /**< see $b_read_find */
+   struct $bcache_key_t *bckey
+)
+{
+   int slog;
+
+   if(fsdata->dedup != NULL && fd == fsdata->dedup->datfd) {
+      bckey->dev = fsdata->dedup->bckey.dev;
+      bckey->ino = fsdata->dedup->bckey.ino;
+      bckey->gen = __atomic_load_n(&(fsdata->bcache_gen), __ATOMIC_RELAXED);
+      slog = $$BL_SLOG; // slots are $$BL_S apart whatever the blocksize
+   } else {
+      memcpy(bckey, &(mfd->sn_steps[sni].bckey), sizeof(struct $bcache_key_t));
+      slog = mfd->sn_steps[sni].bl_slog;
+   }
+   bckey->pointer = (complen > 0 ? -1 - from : (from >> slog) + 1);
+}
+
+
+/** Reads a block saved at any offset in a dat file (see $$BLP_COMP), and decompresses it if needed
+ *
+ * block must be able to hold blocksize bytes, and scratch complen bytes.
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $b_read_comp(
+   const struct $fsdata_t *fsdata,
+   int fd,
+   off_t from,
+   size_t complen, /**< see $b_read_find */
+   size_t blocksize, /**< the blocksize of the map file the pointer was read from */
+   char *block,
+   char *scratch
+)
+{
+   uLongf length;
+   ssize_t ret;
+
+   if(complen == blocksize) { scratch = block; } // the block is not compressed
+
+   ret = pread(fd, scratch, complen, from);
+   if(unlikely(ret != complen)) {
+      ret = (ret == -1 ? errno : ENXIO);
+      $dlogi("ERROR b_read_comp: pread from file '%d' failed with %d = %s\n", fd, (int)ret, strerror(ret));
+      return -ret;
+   }
+
+   if(complen == blocksize) { return 0; }
+
+   length = blocksize;
+   ret = uncompress((Bytef *)block, &length, (const Bytef *)scratch, complen);
+   if(unlikely(ret != Z_OK || length != blocksize)) {
+      $dlogi("ERROR b_read_comp: uncompress failed with %d, length %lu. Broken FS?\n", (int)ret, (unsigned long)length);
+      return -EIO;
+   }
 
+   return 0;
+}
+
+
+/** Adds the whole blocks in a run read from a dat file or the store to the block cache
+ *
+ * Blocks in the store smaller than its slots are not cached this way.
+ */
+static inline void $b_read_cache_run(
+   struct $fsdata_t *fsdata,
+   const struct $mfd_t *mfd,
+   int sni,
+   int fd, /**< the file the data was read from */
+   const char *data, /**< the data read */
+   off_t from, /**< the offset the data was read from in the file */
+   size_t length
+)
+{
+   struct $bcache_key_t bckey;
+   off_t skip;
+   size_t blocksize;
+
+   blocksize = (1 << mfd->sn_steps[sni].bl_slog);
+   if(fsdata->dedup != NULL && fd == fsdata->dedup->datfd && blocksize != $$BL_S) { return; }
+
+   // Skip to the first block boundary
+   skip = ((from + blocksize - 1) & ~(($$BLP_T)blocksize - 1)) - from;
+   if(skip >= length) { return; }
+   data += skip;
+   from += skip;
+   length -= skip;
+
+   for(; length >= blocksize; data += blocksize, from += blocksize, length -= blocksize) {
+      $b_bckey(fsdata, mfd, sni, fd, from, 0, &bckey);
+      $bcache_put(fsdata, &bckey, data, blocksize);
+   }
+}
 
-#define $$B_CALC_BLOCKS(blockoffset, blocknumber, byteoffset, bytesize) \
-   blockoffset = (byteoffset >> $$BL_SLOG); \
-   blocknumber = ((bytesize + (byteoffset & ($$BL_S - 1)) - 1) >> $$BL_SLOG) + 1;
 
 /** Reads data from a snapshot file
+ *
+ * Consecutive blocks that are stored next to each other in the same file
+ * (typically, unmodified parts of the main file, or blocks saved in order
+ * into a dat file) are read using a single pread.
+ *
+ * Blocks saved in the snapshots are looked up in and added to the block cache
+ * if it is enabled (see bcache.c).
+ *
+ * Compressed blocks are read and decompressed one by one into a buffer from
+ * the buffer pool (see $b_read_comp).
  *
  * Returns:
  * * >=0 - the number of bytes read on success
@@ -97,13 +539,16 @@ static int $b_read(
    off_t readoffset
 )
 {
-   $$BLP_T pointer;
-   off_t blockoffset, mapoffset, copyfrom;
-   size_t blocknumber, copylength;
-   ssize_t copyto;
-   int sni, ret, copyfd;
+   off_t blockoffset, copyfrom, blockfrom, blockinner, runfrom;
+   size_t blocknumber, copylength, runlength, complen;
+   ssize_t copyto, runto;
+   int ret, copyfd, runfd, copysni, runsni;
+   int slog = mfd->sn_bl_slog;
+   struct $bcache_key_t bckey;
+   char *compbuf = NULL;
    int lock = -1;
-   int waserror = 0; // positive on error, or -1 if the block was found
+   off_t lockgroup = 0; // the group of blocks locked (see $b_lock_label)
+   int waserror = 0; // positive on error
 
    $dlogdbg("b_read: begin offset='%zu' size='%td'\n", readoffset, readsize);
    if(readsize == 0) { return 0; }
@@ -124,12 +569,29 @@ static int $b_read(
 #undef $$B_SNSIZE
 
    // See which blocks we need to read
-   $$B_CALC_BLOCKS(blockoffset, blocknumber, readoffset, readsize)
+   $$B_CALC_BLOCKS(blockoffset, blocknumber, readoffset, readsize, slog)
 
    $dlogdbg("b_read: adjusted readoffs='%zu' readsize='%td' blockoffs='%zu' blockno='%td'\n", readoffset, readsize, blockoffset, blocknumber);
 
    copyto = 0;
 
+   // The run of data to be read with a single pread
+   runfd = -1;
+   runsni = 0;
+   runfrom = 0;
+   runto = 0;
+   runlength = 0;
+
+#define $$B_READ_RUN \
+      $dlogdbg("b_read: reading run fd='%d' from='%zu' to='%td' length='%td'\n", runfd, runfrom, runto, runlength); \
+      ret = pread(runfd, buf + runto, runlength, runfrom); \
+      if(unlikely(ret != runlength)) { \
+         waserror = (ret == -1 ? errno : ENXIO); \
+         $dlogi("ERROR pread from file '%d'; ret='%d' err='%s'\n", runfd, ret, strerror(waserror)); \
+         break; \
+      } \
+      if($$B_CACHEABLE(fsdata, mfd, runsni)) { $b_read_cache_run(fsdata, mfd, runsni, runfd, buf + runto, runfrom, runlength); }
+
    for(; blocknumber > 0; blocknumber--, blockoffset++, copyto += copylength) {
 
       // blocknumber -- number of blocks still to read
@@ -141,156 +603,837 @@ static int $b_read(
 
       $dlogdbg("b_read: reading block no='%zu'\n", blockoffset);
 
-      mapoffset = (sizeof(struct $mapheader_t)) + blockoffset * $$BLP_S; // TODO 2 There shouldn't be overflow as blockoffset is off_t
-
-      copylength = $$BL_S;
+      copylength = (1 << slog);
       copyfrom = 0;
       if(copyto == 0) { // if we're reading the first block
          // we initialise copyfrom with the offset from the beginning of the block to the real offset
-         copyfrom = readoffset - (blockoffset << $$BL_SLOG);
+         copyfrom = readoffset - (blockoffset << slog);
          // copylength is then smaller
          copylength -= copyfrom;
-         // $dlogdbg("b_read: first block: readoffset='%zu', blockoffset='%zu', blockoffset**='%zu' -> copyfrom='%zu'\n", readoffset, blockoffset, (blockoffset << $$BL_SLOG), copyfrom);
-         // $dlogdbg("b_read: first block: -> copylength='%td', blocksize='%d'\n", copylength, $$BL_S);
       }
 
       if(blocknumber == 1) { // if this is the last block
          // copylength is smaller again.
          // At this point, blockoffset is already original_blockoffset + blocknumber - 1
-         copylength -= ((blockoffset + 1) << $$BL_SLOG) - readoffset - readsize;
+         copylength -= ((blockoffset + 1) << slog) - readoffset - readsize;
       }
 
-      $dlogdbg("b_read: initial copyfrom='%zu', copylength='%td'\n", copyfrom, copylength);
+      // Only the lock of one group of blocks is held at a time. The run read
+      // while holding the lock of the previous group needs to be read first.
+      if(lock != -1 && ((blockoffset << slog) >> $$LOCK_GROUP_SLOG) != lockgroup) {
+         if(runlength > 0) { $$B_READ_RUN }
+         runlength = 0;
+         $dlogdbg("b_read: Releasing lock %d\n", lock);
+         ret = $mflock_unlock(fsdata, lock);
+         lock = -1;
+         if(unlikely(ret < 0)) {
+            waserror = -ret;
+            $dlogi("ERROR unlock; err %d = %s\n", waserror, strerror(waserror));
+            break;
+         }
+      }
 
       // Now see where we can read the block from
-      for(sni = mfd->sn_first_file; sni >= 0; sni--) {
+      if(unlikely((ret = $b_read_find(fsdata, mfd, blockoffset, &lock, &copyfd, &blockfrom, &blockinner, &copysni, &complen)) != 0)) {
+         waserror = -ret;
+         break;
+      }
+      if(lock != -1) { lockgroup = ((blockoffset << slog) >> $$LOCK_GROUP_SLOG); }
 
-         $dlogdbg("b_read: trying snapshot='%d' = '%s'\n", sni, mfd->sn_steps[sni].path);
+      if(copyfd == $$B_FD_ZERO) {
+         memset(buf + copyto, 0, copylength);
+         continue;
+      }
 
-         do {
+      // Try the block cache
+      if($$B_CACHEABLE(fsdata, mfd, copysni)) {
+         $b_bckey(fsdata, mfd, copysni, copyfd, blockfrom, complen, &bckey);
+         if($bcache_get(fsdata, &bckey, buf + copyto, blockinner + copyfrom, copylength)) {
+            $dlogdbg("b_read: block found in the cache\n");
+            continue;
+         }
+      }
 
-            // Acquire the lock if we're reading the latest snapshot or the main file
-            if(sni <= 1 && lock == -1) {
-               if(unlikely((lock = $mflock_lock(fsdata, mfd->locklabel)) < 0)) {
-                  waserror = -lock;
-                  $dlogi("ERROR getting lock; err %d = %s\n", waserror, strerror(waserror));
-                  break;
-               }
-               $dlogdbg("b_read: Got lock %d\n", lock);
-            }
+      // Blocks saved at any offset are read on their own
+      if(complen > 0) {
+         if(compbuf == NULL && unlikely((compbuf = $bufpool_get(fsdata)) == NULL)) {
+            waserror = ENOMEM;
+            break;
+         }
+         if(unlikely((ret = $b_read_comp(fsdata, copyfd, blockfrom, complen, (1 << mfd->sn_steps[copysni].bl_slog), compbuf, compbuf + $$BL_S)) != 0)) {
+            waserror = -ret;
+            break;
+         }
+         memcpy(buf + copyto, compbuf + blockinner + copyfrom, copylength);
+         if($$B_CACHEABLE(fsdata, mfd, copysni)) { $bcache_put(fsdata, &bckey, compbuf, (1 << mfd->sn_steps[copysni].bl_slog)); }
+         continue;
+      }
 
-            if(sni > 0) { // a snapshot file
+      copyfrom += blockfrom + blockinner;
 
-               if(mfd->sn_steps[sni].mapfd < 0) { break; } // go the next snapshot if there is no map file here
+      $dlogdbg("b_read: final copyfd='%d' copyfrom='%zu' copyto='%td' copylength='%td'\n", copyfd, copyfrom, copyto, copylength);
 
-               ret = pread(mfd->sn_steps[sni].mapfd, &pointer, $$BLP_S, mapoffset);
-               if(unlikely(ret != $$BLP_S && ret != 0)) {
-                  waserror = (ret == -1 ? errno : ENXIO);
-                  $dlogi("ERROR pread on map; ret=%d err=%s\n", ret, strerror(waserror));
-                  break;
-               }
-               if(ret == 0) { pointer = 0; }
-               $dlogdbg("b_read: pointer read from map at mapoffs='%td', ret='%d', pointer='%td'\n", mapoffset, ret, pointer);
+      // Extend the current run if the block follows it in the same file
+      if(runlength > 0 && copyfd == runfd && copyfrom == runfrom + runlength && copyto == runto + runlength) {
+         runlength += copylength;
+         continue;
+      }
 
-               if(pointer == 0) { break; } // go to next snapshot
+      // Otherwise read the current run and start a new one
+      if(runlength > 0) { $$B_READ_RUN }
 
-               $dlogdbg("b_read: block found in snapshot '%d' at '%td'\n", sni, pointer - 1);
-               copyfd = mfd->sn_steps[sni].datfd;
-               copyfrom += ((pointer - 1) << $$BL_SLOG);
+      runfd = copyfd;
+      runsni = copysni;
+      runfrom = copyfrom;
+      runto = copyto;
+      runlength = copylength;
 
-            } else { // we are reading from the main file
+   } // end for block
 
-               $dlogdbg("b_read: reading block from main file\n");
-               copyfd = mfd->sn_steps[sni].datfd;
-               copyfrom += (blockoffset << $$BL_SLOG);
+   // Read the last run
+   if(waserror == 0 && runlength > 0) {
+      do { $$B_READ_RUN } while(0);
+   }
 
-            }
+#undef $$B_READ_RUN
 
-            $dlogdbg("b_read: final copyfrom='%zu' copyto='%td' copylength='%td'\n", copyfrom, copyto, copylength);
+   // Release the lock. We keep it until all the data in its group is read, as
+   // blocks in the latest snapshot or the main file may be in any of the runs.
+   if(lock != -1) {
+      $dlogdbg("b_read: Releasing lock %d\n", lock);
+      if(unlikely((ret = $mflock_unlock(fsdata, lock)) < 0)) {
+         $dlogi("ERROR unlock; err %d = %s\n", -ret, strerror(-ret));
+         if(waserror == 0) { waserror = -ret; }
+      }
+   }
 
-            ret = pread(copyfd, buf + copyto, copylength, copyfrom);
-            if(unlikely(ret != copylength)) {
-               waserror = (ret == -1 ? errno : ENXIO);
-               $dlogi("ERROR pread from file '%d' sni='%d'; ret='%d' err='%s'\n", copyfd, sni, ret, strerror(waserror));
+   if(compbuf != NULL) { $bufpool_put(fsdata, compbuf); }
+
+   if(waserror != 0) { return -waserror; }
+
+   $dlogdbg("b_read: read '%zu' bytes\n", copyto);
+   return (int)copyto;
+}
+
+
+/** Reads blocks of a snapshot file in advance
+ *
+ * Blocks saved in the snapshots are read into the block cache if it is enabled.
+ * Otherwise, and for blocks in the main file, the kernel is asked to
+ * read them into the page cache.
+ * The shared lock of the group of a block is only held while the block is read.
+ * blockoffset and blocknumber are in blocks of mfd->sn_bl_slog (see $b_read).
+ *
+ * buffer must be able to hold two blocks of $$BL_S (see $b_read_comp).
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $b_prefetch(
+   struct $fsdata_t *fsdata,
+   const struct $mfd_t *mfd,
+   off_t blockoffset,
+   size_t blocknumber,
+   char *buffer
+)
+{
+   off_t blockfrom, blockinner;
+   size_t complen, blocksize;
+   ssize_t ret;
+   int fd, sni;
+   int lock;
+   int waserror = 0; // negative on error
+   struct $bcache_key_t bckey;
+
+   for(; blocknumber > 0; blocknumber--, blockoffset++) {
+
+      lock = -1;
+
+      do {
+
+         if(unlikely((ret = $b_read_find(fsdata, mfd, blockoffset, &lock, &fd, &blockfrom, &blockinner, &sni, &complen)) != 0)) {
+            waserror = ret;
+            break;
+         }
+
+         if(fd < 0) { break; } // e.g. the main file does not exist
+
+         if($$B_CACHEABLE(fsdata, mfd, sni)) {
+            blocksize = (1 << mfd->sn_steps[sni].bl_slog);
+            $b_bckey(fsdata, mfd, sni, fd, blockfrom, complen, &bckey);
+            if($bcache_get(fsdata, &bckey, buffer, 0, 0)) { break; } // already cached
+            if(complen > 0) {
+               if((ret = $b_read_comp(fsdata, fd, blockfrom, complen, blocksize, buffer, buffer + $$BL_S)) == 0) { $bcache_put(fsdata, &bckey, buffer, blocksize); }
+               waserror = ret;
+               break;
+            }
+            ret = pread(fd, buffer, blocksize, blockfrom);
+            if(unlikely(ret == -1)) {
+               waserror = -errno;
                break;
             }
+            if(ret == blocksize) { $bcache_put(fsdata, &bckey, buffer, blocksize); }
+            break;
+         }
 
-            // We found the block
-            waserror = -1;
+         if(complen > 0) {
+            ret = posix_fadvise(fd, blockfrom, complen, POSIX_FADV_WILLNEED);
+         } else {
+            ret = posix_fadvise(fd, blockfrom + blockinner, (1 << mfd->sn_bl_slog), POSIX_FADV_WILLNEED);
+         }
+         if(unlikely(ret != 0)) { waserror = -ret; }
 
-         } while(0);
+      } while(0);
 
-         // Continue if we need to, without releasing the lock
-         if(waserror == 0) { // We haven't found the block
-            continue;
+      if(lock != -1) {
+         if(unlikely((ret = $mflock_unlock(fsdata, lock)) < 0)) {
+            $dlogi("ERROR b_prefetch: unlock; err %d = %s\n", (int)-ret, strerror(-ret));
+            if(waserror == 0) { waserror = ret; }
          }
+      }
 
-         // Release the lock
-         if(lock != -1) {
-            $dlogdbg("b_read: Releasing lock %d\n", lock);
-            if(unlikely((lock = $mflock_unlock(fsdata, lock)) < 0)) {
-               $dlogi("ERROR unlock; err %d = %s\n", lock, strerror(lock));
-               return -lock;
-            }
-            lock = -1;
+      if(waserror != 0) {
+         $dlogi("ERROR b_prefetch: failed with %d = %s\n", -waserror, strerror(-waserror));
+         return waserror;
+      }
+
+   }
+
+   return 0;
+}
+
+
+/** Values of fsdata->b_copy_unsupported */
+#define $$B_COPY_NO_CLONE 1
+#define $$B_COPY_NO_RANGE 2
+
+/** Checks whether a buffer only contains zeros
+ *
+ * The loop over machine words can be vectorised by the compiler.
+ */
+static inline int $b_is_zero(const char *buf, size_t length)
+{
+   const unsigned long *words;
+   unsigned long acc;
+   size_t i, n;
+
+   words = (const unsigned long *)buf;
+   n = length / sizeof(unsigned long);
+
+   for(i = 0; i < n; i += 64) {
+      size_t j, m;
+      acc = 0;
+      m = (n - i < 64 ? n - i : 64);
+      for(j = 0; j < m; j++) { acc |= words[i + j]; }
+      if(acc != 0) { return 0; }
+   }
+
+   for(i = n * sizeof(unsigned long); i < length; i++) {
+      if(buf[i] != 0) { return 0; }
+   }
+
+   return 1;
+}
+
+
+/** Makes sure that the dat file of a main MFD extends at least to end
+ *
+ * As other threads may be appending to the dat file (see $mfd_dat_reserve),
+ * it cannot be extended using ftruncate, which could also shrink it.
+ * Instead, the last byte is written; the rest of the space is left as a hole.
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static inline int $b_dat_extend(const struct $mfd_t *mfd, off_t end)
+{
+   ssize_t ret;
+
+   ret = pwrite(mfd->datfd, "", 1, end - 1);
+   if(unlikely(ret != 1)) { return (ret == -1 ? -errno : -ENXIO); }
+   return 0;
+}
+
+
+/** Checks whether a run of blocks in the main file may contain a block with zeros only
+ *
+ * Only the first word of each block is read, and the last one if the first is 0,
+ * so that the blocks can be copied in the kernel without reading them, while
+ * zero blocks are still detected by $b_save_data_run.
+ *
+ * Returns:
+ * * 1 - if a block may only contain zeros, or on error
+ * * 0 - if every block contains data
+ */
+static inline int $b_run_may_be_zero(const struct $mfd_t *mfd, int slog, off_t blockoffset, size_t blocknumber)
+{
+   uint64_t word;
+   size_t i;
+
+   for(i = 0; i < blocknumber; i++) {
+      word = 0;
+      if(pread(mfd->mainfd, &word, sizeof(word), ((blockoffset + i) << slog)) == sizeof(word) && word != 0) { continue; }
+      word = 0;
+      if(pread(mfd->mainfd, &word, sizeof(word), ((blockoffset + i + 1) << slog) - sizeof(word)) == sizeof(word) && word != 0) { continue; }
+      return 1;
+   }
+   return 0;
+}
+
+
+/** Copies blocks from the main file to the end of the dat file in the kernel
+ *
+ * We try to clone the blocks (reflink) first, which only needs to update
+ * metadata on filesystems like btrfs and XFS, then copy_file_range, which
+ * at least avoids copying the data through user space.
+ * If a method turns out not to be supported by the underlying filesystem,
+ * it is not tried again (see fsdata->b_copy_unsupported).
+ * Runs that may contain zero blocks are not copied (see $b_run_may_be_zero),
+ * so that $$BLP_ZERO can be saved for them.
+ *
+ * If *datsize is -1, space for the blocks is reserved in the dat file once
+ * they are known to contain data, and *datsize is set. If the copy fails,
+ * the blocks can be written into this space using a buffer.
+ * The dat file is always extended to full blocks.
+ *
+ * Returns:
+ * * 1 - if the blocks have been copied
+ * * 0 - if the blocks need to be copied using a buffer
+ * * -errno - on error
+ */
+static inline int $b_copy_run(struct $fsdata_t *fsdata, const struct $mfd_t *mfd, int slog, off_t blockoffset, size_t blocknumber, off_t *datsize)
+{
+   struct stat mystat;
+   off_t from;
+   size_t length;
+   ssize_t ret;
+   int unsupported;
+
+   unsupported = __atomic_load_n(&(fsdata->b_copy_unsupported), __ATOMIC_RELAXED);
+   if((unsupported & ($$B_COPY_NO_CLONE | $$B_COPY_NO_RANGE)) == ($$B_COPY_NO_CLONE | $$B_COPY_NO_RANGE)) { return 0; }
+
+   // Get how much data there is in the blocks
+   if(unlikely(fstat(mfd->mainfd, &mystat) != 0)) { return -errno; }
+   from = (blockoffset << slog);
+   if(mystat.st_size <= from) { return 0; }
+   length = (blocknumber << slog);
+   if(mystat.st_size - from < length) { length = mystat.st_size - from; }
+
+   if($b_run_may_be_zero(mfd, slog, blockoffset, blocknumber)) { return 0; }
+
+   if(*datsize == -1) { *datsize = $mfd_dat_reserve(fsdata, mfd, (blocknumber << slog)); }
+
+#ifdef FICLONERANGE
+   if(!(unsupported & $$B_COPY_NO_CLONE)) {
+      struct file_clone_range range;
+
+      range.src_fd = mfd->mainfd;
+      range.src_offset = from;
+      range.src_length = length;
+      range.dest_offset = *datsize;
+      if(ioctl(mfd->datfd, FICLONERANGE, &range) == 0) {
+         $dlogdbg("b_copy_run: cloned %zu blocks\n", blocknumber);
+         if(length == (blocknumber << slog) || $b_dat_extend(mfd, *datsize + (blocknumber << slog)) == 0) { return 1; }
+      }
+      ret = errno;
+      if(ret == EOPNOTSUPP || ret == ENOTTY || ret == EXDEV || ret == ENOSYS) {
+         $dlogi("b_copy_run: cloning is not supported (%d = %s)\n", (int)ret, strerror(ret));
+         __atomic_or_fetch(&(fsdata->b_copy_unsupported), $$B_COPY_NO_CLONE, __ATOMIC_RELAXED);
+      }
+   }
+#endif
+
+   if(!(unsupported & $$B_COPY_NO_RANGE)) {
+      loff_t off_in, off_out;
+      size_t done = 0;
+
+      off_in = from;
+      off_out = *datsize;
+      ret = 0;
+      while(done < length) {
+         ret = copy_file_range(mfd->mainfd, &off_in, mfd->datfd, &off_out, length - done, 0);
+         if(ret <= 0) { break; }
+         done += ret;
+      }
+      if(done == length) {
+         $dlogdbg("b_copy_run: copied %zu blocks\n", blocknumber);
+         if(length == (blocknumber << slog) || $b_dat_extend(mfd, *datsize + (blocknumber << slog)) == 0) { return 1; }
+      }
+      if(ret == -1) {
+         ret = errno;
+         if(ret == EOPNOTSUPP || ret == EXDEV || ret == ENOSYS || ret == EINVAL) {
+            $dlogi("b_copy_run: copy_file_range is not supported (%d = %s)\n", (int)ret, strerror(ret));
+            __atomic_or_fetch(&(fsdata->b_copy_unsupported), $$B_COPY_NO_RANGE, __ATOMIC_RELAXED);
          }
+      }
+   }
 
-         // In case of an error
-         if(waserror > 0) { return -waserror; }
+   return 0;
+}
 
-         // We've found the block -- no need to look further
-         // if(waserror == -1) {
-         waserror = 0;
-         break;
 
-      } // end for sni
+/** Finds holes in a run of blocks in the main file
+ *
+ * Sets:
+ * * *holes - the number of blocks at the start of the run that are holes
+ *
+ * Returns the number of blocks following these that contain data
+ * (all of them if holes cannot be detected).
+ */
+static inline size_t $b_find_data(int fd, int slog, off_t blockoffset, size_t blocknumber, size_t *holes)
+{
+   off_t start, data, hole;
+   size_t skip, n;
+
+   start = (blockoffset << slog);
+   data = lseek(fd, start, SEEK_DATA);
+   if(data == -1) {
+      if(errno == ENXIO) { // no data after start
+         *holes = blocknumber;
+         return 0;
+      }
+      *holes = 0;
+      return blocknumber;
+   }
 
-   } // end for block
+   skip = ((data - start) >> slog);
+   if(skip >= blocknumber) {
+      *holes = blocknumber;
+      return 0;
+   }
+   *holes = skip;
 
-   $dlogdbg("b_read: read '%zu' bytes\n", copyto);
-   return (int)copyto;
+   hole = lseek(fd, data, SEEK_HOLE);
+   if(hole == -1) { return blocknumber - skip; }
+
+   // Blocks partially containing data need to be saved
+   n = ((hole - start + (1 << slog) - 1) >> slog) - skip;
+   if(n < 1) { n = 1; }
+   if(n > blocknumber - skip) { n = blocknumber - skip; }
+   return n;
 }
 
 
-/** Initialiases the global block buffer in fsdata
+/** Appends a run of blocks containing data from the main file to the dat file
+ *
+ * If the blocks cannot be copied in the kernel (see $b_copy_run), they are read
+ * using a single pread, and the ones that do not only contain zeros are appended
+ * using a single pwritev, or saved in the deduplication store if it is used.
+ * If the map file is $$MAP_COMPRESSED, the blocks are compressed first.
+ * Should be called with the lock of the group of the blocks held (see $b_lock_label).
+ *
+ * *buf and *compbuf must be NULL or point to a buffer of $$B_WRITE_RUN blocks,
+ * and are got from the buffer pool if needed (see bufpool.c).
+ * slog is the blocksize of the map file (see $$MAP_BL_SLOG).
+ *
+ * Sets:
+ * * pointers[0..blocknumber-1] - the pointers to save in the map file
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
  */
-static inline int $b_init_block_buffer(struct $fsdata_t *fsdata)
+static inline int $b_save_data_run(
+   struct $fsdata_t *fsdata,
+   const struct $mfd_t *mfd,
+   int slog,
+   off_t blockoffset,
+   size_t blocknumber,
+   $$BLP_T *pointers,
+   char **buf,
+   char **compbuf
+)
 {
-   fsdata->block_buffer = malloc($$BL_S);
-   if(unlikely(fsdata->block_buffer == NULL)) {
-      return -ENOMEM;
+   struct iovec iov[$$B_WRITE_RUN];
+   size_t idx[$$B_WRITE_RUN]; // the block saved from each iov
+   off_t datsize, at;
+   ssize_t ret;
+   size_t i, n, length;
+   size_t blocksize = (1 << slog);
+   size_t written = 0; // the number of bytes to append
+   uLongf complen;
+   int compressed;
+
+   compressed = $$MAP_HAS_FLAG(&(mfd->mapheader), $$MAP_COMPRESSED);
+
+   // Try to make the kernel copy the blocks, unless they need to be deduplicated or compressed.
+   // This reserves space for them at the end of the dat file.
+   ret = 0;
+   datsize = -1;
+   if((fsdata->dedup == NULL || fsdata->dedup->write == 0) && !compressed) {
+      ret = $b_copy_run(fsdata, mfd, slog, blockoffset, blocknumber, &datsize);
+   }
+   if(unlikely(ret < 0)) { return ret; }
+   if(ret == 1) {
+      for(i = 0; i < blocknumber; i++) { pointers[i] = (datsize >> slog) + 1 + i; } // We save pointer+1 in the map
+      return 0;
+   }
+
+   // We need to copy the blocks ourselves
+   if(*buf == NULL) {
+      *buf = $bufpool_get(fsdata);
+      if(unlikely(*buf == NULL)) { return -ENOMEM; }
+   }
+
+   // Read the old blocks from the main file
+   ret = pread(mfd->mainfd, *buf, (blocknumber << slog), (blockoffset << slog)); // TODO check all left shifts for potential overflow. Here, blockoffset is off_t
+   if(unlikely(ret == -1)) {
+      ret = errno;
+      $dlogi("ERROR pread from main file FD %d count %zu offset %td; err %d = %s\n", mfd->mainfd, (blocknumber << slog), (blockoffset << slog), (int)ret, strerror(ret));
+      return -ret;
+   }
+   $dlogdbg("b_save_data_run: read old blocks from offs='%td' size='%zd' fd='%d'\n", (blockoffset << slog), ret, mfd->mainfd);
+
+   // Clear the rest of the last block if the main file ends in it
+   length = ret;
+   if((length & (blocksize - 1)) != 0) {
+      memset(*buf + length, 0, blocksize - (length & (blocksize - 1)));
+   }
+
+   // Don't store blocks with zeros only (or beyond the end of the main file)
+   for(i = 0, n = 0; i < blocknumber; i++) {
+      if((i << slog) >= length || $b_is_zero(*buf + (i << slog), blocksize)) {
+         pointers[i] = $$BLP_ZERO;
+         continue;
+      }
+      if(fsdata->dedup != NULL && fsdata->dedup->write != 0) {
+         if(unlikely((ret = $dedup_store(fsdata, *buf + (i << slog), blocksize, &(pointers[i]))) != 0)) { return ret; }
+         continue;
+      }
+      idx[n] = i;
+      iov[n].iov_base = *buf + (i << slog);
+      iov[n].iov_len = blocksize;
+      if(compressed) {
+         if(*compbuf == NULL) {
+            *compbuf = $bufpool_get(fsdata);
+            if(unlikely(*compbuf == NULL)) { return -ENOMEM; }
+         }
+         // Only keep the compressed block if it is smaller. As compressed blocks
+         // are shorter than the blocksize, they always fit into compbuf.
+         complen = blocksize - 1;
+         if(compress2((Bytef *)(*compbuf + written), &complen, (const Bytef *)iov[n].iov_base, blocksize, Z_BEST_SPEED) == Z_OK) {
+            iov[n].iov_base = *compbuf + written;
+            iov[n].iov_len = complen;
+         }
+      }
+      written += iov[n].iov_len;
+      n++;
+   }
+
+   if(n == 0) { return 0; }
+
+   // Reserve space at the end of the dat file unless it has been reserved above.
+   // Other threads may be appending to it at the same time.
+   if(datsize == -1) { datsize = $mfd_dat_reserve(fsdata, mfd, written); }
+
+   // Sanity check: blocks should be aligned in the dat file
+   if(unlikely(!compressed && (datsize & (blocksize - 1)) != 0)) {
+      $dlogi("ERROR Size of dat file (%td) is not divisible by block size (%zu = 2^%d) for main FD '%d', path '%s'; datfd '%d'.\n", datsize, blocksize, slog, mfd->mainfd, mfd->vpath, mfd->datfd);
+      return -EFAULT;
+   }
+
+   for(i = 0, at = datsize; i < n; at += iov[i].iov_len, i++) {
+      if(compressed) {
+         if(unlikely(at + iov[i].iov_len > $$BLP_COMP_MAXOFFSET)) { return -EFBIG; }
+         pointers[idx[i]] = $$BLP_COMP(at, iov[i].iov_len);
+      } else {
+         pointers[idx[i]] = (at >> slog) + 1; // We save pointer+1 in the map
+      }
+   }
+
+   // Write into the space reserved
+   ret = pwritev(mfd->datfd, iov, n, datsize);
+   if(unlikely(ret != written)) {
+      ret = (ret == -1 ? errno : ENXIO);
+      $dlogi("ERROR write into .dat for main file FD %d, err %d = %s\n", mfd->mainfd, (int)ret, strerror(ret));
+      return -ret;
+   }
+   $dlogdbg("b_save_data_run: appended %zu blocks (%zu bytes) to fd '%d' for main fd '%d'\n", n, written, mfd->datfd, mfd->mainfd);
+
+   return 0;
+}
+
+
+/** Saves the blocks in a run that have not been saved yet
+ *
+ * Blocks that are holes in the main file are not stored in the dat file;
+ * their pointer will be $$BLP_ZERO.
+ * Should be called with the lock of the group of the blocks held (see $b_lock_label).
+ *
+ * Sets:
+ * * pointers[i] - for each block with pointers[i] == 0 when called
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static inline int $b_save_run(
+   struct $fsdata_t *fsdata,
+   const struct $mfd_t *mfd,
+   int slog, /**< see $b_save_data_run */
+   off_t blockoffset,
+   size_t blocknumber,
+   $$BLP_T *pointers,
+   char **buf, /**< see $b_save_data_run */
+   char **compbuf /**< see $b_save_data_run */
+)
+{
+   size_t i, j, holes, n;
+   int ret;
+
+   for(i = 0; i < blocknumber; ) {
+
+      if(pointers[i] != 0) { // already saved
+         i++;
+         continue;
+      }
+
+      // Find the end of the blocks to save
+      for(j = i + 1; j < blocknumber && pointers[j] == 0; j++) { }
+
+      // Save the blocks, skipping holes
+      while(i < j) {
+         n = $b_find_data(mfd->mainfd, slog, blockoffset + i, j - i, &holes);
+         $dlogdbg("b_save_run: block '%zu': holes='%zu' data='%zu'\n", blockoffset + i, holes, n);
+         for(; holes > 0; holes--, i++) { pointers[i] = $$BLP_ZERO; }
+         if(n > 0) {
+            if(unlikely((ret = $b_save_data_run(fsdata, mfd, slog, blockoffset + i, n, pointers + i, buf, compbuf)) != 0)) { return ret; }
+            i += n;
+         }
+      }
+
    }
+
    return 0;
 }
 
 
-/** Releases the global block buffer in fsdata
+/** Returns the bitmap of the pages of a block overlapping a range of bytes (see $$BLP_PART)
  */
-static inline int $b_destroy_block_buffer(struct $fsdata_t *fsdata)
+static inline uint32_t $b_page_mask(int slog, off_t blockoffset, off_t offset, size_t size)
 {
-   free(fsdata->block_buffer);
+   off_t from, to;
+
+   from = offset - (blockoffset << slog);
+   if(from < 0) { from = 0; }
+   to = offset + size - (blockoffset << slog);
+   if(to > (1 << slog)) { to = (1 << slog); }
+   if(to <= from) { return 0; }
+
+   from >>= $$BL_PAGE_SLOG;
+   to = ((to - 1) >> $$BL_PAGE_SLOG);
+   return (((uint32_t)2 << to) - 1) & ~(((uint32_t)1 << from) - 1);
+}
+
+
+/** Saves the pages of a block that are about to be overwritten
+ *
+ * If the block has not been saved yet, a whole block is reserved at the end
+ * of the dat file, but only the pages needed are written into it. If it has been
+ * partially saved, the pages still missing are written into the reserved block.
+ * Pages that only contain zeros are left as holes.
+ * Should be called with the lock of the group of the blocks held (see $b_lock_label).
+ *
+ * Sets:
+ * * *pointer - the pointer to save in the map file; a normal pointer once all the pages have been saved
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static inline int $b_save_pages(
+   struct $fsdata_t *fsdata,
+   const struct $mfd_t *mfd,
+   int slog, /**< see $b_save_data_run */
+   off_t blockoffset,
+   uint32_t need, /**< the pages to save */
+   uint32_t full, /**< the pages of the block inside the file */
+   $$BLP_T *pointer,
+   char **buf /**< see $b_save_data_run */
+)
+{
+   off_t datsize, blockfrom;
+   uint32_t mask;
+   size_t length;
+   ssize_t ret;
+   int first, last;
+
+   if(*pointer == 0) {
+
+      // Reserve a block at the end of the dat file
+      datsize = $mfd_dat_reserve(fsdata, mfd, (1 << slog));
+      if(unlikely((datsize & ((1 << slog) - 1)) != 0)) {
+         $dlogi("ERROR b_save_pages: Size of dat file (%td) is not divisible by block size for main FD '%d'\n", datsize, mfd->mainfd);
+         return -EFAULT;
+      }
+      if(unlikely((datsize >> slog) >= $$BLP_PART_MAXINDEX)) { return -EFBIG; }
+      if(unlikely((ret = $b_dat_extend(mfd, datsize + (1 << slog))) != 0)) {
+         $dlogi("ERROR b_save_pages: extending dat for main file FD %d, err %d = %s\n", mfd->mainfd, (int)-ret, strerror(-ret));
+         return ret;
+      }
+      *pointer = $$BLP_PART(datsize >> slog, 0);
+
+   }
+
+   mask = $$BLP_PART_MASK(*pointer);
+   blockfrom = ($$BLP_PART_INDEX(*pointer) << slog);
+   need &= ~mask;
+
+   if(need != 0 && *buf == NULL) {
+      *buf = $bufpool_get(fsdata);
+      if(unlikely(*buf == NULL)) { return -ENOMEM; }
+   }
+
+   // Copy each run of pages needed
+   for(first = 0; first < 32 && (need >> first) != 0; first = last) {
+
+      if(!(need & ((uint32_t)1 << first))) {
+         last = first + 1;
+         continue;
+      }
+      for(last = first + 1; last < 32 && (need & ((uint32_t)1 << last)); last++) { }
+      length = ((size_t)(last - first) << $$BL_PAGE_SLOG);
+
+      ret = pread(mfd->mainfd, *buf, length, (blockoffset << slog) + ((off_t)first << $$BL_PAGE_SLOG));
+      if(unlikely(ret == -1)) {
+         ret = errno;
+         $dlogi("ERROR b_save_pages: pread from main file FD %d, err %d = %s\n", mfd->mainfd, (int)ret, strerror(ret));
+         return -ret;
+      }
+      if(ret < length) { memset(*buf + ret, 0, length - ret); }
+
+      if($b_is_zero(*buf, length)) { continue; }
+
+      ret = pwrite(mfd->datfd, *buf, length, blockfrom + ((off_t)first << $$BL_PAGE_SLOG));
+      if(unlikely(ret != length)) {
+         ret = (ret == -1 ? errno : ENXIO);
+         $dlogi("ERROR b_save_pages: write into .dat for main file FD %d, err %d = %s\n", mfd->mainfd, (int)ret, strerror(ret));
+         return -ret;
+      }
+
+   }
+
+   mask |= need;
+   $dlogdbg("b_save_pages: block '%td' saved pages '%x' of '%x'\n", blockoffset, mask, full);
+   if((mask & full) == full) {
+      *pointer = $$BLP_PART_INDEX(*pointer) + 1; // We save pointer+1 in the map
+   } else {
+      *pointer = $$BLP_PART($$BLP_PART_INDEX(*pointer), mask);
+   }
+
    return 0;
 }
 
 
-#define $$BLOCK_READ_POINTER \
-      ret = pread(mfd->mapfd, &pointer, $$BLP_S, mapoffset); \
-      if(unlikely(ret != $$BLP_S && ret != 0)){ \
-         waserror = (ret==-1 ? errno : ENXIO); \
-         $dlogdbg("Error: pread on .map for main file FD %d, map FD %d, err (%d) %d = %s\n", mfd->mainfd, mfd->mapfd, ret, waserror, strerror(waserror)); \
-         break; \
-      } \
-      if(ret == 0){ pointer = 0; } \
-      $dlogdbg("b_write: Read %zu as pointer from fd %d offs %td for main FD %d\n", pointer, mfd->mapfd, mapoffset, mfd->mainfd);
+/** Number of pointers to read from the map file at once when loading the saved-block bitmap */
+#define $$B_SAVED_CHUNK 512
+
+/** The number of words needed for a bitmap of n bits */
+#define $$B_BITMAP_WORDS(n) (((n) + 8 * sizeof(unsigned long) - 1) / (8 * sizeof(unsigned long)))
+#define $$B_BITMAP_WORD(i) ((i) / (8 * sizeof(unsigned long)))
+#define $$B_BITMAP_BIT(i) (1UL << ((i) % (8 * sizeof(unsigned long))))
+
+/** Checks whether a block of a main file is known to have been saved in the latest snapshot
+ *
+ * Each writable mfd has a bitmap of the blocks saved (mfd->saved_map), so that
+ * most writes do not need to read the map file. It is allocated when first needed,
+ * and the bits are loaded from the map file $$B_SAVED_CHUNK pointers at a time.
+ * The allocation covers the blocks of the file when the snapshot was taken,
+ * followed by a bitmap of the chunks already loaded.
+ * As writes to the same mfd may run in parallel, the bitmaps are only
+ * modified using atomic operations, and bits are only ever set.
+ * The bitmap is freed by $mfd_close_sn, so it is reset when $mfd_validate
+ * reinitialises the mfd after a new snapshot. Callers must keep that from
+ * happening while they use the bitmap: writes hold the mfd with $mfd_sn_hold,
+ * and the delta store uses its mfd holding the lock of the delta file.
+ *
+ * Returns:
+ * * 1 - if the block has been saved
+ * * 0 - if the block may not have been saved, and the map file needs to be checked
+ * * -errno - on error
+ */
+static inline int $b_saved_get(struct $fsdata_t *fsdata, struct $mfd_t *mfd, off_t blockoffset)
+{
+   unsigned long *map;
+   unsigned long *loaded;
+   unsigned long *newmap;
+   $$BLP_T pointers[$$B_SAVED_CHUNK];
+   off_t blocks, chunkstart;
+   size_t chunklen, i;
+   ssize_t ret;
+   int slog;
+
+   slog = $$MAP_BL_SLOG(&(mfd->mapheader));
+   blocks = ((mfd->mapheader.fstat.st_size + (1 << slog) - 1) >> slog);
+   if(blockoffset >= blocks) { return 0; }
+
+   map = __atomic_load_n(&(mfd->saved_map), __ATOMIC_ACQUIRE);
+   if(map == NULL) {
+      newmap = calloc($$B_BITMAP_WORDS(blocks) + $$B_BITMAP_WORDS(blocks / $$B_SAVED_CHUNK + 1), sizeof(unsigned long));
+      if(newmap == NULL) { return 0; } // we can do without it
+      if(__sync_bool_compare_and_swap(&(mfd->saved_map), NULL, newmap)) {
+         map = newmap;
+      } else { // another thread was faster
+         free(newmap);
+         map = __atomic_load_n(&(mfd->saved_map), __ATOMIC_ACQUIRE);
+      }
+   }
+   loaded = map + $$B_BITMAP_WORDS(blocks);
+
+   i = blockoffset / $$B_SAVED_CHUNK;
+   if(!(__atomic_load_n(&(loaded[$$B_BITMAP_WORD(i)]), __ATOMIC_ACQUIRE) & $$B_BITMAP_BIT(i))) {
+
+      // Load the pointers in this chunk from the map file.
+      // If another thread saves a block in the meantime, it sets its bit itself.
+      chunkstart = i * $$B_SAVED_CHUNK;
+      chunklen = $$B_SAVED_CHUNK;
+      if(chunkstart + chunklen > blocks) { chunklen = blocks - chunkstart; }
+
+      ret = pread(mfd->mapfd, pointers, chunklen * $$BLP_S, sizeof(struct $mapheader_t) + chunkstart * $$BLP_S);
+      if(unlikely(ret == -1)) {
+         ret = errno;
+         $dlogi("ERROR b_saved_get: pread on map failed with %d = %s\n", (int)ret, strerror(ret));
+         return -ret;
+      }
+      if(unlikely(ret % $$BLP_S != 0)) { return -ENXIO; }
+
+      for(chunklen = ret / $$BLP_S; chunklen > 0; chunklen--) {
+         if(pointers[chunklen - 1] != 0 && !$$BLP_IS_PART(pointers[chunklen - 1])) {
+            __atomic_or_fetch(&(map[$$B_BITMAP_WORD(chunkstart + chunklen - 1)]), $$B_BITMAP_BIT(chunkstart + chunklen - 1), __ATOMIC_RELEASE);
+         }
+      }
+
+      __atomic_or_fetch(&(loaded[$$B_BITMAP_WORD(i)]), $$B_BITMAP_BIT(i), __ATOMIC_RELEASE);
+   }
+
+   return ((__atomic_load_n(&(map[$$B_BITMAP_WORD(blockoffset)]), __ATOMIC_ACQUIRE) & $$B_BITMAP_BIT(blockoffset)) != 0);
+}
+
+
+/** Marks a block as saved in the saved-block bitmap of an mfd (see $b_saved_get)
+ */
+static inline void $b_saved_set(struct $mfd_t *mfd, off_t blockoffset)
+{
+   unsigned long *map;
+   int slog;
+
+   map = __atomic_load_n(&(mfd->saved_map), __ATOMIC_ACQUIRE);
+   if(map == NULL) { return; }
+   slog = $$MAP_BL_SLOG(&(mfd->mapheader));
+   if(blockoffset >= ((mfd->mapheader.fstat.st_size + (1 << slog) - 1) >> slog)) { return; }
+   __atomic_or_fetch(&(map[$$B_BITMAP_WORD(blockoffset)]), $$B_BITMAP_BIT(blockoffset), __ATOMIC_RELEASE);
+}
 
 
 #define $$B_WRITE_DEFAULTS 0
-#define $$B_WRITE_HAS_LOCK 1
 
 /** Saves the overwritten part of a file
  *
- * Flags:
- * * $$B_WRITE_HAS_LOCK -- the lock has already been acquired & don't release it
+ * The blocks are saved in runs that do not cross groups of blocks locked
+ * together, and only the lock of the group of the current run is held
+ * (see $b_lock_label).
  *
  * Returns:
  * * 0 - on success
@@ -301,23 +1444,32 @@ static inline int $b_write(
    struct $mfd_t *mfd,
    size_t writesize,
    off_t writeoffset,
-   int flags /**< $$B_WRITE_DEFAULTS or $$B_WRITE_HAS_LOCK */
+   int flags /**< $$B_WRITE_DEFAULTS */
 )
 {
-   $$BLP_T pointer;
+   $$BLP_T pointers[$$B_WRITE_RUN];
    off_t mapoffset;
-   off_t datsize;
    int waserror = 0;
    int lock = -1;
+   off_t lockgroup = 0; // the group of blocks locked
+   off_t groupend; // the first block of the next group
    char *buf = NULL;
+   char *compbuf = NULL;
    off_t blockoffset; // starting number of blocks written
    size_t blocknumber; // number of blocks written
-   int ret;
+   size_t runlength; // number of blocks in the current run
+   size_t i;
+   ssize_t ret;
+   int slog; // the blocksize of the map file
+   int pages; // whether new blocks can be partially saved
+   int changed;
+   uint32_t need, full;
 
    // Nothing to do if the main file is read-only or there are no snapshots or the file was empty in the snapshot
    if(mfd->datfd < 0 || writesize == 0) { return 0; }
 
-   if(flags & $$B_WRITE_HAS_LOCK) { lock = -2; }
+   // or the whole file has already been moved into the snapshot
+   if($$MAP_HAS_FLAG(&(mfd->mapheader), $$MAP_WHOLE)) { return 0; }
 
    $dlogdbg("b_write: woffset='%zu' wsize='%td' filesize_in_sn='%zu'\n", writeoffset, writesize, mfd->mapheader.fstat.st_size);
 
@@ -335,133 +1487,142 @@ static inline int $b_write(
 #undef $$B_SNSIZE
 
    // See which blocks we need to write
-   $$B_CALC_BLOCKS(blockoffset, blocknumber, writeoffset, writesize)
+   slog = $$MAP_BL_SLOG(&(mfd->mapheader));
+   $$B_CALC_BLOCKS(blockoffset, blocknumber, writeoffset, writesize, slog)
+
+   // Blocks in the store are always saved whole
+   pages = ($$MAP_HAS_FLAG(&(mfd->mapheader), $$MAP_PAGES) && (fsdata->dedup == NULL || fsdata->dedup->write == 0));
 
    // We cannot use %m$ here because additional data is added later
-   $dlogdbg("b_write: blockoffs='%zu'=o'%zo' woffset='%zu'=o'%zo' blockno='%td'=o'%to' wsize='%td'=o'%to' :: blocksize='%d'=o'%o' log='%d'\n", blockoffset, blockoffset, writeoffset, writeoffset, blocknumber, blocknumber, writesize, writesize, $$BL_S, $$BL_S, $$BL_SLOG);
+   $dlogdbg("b_write: blockoffs='%zu'=o'%zo' woffset='%zu'=o'%zo' blockno='%td'=o'%to' wsize='%td'=o'%to' :: blocksize='%d'=o'%o' log='%d'\n", blockoffset, blockoffset, writeoffset, writeoffset, blocknumber, blocknumber, writesize, writesize, (1 << slog), (1 << slog), slog);
 
-   for(; blocknumber > 0; blocknumber--, blockoffset++) {
+   for(; blocknumber > 0; blocknumber -= runlength, blockoffset += runlength) {
+
+      // ============== RUN LOOP =================
 
-      // ============== BLOCK LOOP =================
+      $dlogdbg("b_write: processing block no '%zu' from main FD '%d'\n", blockoffset, mfd->mainfd);
 
-      $dlogdbg("b_write: processing block no '%zu' from main FD '%d' (cache %zu)\n", blockoffset, mfd->mainfd, mfd->latest_written_block_cache);
+      runlength = 1;
 
-      // Check the cache to see if this block is already saved
-      if(mfd->latest_written_block_cache == blockoffset + 1) {
-         $dlogdbg("b_write: written block cache hit\n");
+      // Check the bitmap to see if this block is already saved.
+      // If it is not, we still need to read the pointer from the map file to be sure.
+      ret = $b_saved_get(fsdata, mfd, blockoffset);
+      if(unlikely(ret < 0)) {
+         waserror = -ret;
+         break;
+      }
+      if(ret == 1) {
+         $dlogdbg("b_write: saved block bitmap hit\n");
          continue; // We don't need to save again, so go to the next block
       }
 
-      mapoffset = (sizeof(struct $mapheader_t)) + blockoffset * $$BLP_S; // TODO 2 There shouldn't be overflow as blockoffset is off_t
-
-      // Read the pointer from the map file.
-      // This may not be the final pointer if we haven't got the lock, but if it's already non-0, we
-      // save ourselves the trouble of getting the lock.
-      $$BLOCK_READ_POINTER
-
-      if(pointer != 0) {
-         mfd->latest_written_block_cache = blockoffset + 1; // Cache that this block has been saved
-         continue; // We don't need to save again, so go to next block
+      // Collect the following blocks in the same group that may need to be saved,
+      // so that they can be saved together
+      groupend = ((blockoffset >> ($$LOCK_GROUP_SLOG - slog)) + 1) << ($$LOCK_GROUP_SLOG - slog);
+      while(runlength < blocknumber && runlength < $$B_WRITE_RUN && blockoffset + runlength < groupend) {
+         if($b_saved_get(fsdata, mfd, blockoffset + runlength) != 0) { break; }
+         runlength++;
       }
 
-      // Read the pointer from the map file - for real.
+      mapoffset = (sizeof(struct $mapheader_t)) + blockoffset * $$BLP_S; // TODO 2 There shouldn't be overflow as blockoffset is off_t
+
+      // Read the pointers from the map file - for real.
       // For this to work correctly, we need to make sure that the underlying FS is POSIX conforming,
       // and that any write has returned on this file (see the quote above).
       // It seems we can only be sure that we're reading the new value then.
-      // So we lock here.
-      if(lock == -1) { // If we already have the lock, the first read was for real.
+      // So we lock here, releasing the lock of the previous group if needed.
+      if(lock != -1 && (blockoffset >> ($$LOCK_GROUP_SLOG - slog)) != lockgroup) {
+         $dlogdbg("b_write: Releasing lock %d for main file FD %d\n", lock, mfd->mainfd);
+         ret = $mflock_unlock(fsdata, lock);
+         lock = -1;
+         if(unlikely(ret < 0)) {
+            waserror = -ret;
+            $dlogi("ERROR unlock for main file FD %d, err %d = %s\n", mfd->mainfd, waserror, strerror(waserror));
+            break;
+         }
+      }
+      if(lock == -1) {
 
          $dlogdbg("b_write: Getting lock...\n");
-         if(unlikely((lock = $mflock_lock(fsdata, mfd->locklabel)) < 0)) {
+         lockgroup = (blockoffset >> ($$LOCK_GROUP_SLOG - slog));
+         if(unlikely((lock = $mflock_lock(fsdata, $b_lock_label(mfd, blockoffset << slog))) < 0)) {
             waserror = -lock;
             $dlogi("ERROR lock for main file FD %d; err %d = %s\n", mfd->mainfd, waserror, strerror(waserror));
+            lock = -1;
             break;
          }
          $dlogdbg("b_write: Got lock %d for main file FD %d\n", lock, mfd->mainfd);
 
-
-         // Read the pointer from the map file
-         $$BLOCK_READ_POINTER
-
-         if(pointer != 0) { continue; } // We don't need to save
-
-      }
-
-      // We need to save the block
-      // TODO implement a list of buffers various threads can lock and use
-      if(buf == NULL) { // only allocate once in the loop
-         if(lock == 0) { // If lock==0, use the global block buffer to save malloc/free
-            $dlogdbg("b_write: Using global block buffer\n");
-            buf = fsdata->block_buffer;
-         } else {
-            buf = malloc($$BL_S);
-            if(unlikely(buf == NULL)) {
-               waserror = ENOMEM;
-               break;
-            }
-         }
       }
 
-      // Read the old block from the main file
-      ret = pread(mfd->mainfd, buf, $$BL_S, (blockoffset << $$BL_SLOG)); // TODO check all left shifts for potential overflow. Here, blockoffset is off_t
-      if(unlikely(ret < 1)) { // We should be able to read from the main file at least 1 byte
+      ret = pread(mfd->mapfd, pointers, runlength * $$BLP_S, mapoffset);
+      if(unlikely(ret == -1 || ret % $$BLP_S != 0)) {
          waserror = (ret == -1 ? errno : ENXIO);
-         $dlogi("ERROR pread from main file FD %d count %d offset %td; ret %d err %d = %s\n", mfd->mainfd, $$BL_S, (blockoffset << $$BL_SLOG), ret, waserror, strerror(waserror));
+         $dlogi("ERROR pread on .map for main file FD %d, map FD %d, err (%zd) %d = %s\n", mfd->mainfd, mfd->mapfd, ret, waserror, strerror(waserror));
          break;
       }
-      $dlogdbg("b_write: read old block from offs='%td' size='%d' fd='%d'\n", (blockoffset << $$BL_SLOG), $$BL_S, mfd->mainfd);
-
-      // Get the size of the dat file -- this is where we'll write
-      if(unlikely((datsize = lseek(mfd->datfd, 0, SEEK_END)) == -1)) {
-         waserror = errno;
-         $dlogi("ERROR lseek on dat for main file FD %d, err %d = %s\n", mfd->mainfd, waserror, strerror(waserror));
-         break;
+      for(i = ret / $$BLP_S; i < runlength; i++) { pointers[i] = 0; } // uninitialised parts of the map are 0
+
+      // Save the pages overwritten in blocks partially saved, or only partly overwritten
+      changed = 0;
+      for(i = 0; i < runlength; i++) {
+         if(pointers[i] != 0 && !$$BLP_IS_PART(pointers[i])) { continue; }
+         full = $b_page_mask(slog, blockoffset + i, 0, mfd->mapheader.fstat.st_size);
+         need = $b_page_mask(slog, blockoffset + i, writeoffset, writesize);
+         if(pointers[i] == 0 && (!pages || need == full)) { continue; } // see below
+         if(unlikely((ret = $b_save_pages(fsdata, mfd, slog, blockoffset + i, need, full, &(pointers[i]), &buf)) != 0)) {
+            waserror = -ret;
+            $dlogi("ERROR b_write: saving pages for main file FD %d failed, err %d = %s\n", mfd->mainfd, waserror, strerror(waserror));
+            break;
+         }
+         changed = 1;
       }
+      if(waserror != 0) { break; }
 
-      // Sanity check: the size of the dat file should be divisible by $$BL_S
-      if(unlikely((datsize & ($$BL_S - 1)) != 0)) {
-         $dlogi("ERROR Size of dat file (%td) is not divisible by block size (%d = 2^%d) for main FD '%d', path '%s'; datfd '%d'.\n", datsize, $$BL_S, $$BL_SLOG, mfd->mainfd, mfd->vpath, mfd->datfd);
-         waserror = EFAULT;
-         break;
-      }
+      for(i = 0; i < runlength && pointers[i] != 0; i++) { }
+      if(i < runlength) { // We need to save some of the blocks
+
+         if(unlikely((ret = $b_save_run(fsdata, mfd, slog, blockoffset, runlength, pointers, &buf, &compbuf)) != 0)) {
+            waserror = -ret;
+            $dlogi("ERROR b_write: saving blocks for main file FD %d failed, err %d = %s\n", mfd->mainfd, waserror, strerror(waserror));
+            break;
+         }
+         changed = 1;
 
-      // First we try to append to the dat file
-      ret = write(mfd->datfd, buf, $$BL_S);
-      if(unlikely(ret != $$BL_S)) {
-         waserror = (ret == -1 ? errno : ENXIO);
-         $dlogi("ERROR write into .dat for main file FD %d, ret %d err %d = %s\n", mfd->mainfd, ret, waserror, strerror(waserror));
-         break;
       }
-      $dlogdbg("b_write: appended block to fd '%d' for main fd '%d'\n", mfd->datfd, mfd->mainfd);
 
-      pointer = (datsize >> $$BL_SLOG); // Get where we've written the block
-      pointer++; // We save pointer+1 in the map
+      if(changed) {
 
-      ret = pwrite(mfd->mapfd, &pointer, $$BLP_S, mapoffset);
-      if(unlikely(ret != $$BLP_S)) {
-         waserror = (ret == -1 ? errno : ENXIO);
-         $dlogi("ERROR pwrite into .map for main file FD %d, ret %d err %d = %s\n", mfd->mainfd, ret, waserror, strerror(waserror));
-         break;
-      }
+         // Save the pointers of the whole run with a single write
+         ret = pwrite(mfd->mapfd, pointers, runlength * $$BLP_S, mapoffset);
+         if(unlikely(ret != runlength * $$BLP_S)) {
+            waserror = (ret == -1 ? errno : ENXIO);
+            $dlogi("ERROR pwrite into .map for main file FD %d, ret %zd err %d = %s\n", mfd->mainfd, ret, waserror, strerror(waserror));
+            break;
+         }
+         $dlogdbg("b_write: wrote %zu pointers to fd '%d' offs '%td' for main fd '%d'\n", runlength, mfd->mapfd, mapoffset, mfd->mainfd);
 
-      // Save the last written block in the mfd for caching
-      mfd->latest_written_block_cache = blockoffset + 1;
+      }
 
-      $dlogdbg("b_write: wrote pointer '%zu' to fd '%d' offs '%td' for main fd '%d'\n", pointer, mfd->mapfd, mapoffset, mfd->mainfd);
+      // Cache that the blocks have been saved
+      for(i = 0; i < runlength; i++) {
+         if(!$$BLP_IS_PART(pointers[i])) { $b_saved_set(mfd, blockoffset + i); }
+      }
 
    } // end for
 
    // Cleanup
-   if(lock != -1 && (!(flags & $$B_WRITE_HAS_LOCK))) {
+   if(lock != -1) {
       $dlogdbg("b_write: Releasing lock %d for main file FD %d\n", lock, mfd->mainfd);
       if(unlikely((lock = $mflock_unlock(fsdata, lock)) < 0)) {
          $dlogi("ERROR unlock for main file FD %d, err %d = %s\n", mfd->mainfd, lock, strerror(lock));
          if(waserror == 0) { waserror = -lock; }
       }
-
-      if(buf != NULL && lock != 0) { free(buf); }
    }
 
+   if(buf != NULL) { $bufpool_put(fsdata, buf); }
+   if(compbuf != NULL) { $bufpool_put(fsdata, compbuf); }
+
    return -waserror; // this is 0 if waserror==0
 }
 
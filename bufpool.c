@@ -0,0 +1,233 @@
+/*
+  This file is part of ESFS, a FUSE-based filesystem that supports snapshots.
+  ESFS is Copyright (C) 2013 Elod Csirmaz
+  <http://www.epcsirmaz.com/> <https://github.com/csirmaz>.
+
+  ESFS is based on Big Brother File System (fuse-tutorial)
+  Copyright (C) 2012 Joseph J. Pfeiffer, Jr., Ph.D. <pfeiffer@cs.nmsu.edu>,
+  and was forked from it on 21 August 2013.
+  Big Brother File System can be distributed under the terms of
+  the GNU GPLv3. See the file COPYING.
+  See also <http://www.cs.nmsu.edu/~pfeiffer/fuse-tutorial/>.
+
+  Big Brother File System was derived from function prototypes found in
+  /usr/include/fuse/fuse.h
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+  fuse.h is licensed under the LGPLv2.
+
+  ESFS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  ESFS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * NOTE: A Perl script is used to replace $ with esfs_ and $$ with ESFS_
+ * in this file. To write $, use \$.
+ */
+
+/* This file contains the pool of buffers used to copy blocks on write.
+ *
+ * Buffer pool
+ * ===========
+ *
+ * Each buffer holds $$BUFPOOL_BUFSIZE bytes, that is, a run of blocks saved
+ * together by $b_write. Buffers are mapped directly from the kernel, so they
+ * are page-aligned, and, if ESFS is started with --hugepages, they are backed
+ * by huge pages where possible. If no huge pages are available (MAP_HUGETLB
+ * fails), ESFS falls back to asking for transparent huge pages.
+ *
+ * Buffers are never returned to the kernel while ESFS is running. Each thread
+ * keeps up to $$BUFPOOL_CACHE buffers for itself, so that a FUSE thread
+ * saving blocks usually does not need any lock to get a buffer. Other buffers
+ * are kept on a global free list protected by a mutex. When a thread exits,
+ * the buffers it kept are put on the global list.
+ */
+
+
+/** Maps a new buffer
+ *
+ * Returns:
+ * * the buffer - on success
+ * * NULL - on error
+ */
+static char *$bufpool_alloc(struct $fsdata_t *fsdata)
+{
+   struct $bufpool_t *pool;
+   char *buf;
+
+   pool = fsdata->bufpool;
+
+#ifdef MAP_HUGETLB
+   if(__atomic_load_n(&(pool->hugepages), __ATOMIC_RELAXED) == $$BUFPOOL_HUGETLB) {
+      buf = mmap(NULL, $$BUFPOOL_BUFSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if(buf != MAP_FAILED) { return buf; }
+      $dlogi("bufpool: no huge pages available (%d = %s), using transparent huge pages\n", errno, strerror(errno));
+      __atomic_store_n(&(pool->hugepages), $$BUFPOOL_THP, __ATOMIC_RELAXED);
+   }
+#endif
+
+   buf = mmap(NULL, $$BUFPOOL_BUFSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if(unlikely(buf == MAP_FAILED)) { return NULL; }
+
+#ifdef MADV_HUGEPAGE
+   if(pool->hugepages != $$BUFPOOL_NOHUGE) { madvise(buf, $$BUFPOOL_BUFSIZE, MADV_HUGEPAGE); }
+#endif
+
+   return buf;
+}
+
+
+/** Puts a buffer on the global free list */
+static inline void $bufpool_push(struct $bufpool_t *pool, char *buf)
+{
+   pthread_mutex_lock(&(pool->mutex));
+   *((char **)buf) = pool->free;
+   pool->free = buf;
+   pthread_mutex_unlock(&(pool->mutex));
+}
+
+
+/** Puts the buffers kept by a thread on the global free list.
+ * Called when a thread exits.
+ */
+static void $bufpool_cache_release(void *privdata)
+{
+   struct $bufpool_cache_t *cache;
+
+   cache = (struct $bufpool_cache_t *)privdata;
+   while(cache->used > 0) {
+      cache->used--;
+      $bufpool_push(cache->pool, cache->buf[cache->used]);
+   }
+   free(cache);
+}
+
+
+/** Initialises the buffer pool
+ *
+ * Returns:
+ * * 0 on success
+ * * -errno on error
+ */
+static int $bufpool_init(struct $fsdata_t *fsdata, int hugepages /**< whether to try to use huge pages, 0 or 1 */)
+{
+   struct $bufpool_t *pool;
+   int ret;
+
+   pool = malloc(sizeof(struct $bufpool_t));
+   if(pool == NULL) { return -ENOMEM; }
+
+   if((ret = pthread_key_create(&(pool->key), $bufpool_cache_release)) != 0) {
+      free(pool);
+      return -ret;
+   }
+   pthread_mutex_init(&(pool->mutex), NULL);
+   pool->free = NULL;
+   pool->hugepages = (hugepages ? $$BUFPOOL_HUGETLB : $$BUFPOOL_NOHUGE);
+
+   fsdata->bufpool = pool;
+   return 0;
+}
+
+
+/** Frees the buffer pool.
+ * Should be called when the other threads have exited.
+ */
+static void $bufpool_destroy(struct $fsdata_t *fsdata)
+{
+   struct $bufpool_t *pool;
+   struct $bufpool_cache_t *cache;
+   char *buf;
+
+   pool = fsdata->bufpool;
+   if(pool == NULL) { return; }
+
+   // Release the buffers kept by this thread
+   if((cache = pthread_getspecific(pool->key)) != NULL) {
+      pthread_setspecific(pool->key, NULL);
+      $bufpool_cache_release(cache);
+   }
+   pthread_key_delete(pool->key);
+
+   while((buf = pool->free) != NULL) {
+      pool->free = *((char **)buf);
+      munmap(buf, $$BUFPOOL_BUFSIZE);
+   }
+
+   pthread_mutex_destroy(&(pool->mutex));
+   free(pool);
+   fsdata->bufpool = NULL;
+}
+
+
+/** Gets a buffer of $$BUFPOOL_BUFSIZE bytes
+ *
+ * Returns:
+ * * the buffer - on success
+ * * NULL - on error
+ */
+static inline char *$bufpool_get(struct $fsdata_t *fsdata)
+{
+   struct $bufpool_t *pool;
+   struct $bufpool_cache_t *cache;
+   char *buf;
+
+   pool = fsdata->bufpool;
+
+   cache = pthread_getspecific(pool->key);
+   if(likely(cache != NULL && cache->used > 0)) {
+      cache->used--;
+      return cache->buf[cache->used];
+   }
+
+   pthread_mutex_lock(&(pool->mutex));
+   buf = pool->free;
+   if(buf != NULL) { pool->free = *((char **)buf); }
+   pthread_mutex_unlock(&(pool->mutex));
+
+   if(buf != NULL) { return buf; }
+
+   $dlogdbg("bufpool: mapping a new buffer\n");
+   return $bufpool_alloc(fsdata);
+}
+
+
+/** Returns a buffer got from $bufpool_get to the pool
+ */
+static inline void $bufpool_put(struct $fsdata_t *fsdata, char *buf)
+{
+   struct $bufpool_t *pool;
+   struct $bufpool_cache_t *cache;
+
+   pool = fsdata->bufpool;
+
+   cache = pthread_getspecific(pool->key);
+   if(unlikely(cache == NULL)) { // first buffer returned by this thread
+      cache = malloc(sizeof(struct $bufpool_cache_t));
+      if(cache != NULL) {
+         cache->pool = pool;
+         cache->used = 0;
+         if(pthread_setspecific(pool->key, cache) != 0) {
+            free(cache);
+            cache = NULL;
+         }
+      }
+   }
+
+   if(likely(cache != NULL && cache->used < $$BUFPOOL_CACHE)) {
+      cache->buf[cache->used] = buf;
+      cache->used++;
+      return;
+   }
+
+   $bufpool_push(pool, buf);
+}
@@ -0,0 +1,550 @@
+/*
+  This file is part of ESFS, a FUSE-based filesystem that supports snapshots.
+  ESFS is Copyright (C) 2013 Elod Csirmaz
+  <http://www.epcsirmaz.com/> <https://github.com/csirmaz>.
+
+  ESFS is based on Big Brother File System (fuse-tutorial)
+  Copyright (C) 2012 Joseph J. Pfeiffer, Jr., Ph.D. <pfeiffer@cs.nmsu.edu>,
+  and was forked from it on 21 August 2013.
+  Big Brother File System can be distributed under the terms of
+  the GNU GPLv3. See the file COPYING.
+  See also <http://www.cs.nmsu.edu/~pfeiffer/fuse-tutorial/>.
+
+  Big Brother File System was derived from function prototypes found in
+  /usr/include/fuse/fuse.h
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+  fuse.h is licensed under the LGPLv2.
+
+  ESFS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  ESFS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * NOTE: A Perl script is used to replace $ with esfs_ and $$ with ESFS_
+ * in this file. To write $, use \$.
+ */
+
+/* This file contains the store used to deduplicate blocks saved in the snapshots.
+ *
+ * Deduplication store
+ * ===================
+ *
+ * If ESFS is started with --dedup, blocks saved by $b_write are not appended
+ * to the dat files. Instead, they are stored once in a store shared by all
+ * files and snapshots, in ROOT/snapshots/.dedup.hid/ (see $$DEDUP_DIR), which
+ * is hidden by $sn_filter_name. The store consists of:
+ *
+ * * dat - the stored blocks. Block n is at offset n * $$BL_S. Blocks of map files
+ *   using a smaller blocksize only fill the start of their slot.
+ * * index - a record ($dedup_rec_t) for each block in dat, with a hash of the
+ *   contents and the number of pointers in the map files referring to it.
+ *
+ * Pointers to blocks in the store are saved in the map files as negative
+ * numbers (see $$DEDUP_POINTER). These can be read even if ESFS is later
+ * started without --dedup, as long as the store exists.
+ *
+ * The index file is loaded into memory when ESFS starts, and a hash table
+ * is built from it. When a block is saved, its hash is looked up, and the
+ * contents of blocks with the same hash are compared byte by byte before
+ * the reference count of one is increased. Otherwise the block is written into
+ * the first free slot or appended to dat.
+ *
+ * When a snapshot is removed, $dedup_release_sn decreases the reference counts
+ * of the blocks its map files refer to. Slots no longer used are added to a
+ * free list, and their space is freed by punching a hole in dat.
+ *
+ * The block and its reference count are written into the store before the pointer
+ * is saved in the map file, and fsync flushes the store before the map files
+ * (see gsync.c). So after a crash, blocks can be leaked, but the pointers flushed
+ * by fsync cannot refer to blocks that were lost or reused.
+ *
+ * A single mutex protects the records and the hash table, but it is not held
+ * while a block is compared or written (see $dedup_store). If two identical
+ * new blocks are saved at the same time, or blocks with different contents
+ * have the same hash, the block is stored again.
+ * Zero blocks are never stored (see $$BLP_ZERO).
+ */
+
+
+/** Calculates the hash of a block
+ *
+ * Four independent lanes are used so that the multiplications can overlap.
+ * The length is mixed in so that blocks of different sizes do not match.
+ */
+static inline uint64_t $dedup_hash(const char *buf, size_t length)
+{
+   const uint64_t *words;
+   uint64_t h0, h1, h2, h3;
+   size_t i;
+
+   words = (const uint64_t *)buf;
+   h0 = 0x243F6A8885A308D3ULL ^ (length == $$BL_S ? 0 : length); // keep the hashes of existing stores
+   h1 = 0x13198A2E03707344ULL;
+   h2 = 0xA4093822299F31D0ULL;
+   h3 = 0x082EFA98EC4E6C89ULL;
+
+#define $$DEDUP_MIX(h, w) h = ((h) ^ (w)) * 0x9E3779B97F4A7C15ULL; h ^= (h >> 29);
+   for(i = 0; i < length / sizeof(uint64_t); i += 4) {
+      $$DEDUP_MIX(h0, words[i])
+      $$DEDUP_MIX(h1, words[i + 1])
+      $$DEDUP_MIX(h2, words[i + 2])
+      $$DEDUP_MIX(h3, words[i + 3])
+   }
+   $$DEDUP_MIX(h0, h1)
+   $$DEDUP_MIX(h0, h2)
+   $$DEDUP_MIX(h0, h3)
+#undef $$DEDUP_MIX
+
+   return h0;
+}
+
+
+/** Adds a slot to its hash bucket */
+static inline void $dedup_link(struct $dedup_t *dd, int64_t slot)
+{
+   uint64_t b;
+
+   b = dd->recs[slot].hash & (dd->nbuckets - 1);
+   dd->next[slot] = dd->buckets[b];
+   dd->buckets[b] = slot;
+}
+
+
+/** Removes a slot from its hash bucket */
+static inline void $dedup_unlink(struct $dedup_t *dd, int64_t slot)
+{
+   int64_t *p;
+
+   for(p = &(dd->buckets[dd->recs[slot].hash & (dd->nbuckets - 1)]); *p != -1; p = &(dd->next[*p])) {
+      if(*p == slot) {
+         *p = dd->next[slot];
+         return;
+      }
+   }
+}
+
+
+/** Makes sure there is space for a new slot, and that the hash table is large enough
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $dedup_grow(struct $dedup_t *dd)
+{
+   void *pret;
+   int64_t allocated, slot;
+   uint64_t nbuckets, b;
+
+   if(dd->slots >= dd->allocated) {
+      allocated = (dd->allocated < 1024 ? 1024 : dd->allocated * 2);
+      if((pret = realloc(dd->recs, allocated * sizeof(struct $dedup_rec_t))) == NULL) { return -ENOMEM; }
+      dd->recs = pret;
+      if((pret = realloc(dd->next, allocated * sizeof(int64_t))) == NULL) { return -ENOMEM; }
+      dd->next = pret;
+      if((pret = realloc(dd->pins, allocated * sizeof(int64_t))) == NULL) { return -ENOMEM; }
+      dd->pins = pret;
+      if((pret = realloc(dd->writing, allocated)) == NULL) { return -ENOMEM; }
+      dd->writing = pret;
+      dd->allocated = allocated;
+   }
+
+   if(dd->slots >= dd->nbuckets) {
+      nbuckets = (dd->nbuckets < 1024 ? 1024 : dd->nbuckets * 2);
+      if((pret = malloc(nbuckets * sizeof(int64_t))) == NULL) { return -ENOMEM; }
+      free(dd->buckets);
+      dd->buckets = pret;
+      dd->nbuckets = nbuckets;
+      for(b = 0; b < nbuckets; b++) { dd->buckets[b] = -1; }
+      for(slot = 0; slot < dd->slots; slot++) {
+         if(dd->recs[slot].refs > 0 && dd->writing[slot] == 0) { $dedup_link(dd, slot); }
+      }
+   }
+
+   return 0;
+}
+
+
+/** Saves the record of a slot in the index file.
+ * References taken by $dedup_store while comparing or writing a block are not saved.
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static inline int $dedup_save_rec(struct $fsdata_t *fsdata, int64_t slot)
+{
+   struct $dedup_t *dd;
+   struct $dedup_rec_t rec;
+   ssize_t ret;
+
+   dd = fsdata->dedup;
+   rec.hash = dd->recs[slot].hash;
+   rec.refs = dd->recs[slot].refs - dd->pins[slot];
+   ret = pwrite(dd->idxfd, &rec, sizeof(struct $dedup_rec_t), slot * sizeof(struct $dedup_rec_t));
+   if(unlikely(ret != sizeof(struct $dedup_rec_t))) {
+      ret = (ret == -1 ? errno : EIO);
+      $dlogi("ERROR dedup: writing the record of slot %lld failed with %d = %s\n", (long long)slot, (int)ret, strerror(ret));
+      return -ret;
+   }
+   return 0;
+}
+
+
+/** Decreases the reference count of a block in the store.
+ * Should be called with the mutex held.
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $dedup_unref_locked(struct $fsdata_t *fsdata, int64_t slot)
+{
+   struct $dedup_t *dd;
+
+   dd = fsdata->dedup;
+   if(unlikely(slot < 0 || slot >= dd->slots || dd->recs[slot].refs <= 0)) {
+      $dlogi("ERROR dedup: unreferencing unused slot %lld\n", (long long)slot);
+      return -EFAULT;
+   }
+
+   dd->recs[slot].refs--;
+   if(dd->recs[slot].refs > 0) { return $dedup_save_rec(fsdata, slot); }
+
+   // The slot is now free
+   $dedup_unlink(dd, slot);
+   dd->next[slot] = dd->free;
+   dd->free = slot;
+   if(fallocate(dd->datfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (slot << $$BL_SLOG), $$BL_S) != 0) {
+      $dlogdbg("dedup: punching a hole failed with %d = %s\n", errno, strerror(errno));
+   }
+   return $dedup_save_rec(fsdata, slot);
+}
+
+
+/** Stores a block in the store, or increases the reference count of an identical one
+ *
+ * length must be a blocksize (see $$MAP_BL_SLOG).
+ *
+ * The mutex is only held to look up or reserve a slot and to update its record.
+ * A block with the same hash is referenced while it is compared, so that it
+ * cannot be freed; a new slot is marked as being written, and is only added
+ * to its hash bucket once the block is in dat.
+ *
+ * Sets:
+ * * *pointer - the pointer to save in the map file
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $dedup_store(struct $fsdata_t *fsdata, const char *block, size_t length, $$BLP_T *pointer)
+{
+   struct $dedup_t *dd;
+   char *vbuf;
+   uint64_t hash;
+   int64_t slot;
+   ssize_t ret;
+   int waserror = 0; // positive on error
+
+   dd = fsdata->dedup;
+   hash = $dedup_hash(block, length);
+
+   // Look for a block with the same hash
+   pthread_mutex_lock(&(dd->mutex));
+   for(slot = dd->buckets[hash & (dd->nbuckets - 1)]; slot != -1; slot = dd->next[slot]) {
+      if(dd->recs[slot].hash == hash) {
+         dd->recs[slot].refs++;
+         dd->pins[slot]++;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&(dd->mutex));
+
+   if(slot != -1) { // Compare it
+
+      if(unlikely((vbuf = $bufpool_get(fsdata)) == NULL)) {
+         waserror = ENOMEM;
+      } else {
+         ret = pread(dd->datfd, vbuf, length, (slot << $$BL_SLOG));
+         if(unlikely(ret != length)) {
+            waserror = (ret == -1 ? errno : EIO);
+            $dlogi("ERROR dedup: reading slot %lld failed with %d = %s\n", (long long)slot, waserror, strerror(waserror));
+         } else if(memcmp(vbuf, block, length) != 0) {
+            $dlogdbg("dedup: hash collision with slot %lld\n", (long long)slot);
+            waserror = -1;
+         }
+         $bufpool_put(fsdata, vbuf);
+      }
+
+      pthread_mutex_lock(&(dd->mutex));
+      dd->pins[slot]--;
+      if(waserror == 0 && unlikely((ret = $dedup_save_rec(fsdata, slot)) != 0)) { waserror = -ret; }
+      if(waserror != 0) { $dedup_unref_locked(fsdata, slot); }
+      pthread_mutex_unlock(&(dd->mutex));
+
+      if(waserror > 0) { return -waserror; }
+      if(waserror == 0) {
+         $dlogdbg("dedup: stored block in slot %lld\n", (long long)slot);
+         *pointer = $$DEDUP_POINTER(slot);
+         return 0;
+      }
+      waserror = 0; // store the block in a new slot
+   }
+
+   // Reserve a new slot
+   pthread_mutex_lock(&(dd->mutex));
+   if(dd->free != -1) {
+      slot = dd->free;
+      dd->free = dd->next[slot];
+   } else if(unlikely((ret = $dedup_grow(dd)) != 0)) {
+      pthread_mutex_unlock(&(dd->mutex));
+      return ret;
+   } else {
+      slot = dd->slots;
+      dd->slots++;
+   }
+   dd->recs[slot].hash = hash;
+   dd->recs[slot].refs = 1;
+   dd->pins[slot] = 1;
+   dd->writing[slot] = 1;
+   pthread_mutex_unlock(&(dd->mutex));
+
+   ret = pwrite(dd->datfd, block, length, (slot << $$BL_SLOG));
+   if(unlikely(ret != length)) {
+      waserror = (ret == -1 ? errno : EIO);
+      $dlogi("ERROR dedup: writing slot %lld failed with %d = %s\n", (long long)slot, waserror, strerror(waserror));
+   }
+
+   pthread_mutex_lock(&(dd->mutex));
+   dd->writing[slot] = 0;
+   dd->pins[slot] = 0;
+   $dedup_link(dd, slot);
+   if(waserror == 0 && unlikely((ret = $dedup_save_rec(fsdata, slot)) != 0)) { waserror = -ret; }
+   if(waserror != 0) { $dedup_unref_locked(fsdata, slot); }
+   pthread_mutex_unlock(&(dd->mutex));
+
+   if(waserror != 0) { return -waserror; }
+   $dlogdbg("dedup: stored new block in slot %lld\n", (long long)slot);
+   *pointer = $$DEDUP_POINTER(slot);
+   return 0;
+}
+
+
+/** Helper for $dedup_release_sn: releases the blocks a map file refers to
+ *
+ * Returns 0 or errno.
+ */
+int $_dedup_release_map(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+   struct $fsdata_t *fsdata;
+   $$BLP_T pointers[$$DEDUP_RELEASE_CHUNK];
+   $$PATH_LEN_T plen;
+   off_t offset;
+   ssize_t ret;
+   int fd, i, n;
+   int waserror = 0;
+
+   if(typeflag != FTW_F) { return 0; }
+   plen = strlen(fpath);
+   if(plen < $$EXT_LEN || strcmp(fpath + plen - $$EXT_LEN, $$EXT_MAP) != 0) { return 0; }
+
+   fsdata = $$FSDATA;
+
+   if((fd = open(fpath, O_RDONLY)) == -1) { return errno; }
+
+   pthread_mutex_lock(&(fsdata->dedup->mutex));
+
+   for(offset = sizeof(struct $mapheader_t); ; offset += ret) {
+      ret = pread(fd, pointers, sizeof(pointers), offset);
+      if(ret == -1) {
+         waserror = errno;
+         break;
+      }
+      n = ret / $$BLP_S;
+      if(n == 0) { break; }
+      for(i = 0; i < n; i++) {
+         if(pointers[i] <= $$DEDUP_POINTER(0)) {
+            if((ret = $dedup_unref_locked(fsdata, $$DEDUP_SLOT(pointers[i]))) != 0) { waserror = -ret; }
+         }
+      }
+      ret = n * $$BLP_S;
+   }
+
+   pthread_mutex_unlock(&(fsdata->dedup->mutex));
+
+   close(fd);
+   return waserror;
+}
+
+
+/** Releases the blocks in the store referred to by the map files of a snapshot.
+ * Should be called before the snapshot is removed.
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $dedup_release_sn(struct $fsdata_t *fsdata, const char *snpath)
+{
+   int ret;
+
+   if(fsdata->dedup == NULL) { return 0; }
+
+   ret = nftw(snpath, $_dedup_release_map, $$RECURSIVE_RM_FDS, FTW_PHYS);
+   if(ret >= 0) { return -ret; } // success or errno
+   return -ENOMEM; // generic error encountered by nftw
+}
+
+
+/** Opens the deduplication store if it exists or if it is to be used
+ *
+ * Sets fsdata->dedup, which is left NULL if there is no store.
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $dedup_init(struct $fsdata_t *fsdata, int enable /**< whether new blocks should be stored, 0 or 1 */)
+{
+   struct $dedup_t *dd;
+   struct stat mystat;
+   char path[$$PATH_MAX];
+   char filepath[$$PATH_MAX];
+   ssize_t ret;
+   int64_t slot;
+   int waserror = 0; // positive on error
+
+   fsdata->dedup = NULL;
+
+   if(strlen(fsdata->sn_dir) + strlen($$DEDUP_DIR) + 7 >= $$PATH_MAX) { return -ENAMETOOLONG; }
+   strcpy(path, fsdata->sn_dir);
+   strcat(path, $$DEDUP_DIR);
+
+   if(enable == 0) {
+      if(lstat(path, &mystat) != 0) {
+         if(errno == ENOENT) { return 0; }
+         return -errno;
+      }
+   } else if(mkdir(path, S_IRWXU) != 0 && errno != EEXIST) {
+      ret = errno;
+      $dlogi("ERROR dedup: creating '%s' failed with %d = %s\n", path, (int)ret, strerror(ret));
+      return -ret;
+   }
+
+   dd = calloc(1, sizeof(struct $dedup_t));
+   if(dd == NULL) { return -ENOMEM; }
+   dd->datfd = -1;
+   dd->idxfd = -1;
+   dd->free = -1;
+   dd->write = enable;
+
+   do {
+
+      strcpy(filepath, path);
+      strcat(filepath, "/dat");
+      if((dd->datfd = open(filepath, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) == -1) {
+         waserror = errno;
+         break;
+      }
+
+      strcpy(filepath, path);
+      strcat(filepath, "/index");
+      if((dd->idxfd = open(filepath, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) == -1) {
+         waserror = errno;
+         break;
+      }
+
+      if(fstat(dd->datfd, &mystat) != 0) {
+         waserror = errno;
+         break;
+      }
+      dd->bckey.dev = mystat.st_dev;
+      dd->bckey.ino = mystat.st_ino;
+
+      // Load the index
+      if(fstat(dd->idxfd, &mystat) != 0) {
+         waserror = errno;
+         break;
+      }
+      dd->slots = mystat.st_size / sizeof(struct $dedup_rec_t);
+      dd->allocated = 1024;
+      while(dd->allocated < dd->slots) { dd->allocated *= 2; }
+      dd->nbuckets = dd->allocated;
+      dd->recs = malloc(dd->allocated * sizeof(struct $dedup_rec_t));
+      dd->next = malloc(dd->allocated * sizeof(int64_t));
+      dd->pins = calloc(dd->allocated, sizeof(int64_t));
+      dd->writing = calloc(dd->allocated, 1);
+      dd->buckets = malloc(dd->nbuckets * sizeof(int64_t));
+      if(dd->recs == NULL || dd->next == NULL || dd->pins == NULL || dd->writing == NULL || dd->buckets == NULL) {
+         waserror = ENOMEM;
+         break;
+      }
+      for(slot = 0; slot < dd->nbuckets; slot++) { dd->buckets[slot] = -1; }
+
+      ret = pread(dd->idxfd, dd->recs, dd->slots * sizeof(struct $dedup_rec_t), 0);
+      if(ret != (ssize_t)(dd->slots * sizeof(struct $dedup_rec_t))) {
+         waserror = (ret == -1 ? errno : EIO);
+         break;
+      }
+
+      for(slot = dd->slots - 1; slot >= 0; slot--) {
+         if(dd->recs[slot].refs > 0) {
+            $dedup_link(dd, slot);
+         } else {
+            dd->next[slot] = dd->free;
+            dd->free = slot;
+         }
+      }
+
+   } while(0);
+
+   if(waserror != 0) {
+      $dlogi("ERROR dedup: opening the store at '%s' failed with %d = %s\n", path, waserror, strerror(waserror));
+      if(dd->datfd != -1) { close(dd->datfd); }
+      if(dd->idxfd != -1) { close(dd->idxfd); }
+      free(dd->recs);
+      free(dd->next);
+      free(dd->pins);
+      free(dd->writing);
+      free(dd->buckets);
+      free(dd);
+      return -waserror;
+   }
+
+   pthread_mutex_init(&(dd->mutex), NULL);
+   fsdata->dedup = dd;
+   $dlogi("dedup: opened store with %lld slots, storing new blocks: %d\n", (long long)dd->slots, enable);
+   return 0;
+}
+
+
+/** Closes the deduplication store */
+static void $dedup_destroy(struct $fsdata_t *fsdata)
+{
+   struct $dedup_t *dd;
+
+   dd = fsdata->dedup;
+   if(dd == NULL) { return; }
+
+   close(dd->datfd);
+   close(dd->idxfd);
+   pthread_mutex_destroy(&(dd->mutex));
+   free(dd->recs);
+   free(dd->next);
+   free(dd->pins);
+   free(dd->writing);
+   free(dd->buckets);
+   free(dd);
+   fsdata->dedup = NULL;
+}
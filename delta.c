@@ -0,0 +1,1051 @@
+/*
+  This file is part of ESFS, a FUSE-based filesystem that supports snapshots.
+  ESFS is Copyright (C) 2013 Elod Csirmaz
+  <http://www.epcsirmaz.com/> <https://github.com/csirmaz>.
+
+  ESFS is based on Big Brother File System (fuse-tutorial)
+  Copyright (C) 2012 Joseph J. Pfeiffer, Jr., Ph.D. <pfeiffer@cs.nmsu.edu>,
+  and was forked from it on 21 August 2013.
+  Big Brother File System can be distributed under the terms of
+  the GNU GPLv3. See the file COPYING.
+  See also <http://www.cs.nmsu.edu/~pfeiffer/fuse-tutorial/>.
+
+  Big Brother File System was derived from function prototypes found in
+  /usr/include/fuse/fuse.h
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+  fuse.h is licensed under the LGPLv2.
+
+  ESFS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  ESFS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * NOTE: A Perl script is used to replace $ with esfs_ and $$ with ESFS_
+ * in this file. To write $, use \$.
+ */
+/* This file contains the delta store used to redirect writes into the main files.
+ *
+ * Redirect on write
+ * =================
+ *
+ * The first write into a block after a snapshot has been taken normally
+ * copies the old block into the snapshot before the main file is written
+ * (see block.c). If ESFS is started with --redirect-on-write, such writes
+ * are written into a delta file instead, and the old block stays in the
+ * main file, where the latest snapshot reads it from. The merger thread
+ * later saves the old blocks into the snapshot using $b_write, and writes the
+ * new blocks into the main file ("merging").
+ *
+ * The main files that are open each have a $delta_file_t shared by their mfds
+ * (see $delta_get). Once blocks have been redirected, it has a delta file in
+ * ROOT/snapshots/.delta.hid/ (see $$DELTA_DIR), which starts with a header
+ * naming the main file, followed by slots holding a block number and a whole
+ * block (see $$DELTA_SLOT_POS). Later writes into the same block overwrite
+ * the slot. Only blocks that are whole both in the main file and in the
+ * latest snapshot are redirected; if a block is only partly overwritten,
+ * the rest of it is read from the main file first.
+ * Reads of the main file are then patched with the blocks in the delta file
+ * (see $delta_read).
+ *
+ * Other writes merge the redirected blocks they overwrite first, and truncating
+ * a file merges or drops the blocks affected (see $delta_truncate).
+ * Writes that are not redirected and do not overwrite redirected blocks only
+ * hold the lock of the delta file for reading, so that they can still run
+ * in parallel (see $delta_write_direct).
+ * All blocks are merged before a snapshot is created (see $delta_pause).
+ * Slots are marked with $$DELTA_DEAD when their blocks have been merged and the
+ * main file has been synced. Syncing a main file also syncs its delta file,
+ * and delta files left behind by a crash are merged when ESFS starts
+ * (see $delta_init).
+ */
+
+
+/** Writes the blocks in a delta file left behind into the main file
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $delta_replay(struct $fsdata_t *fsdata, const char *path)
+{
+   struct $delta_header_t head;
+   struct $mfd_t mfd;
+   char fpath[$$PATH_MAX];
+   char *buf = NULL;
+   int64_t block;
+   off_t pos;
+   ssize_t ret;
+   size_t bs;
+   int fd;
+   int mfd_open = 0;
+   int waserror = 0; // positive on error
+
+   fd = open(path, O_RDONLY);
+   if(fd == -1) { return -errno; }
+   mfd.mainfd = -1;
+
+   do {
+
+      // The header is written before any blocks
+      ret = pread(fd, &head, sizeof(struct $delta_header_t), 0);
+      if(ret != sizeof(struct $delta_header_t) || strncmp(head.signature, "ESFD", 4) != 0) {
+         $dlogi("WARNING delta: '%s' has no header, ignoring it\n", path);
+         break;
+      }
+      if(unlikely(head.slog < $$BL_SLOG_MIN || head.slog > $$BL_SLOG)) {
+         $dlogi("ERROR delta: '%s' has an invalid blocksize\n", path);
+         waserror = EINVAL;
+         break;
+      }
+      head.vpath[$$PATH_MAX - 1] = '\0';
+      bs = (1 << head.slog);
+
+      if($map_path(fpath, head.vpath, fsdata) != 0) {
+         waserror = ENAMETOOLONG;
+         break;
+      }
+
+      mfd.mainfd = open(fpath, O_RDWR);
+      if(mfd.mainfd == -1) {
+         waserror = errno;
+         if(waserror == ENOENT) { // nothing to merge into
+            $dlogi("WARNING delta: main file '%s' no longer exists\n", head.vpath);
+            waserror = 0;
+         }
+         break;
+      }
+
+      if(unlikely((ret = $mfd_set_locklabel(&mfd, fpath)) != 0 || (ret = $mfd_open_sn(&mfd, head.vpath, fpath, fsdata)) != 0)) {
+         waserror = -ret;
+         break;
+      }
+      mfd_open = 1;
+
+      if(unlikely((buf = $bufpool_get(fsdata)) == NULL)) {
+         waserror = ENOMEM;
+         break;
+      }
+
+      for(pos = $$DELTA_SLOT_POS(head.slog, 0); ; pos += bs + sizeof(int64_t)) {
+         // A slot may have been left incomplete
+         if(pread(fd, &block, sizeof(int64_t), pos) != sizeof(int64_t)) { break; }
+         if(pread(fd, buf, bs, pos + sizeof(int64_t)) != bs) { break; }
+         if(block == $$DELTA_DEAD) { continue; }
+
+         if(unlikely((ret = $b_write(fsdata, &mfd, bs, block << head.slog, $$B_WRITE_DEFAULTS)) != 0)) {
+            waserror = -ret;
+            break;
+         }
+         ret = pwrite(mfd.mainfd, buf, bs, block << head.slog);
+         if(unlikely(ret != bs)) {
+            waserror = (ret == -1 ? errno : EIO);
+            break;
+         }
+      }
+
+      if(waserror == 0 && unlikely(fdatasync(mfd.mainfd) != 0)) { waserror = errno; }
+
+   } while(0);
+
+   if(buf != NULL) { $bufpool_put(fsdata, buf); }
+   if(mfd_open) { $mfd_close_sn(&mfd, fsdata); }
+   if(mfd.mainfd != -1) { close(mfd.mainfd); }
+   close(fd);
+
+   if(waserror != 0) {
+      $dlogi("ERROR delta: merging '%s' failed with %d = %s\n", path, waserror, strerror(waserror));
+   }
+   return -waserror;
+}
+
+
+/** Merges the delta files left behind, and creates the delta store if enable is 1
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $delta_init(struct $fsdata_t *fsdata, int enable /**< whether writes should be redirected, 0 or 1 */)
+{
+   struct $delta_t *dt;
+   char path[$$PATH_MAX];
+   char filepath[$$PATH_MAX];
+   DIR *dir;
+   struct dirent *entry;
+   int ret;
+   int waserror = 0; // positive on error
+
+   fsdata->delta = NULL;
+
+   if(strlen(fsdata->sn_dir) + strlen($$DELTA_DIR) + 1 >= $$PATH_MAX) { return -ENAMETOOLONG; }
+   strcpy(path, fsdata->sn_dir);
+   strcat(path, $$DELTA_DIR);
+
+   if(enable != 0 && mkdir(path, S_IRWXU) != 0 && errno != EEXIST) {
+      ret = errno;
+      $dlogi("ERROR delta: creating '%s' failed with %d = %s\n", path, ret, strerror(ret));
+      return -ret;
+   }
+
+   // Merge the blocks left by a crash
+   dir = opendir(path);
+   if(dir == NULL) {
+      if(errno == ENOENT) { return 0; }
+      return -errno;
+   }
+
+   while((entry = readdir(dir)) != NULL) {
+      if(entry->d_name[0] == '.') { continue; }
+      if(strlen(path) + strlen(entry->d_name) + 1 >= $$PATH_MAX) { continue; }
+      strcpy(filepath, path);
+      strcat(filepath, $$DIRSEP);
+      strcat(filepath, entry->d_name);
+
+      $dlogi("Merging the blocks left in '%s'\n", filepath);
+      if((ret = $delta_replay(fsdata, filepath)) != 0) {
+         waserror = -ret;
+         break;
+      }
+      if(unlikely(unlink(filepath) != 0)) {
+         waserror = errno;
+         break;
+      }
+   }
+
+   closedir(dir);
+   if(waserror != 0) { return -waserror; }
+
+   if(enable == 0) { return 0; }
+
+   dt = calloc(1, sizeof(struct $delta_t));
+   if(dt == NULL) { return -ENOMEM; }
+
+   pthread_mutex_init(&(dt->mutex), NULL);
+   pthread_cond_init(&(dt->wake), NULL);
+   strcpy(dt->dir, path);
+   fsdata->delta = dt;
+
+   return 0;
+}
+
+
+/** Finds the delta file of the main file at vpath. Call this with the mutex of the store held
+ *
+ * Returns the link pointing to it in the hash table, which points to NULL if there is none.
+ */
+static inline struct $delta_file_t **$delta_find(struct $delta_t *dt, const char *vpath, unsigned long hash)
+{
+   struct $delta_file_t **link;
+
+   for(link = &(dt->buckets[hash % $$DELTA_BUCKETS]); *link != NULL; link = &((*link)->next)) {
+      if((*link)->hash == hash && strcmp((*link)->vpath, vpath) == 0) { break; }
+   }
+   return link;
+}
+
+
+/** Frees a delta file that is no longer used. Call this with the mutex of the store held
+ */
+static void $delta_unref(struct $fsdata_t *fsdata, struct $delta_file_t *df)
+{
+   struct $delta_file_t **link;
+
+   df->refs--;
+   if(df->refs > 0 || (df->pending > 0 && df->listed)) { return; }
+
+   if(df->listed) {
+      for(link = &(fsdata->delta->buckets[df->hash % $$DELTA_BUCKETS]); *link != df; link = &((*link)->next)) { }
+      *link = df->next;
+   }
+
+   if(df->fd != -1) {
+      close(df->fd);
+      unlink(df->path);
+   }
+   if(df->mfd_open) {
+      $mfd_close_sn(&(df->mfd), fsdata);
+      close(df->mfd.mainfd);
+   }
+   pthread_rwlock_destroy(&(df->rwlock));
+   pthread_rwlock_destroy(&(df->mfd.sn_lock));
+   free(df->slots);
+   free(df);
+}
+
+
+/** Sets mfd->delta to the delta file of the main file at vpath, which is created if needed
+ *
+ * Call this when a main file is opened, and $delta_put when it is closed.
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $delta_get(struct $fsdata_t *fsdata, struct $mfd_t *mfd, const char *vpath)
+{
+   struct $delta_t *dt;
+   struct $delta_file_t *df;
+   unsigned long hash;
+
+   mfd->delta = NULL;
+   dt = fsdata->delta;
+   if(dt == NULL) { return 0; }
+
+   hash = $djb2((const unsigned char *)vpath);
+
+   pthread_mutex_lock(&(dt->mutex));
+
+   df = *$delta_find(dt, vpath, hash);
+   if(df == NULL) {
+      df = calloc(1, sizeof(struct $delta_file_t));
+      if(df == NULL) {
+         pthread_mutex_unlock(&(dt->mutex));
+         return -ENOMEM;
+      }
+      strcpy(df->vpath, vpath);
+      df->hash = hash;
+      df->fd = -1;
+      df->limit = -1;
+      df->listed = 1;
+      pthread_rwlock_init(&(df->rwlock), NULL);
+      $mfd_sn_lock_init(&(df->mfd));
+      df->next = dt->buckets[hash % $$DELTA_BUCKETS];
+      dt->buckets[hash % $$DELTA_BUCKETS] = df;
+   }
+
+   df->refs++;
+   mfd->delta = df;
+
+   pthread_mutex_unlock(&(dt->mutex));
+   return 0;
+}
+
+
+/** Releases mfd->delta (see $delta_get). Blocks not merged yet are left to the merger
+ */
+static void $delta_put(struct $fsdata_t *fsdata, struct $mfd_t *mfd)
+{
+   if(mfd->delta == NULL) { return; }
+
+   pthread_mutex_lock(&(fsdata->delta->mutex));
+   $delta_unref(fsdata, mfd->delta);
+   pthread_mutex_unlock(&(fsdata->delta->mutex));
+   mfd->delta = NULL;
+}
+
+
+/** Marks a redirected block as merged or dropped. Call this with the lock of the delta file held
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static inline int $delta_drop(struct $delta_file_t *df, off_t block)
+{
+   int64_t dead = $$DELTA_DEAD;
+   ssize_t ret;
+
+   ret = pwrite(df->fd, &dead, sizeof(int64_t), $$DELTA_SLOT_POS(df->slog, df->slots[block] - 1));
+   if(unlikely(ret != sizeof(int64_t))) { return (ret == -1 ? -errno : -EIO); }
+
+   df->slots[block] = 0;
+   if(__atomic_sub_fetch(&(df->pending), 1, __ATOMIC_SEQ_CST) == 0) {
+      // Start filling the delta file again
+      df->nslots = 0;
+      if(unlikely(ftruncate(df->fd, sizeof(struct $delta_header_t)) != 0)) { return -errno; }
+   }
+   return 0;
+}
+
+
+/** Merges the redirected blocks from blockoffset to blockend (exclusive)
+ *
+ * Call this with the lock of the delta file held for writing.
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $delta_merge(struct $fsdata_t *fsdata, struct $delta_file_t *df, off_t blockoffset, off_t blockend)
+{
+   char *buf = NULL;
+   off_t block, runend;
+   size_t bs;
+   ssize_t ret;
+   int merged = 0;
+   int waserror = 0; // positive on error
+
+   if(df->pending == 0) { return 0; }
+   if(blockend > df->nblocks) { blockend = df->nblocks; }
+
+   bs = (1 << df->slog);
+
+   for(block = blockoffset; block < blockend; ) {
+
+      if(df->slots[block] == 0) {
+         block++;
+         continue;
+      }
+
+      if(buf == NULL && unlikely((buf = $bufpool_get(fsdata)) == NULL)) {
+         waserror = ENOMEM;
+         break;
+      }
+
+      // Save the old blocks into the snapshot
+      for(runend = block + 1; runend < blockend && df->slots[runend] != 0; runend++) { }
+      if(unlikely((ret = $b_write(fsdata, &(df->mfd), (runend - block) << df->slog, block << df->slog, $$B_WRITE_DEFAULTS)) != 0)) {
+         waserror = -ret;
+         break;
+      }
+
+      for(; block < runend; block++) {
+         ret = pread(df->fd, buf, bs, $$DELTA_SLOT_POS(df->slog, df->slots[block] - 1) + sizeof(int64_t));
+         if(unlikely(ret != bs)) {
+            waserror = (ret == -1 ? errno : EIO);
+            break;
+         }
+         ret = pwrite(df->mfd.mainfd, buf, bs, block << df->slog);
+         if(unlikely(ret != bs)) {
+            waserror = (ret == -1 ? errno : EIO);
+            break;
+         }
+         merged = 1;
+      }
+      if(waserror != 0) { break; }
+
+   }
+
+   if(buf != NULL) { $bufpool_put(fsdata, buf); }
+
+   // The slots can only be marked once the blocks are safely in the main file
+   if(merged && waserror == 0 && unlikely(fdatasync(df->mfd.mainfd) != 0)) { waserror = errno; }
+
+   for(block = blockoffset; waserror == 0 && block < blockend && df->pending > 0; block++) {
+      if(df->slots[block] != 0 && unlikely((ret = $delta_drop(df, block)) != 0)) { waserror = -ret; }
+   }
+
+   if(waserror != 0) {
+      $dlogi("ERROR delta: merging into '%s' failed with %d = %s\n", df->vpath, waserror, strerror(waserror));
+   }
+   return -waserror;
+}
+
+
+/** Merges all redirected blocks
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error (the last one)
+ */
+static int $delta_merge_all(struct $fsdata_t *fsdata)
+{
+   struct $delta_t *dt;
+   struct $delta_file_t *df;
+   struct $delta_file_t *next;
+   off_t block;
+   int ret;
+   int i;
+   int waserror = 0; // positive on error
+
+   dt = fsdata->delta;
+
+   pthread_mutex_lock(&(dt->mutex));
+
+   for(i = 0; i < $$DELTA_BUCKETS; i++) {
+      for(df = dt->buckets[i]; df != NULL; df = next) {
+
+         df->refs++;
+         pthread_mutex_unlock(&(dt->mutex));
+
+         // The lock is taken even if there is nothing to merge, so that
+         // writes already deciding to redirect blocks are waited for (see $delta_pause)
+         for(block = 0; ; block += $$DELTA_MERGE_BATCH) {
+            pthread_rwlock_wrlock(&(df->rwlock));
+            if(df->pending == 0 || block >= df->nblocks) {
+               pthread_rwlock_unlock(&(df->rwlock));
+               break;
+            }
+            ret = $delta_merge(fsdata, df, block, block + $$DELTA_MERGE_BATCH);
+            pthread_rwlock_unlock(&(df->rwlock));
+            if(unlikely(ret != 0)) {
+               waserror = -ret;
+               break;
+            }
+         }
+
+         pthread_mutex_lock(&(dt->mutex));
+         next = (df->listed ? df->next : dt->buckets[i]); // start again if it has been removed
+         $delta_unref(fsdata, df);
+
+      }
+   }
+
+   pthread_mutex_unlock(&(dt->mutex));
+   return -waserror;
+}
+
+
+/** The main function of the merger thread */
+static void *$delta_merger(void *privdata)
+{
+   struct $fsdata_t *fsdata;
+   struct $delta_t *dt;
+   struct timespec until;
+
+   fsdata = (struct $fsdata_t *)privdata;
+   dt = fsdata->delta;
+
+   pthread_mutex_lock(&(dt->mutex));
+
+   while(dt->stop == 0) {
+
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec += $$DELTA_MERGE_INTERVAL;
+      pthread_cond_timedwait(&(dt->wake), &(dt->mutex), &until);
+      if(dt->stop != 0) { break; }
+
+      pthread_mutex_unlock(&(dt->mutex));
+      $delta_merge_all(fsdata); // errors are logged, and the blocks are tried again later
+      pthread_mutex_lock(&(dt->mutex));
+
+   }
+
+   pthread_mutex_unlock(&(dt->mutex));
+   return NULL;
+}
+
+
+/** Starts the merger thread
+ *
+ * If it cannot be started, no more writes are redirected.
+ */
+static void $delta_start(struct $fsdata_t *fsdata)
+{
+   struct $delta_t *dt;
+   int ret;
+
+   dt = fsdata->delta;
+   if(dt == NULL) { return; }
+
+   if(unlikely((ret = pthread_create(&(dt->thread), NULL, $delta_merger, fsdata)) != 0)) {
+      $dlogi("WARNING Failed to start the merger with %d = %s; continuing without redirect on write\n", ret, strerror(ret));
+      dt->paused = 1;
+      return;
+   }
+   dt->started = 1;
+}
+
+
+/** Stops the merger, merges all blocks, and frees the delta store
+ */
+static void $delta_destroy(struct $fsdata_t *fsdata)
+{
+   struct $delta_t *dt;
+   struct $delta_file_t *df;
+   int i;
+
+   dt = fsdata->delta;
+   if(dt == NULL) { return; }
+
+   pthread_mutex_lock(&(dt->mutex));
+   dt->stop = 1;
+   pthread_cond_broadcast(&(dt->wake));
+   pthread_mutex_unlock(&(dt->mutex));
+
+   if(dt->started) { pthread_join(dt->thread, NULL); }
+
+   if($delta_merge_all(fsdata) != 0) {
+      $dlogi("ERROR delta: blocks left in '%s' will be merged when ESFS is started again\n", dt->dir);
+   }
+
+   // Free the files still open
+   for(i = 0; i < $$DELTA_BUCKETS; i++) {
+      while((df = dt->buckets[i]) != NULL) {
+         if(df->fd != -1) { close(df->fd); }
+         if(df->mfd_open) {
+            $mfd_close_sn(&(df->mfd), fsdata);
+            close(df->mfd.mainfd);
+         }
+         dt->buckets[i] = df->next;
+         pthread_rwlock_destroy(&(df->rwlock));
+         pthread_rwlock_destroy(&(df->mfd.sn_lock));
+         free(df->slots);
+         free(df);
+      }
+   }
+
+   pthread_cond_destroy(&(dt->wake));
+   pthread_mutex_destroy(&(dt->mutex));
+   free(dt);
+   fsdata->delta = NULL;
+}
+
+
+/** Merges all redirected blocks, and stops redirecting writes until $delta_resume is called
+ *
+ * This is called before a snapshot is created, as the old blocks need to be saved
+ * into the snapshot that is the latest when they were redirected.
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $delta_pause(struct $fsdata_t *fsdata)
+{
+   if(fsdata->delta == NULL) { return 0; }
+
+   __atomic_add_fetch(&(fsdata->delta->paused), 1, __ATOMIC_SEQ_CST);
+   return $delta_merge_all(fsdata);
+}
+
+
+/** Allows redirecting writes again (see $delta_pause)
+ */
+static void $delta_resume(struct $fsdata_t *fsdata)
+{
+   if(fsdata->delta == NULL) { return; }
+
+   __atomic_sub_fetch(&(fsdata->delta->paused), 1, __ATOMIC_SEQ_CST);
+}
+
+
+/** Opens the main file and the latest snapshot for a delta file with no blocks,
+ * and sets the blocks that can be redirected.
+ * Call this with the lock of the delta file held for writing.
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $delta_prepare(struct $fsdata_t *fsdata, struct $delta_file_t *df)
+{
+   char fpath[$$PATH_MAX];
+   struct stat mystat;
+   off_t size;
+   int sn_number;
+   int ret;
+
+   if(df->mfd_open == 0) {
+
+      if($map_path(fpath, df->vpath, fsdata) != 0) { return -ENAMETOOLONG; }
+      df->mfd.mainfd = open(fpath, O_RDWR);
+      if(unlikely(df->mfd.mainfd == -1)) { return -errno; }
+      if(unlikely((ret = $mfd_set_locklabel(&(df->mfd), fpath)) != 0 || (ret = $mfd_open_sn(&(df->mfd), df->vpath, fpath, fsdata)) != 0)) {
+         close(df->mfd.mainfd);
+         return ret;
+      }
+      df->mfd_open = 1;
+      df->limit = -1;
+
+   } else {
+
+      // The limit changes with a new snapshot
+      sn_number = df->mfd.sn_number;
+      if(unlikely((ret = $mfd_validate(&(df->mfd), fsdata)) != 0)) {
+         // mfd_validate leaves the mfd closed on error
+         close(df->mfd.mainfd);
+         df->mfd_open = 0;
+         return ret;
+      }
+      if(sn_number != df->mfd.sn_number) { df->limit = -1; }
+
+   }
+
+   if(df->limit >= 0) { return 0; }
+
+   df->limit = 0;
+   df->slog = $$MAP_BL_SLOG(&(df->mfd.mapheader));
+
+   // Nothing to save if there are no snapshots or the file did not exist
+   if(df->mfd.datfd < 0 || $$MAP_HAS_FLAG(&(df->mfd.mapheader), $$MAP_WHOLE)) { return 0; }
+
+   if(unlikely(fstat(df->mfd.mainfd, &mystat) != 0)) { return -errno; }
+   size = df->mfd.mapheader.fstat.st_size;
+   if(mystat.st_size < size) { size = mystat.st_size; }
+
+   if((size >> df->slog) > df->nblocks) {
+      // All slots are unused at this point
+      free(df->slots);
+      df->nblocks = 0;
+      df->slots = calloc(size >> df->slog, sizeof(int));
+      if(df->slots == NULL) { return 0; } // we can do without redirecting
+      df->nblocks = (size >> df->slog);
+   }
+   df->limit = (size >> df->slog);
+
+   return 0;
+}
+
+
+/** Whether $delta_prepare has nothing to do for a delta file */
+#define $$DELTA_PREPARED(fsdata, df) ((df)->mfd_open != 0 && (df)->limit >= 0 && (df)->mfd.sn_number == (fsdata)->sn_number)
+
+
+/** Checks if a write into a main file can go ahead without redirecting it
+ * or merging redirected blocks, which need the lock of the delta file held
+ * for writing. The decision is the same as in $delta_write.
+ *
+ * Call this with the lock of df held for reading.
+ *
+ * Returns:
+ * * 1 - if the main file can be written holding the lock for reading
+ * * 0 - if the write needs $delta_write with the lock held for writing
+ * * -errno - on error
+ */
+static int $delta_write_direct(struct $fsdata_t *fsdata, struct $delta_file_t *df, size_t size, off_t offset)
+{
+   off_t block, lastblock;
+   int ret;
+
+   if(size == 0) { return 1; }
+
+   // See if the write could be redirected
+   if(__atomic_load_n(&(fsdata->delta->paused), __ATOMIC_SEQ_CST) == 0 && df->listed != 0) {
+      if(__atomic_load_n(&(df->pending), __ATOMIC_SEQ_CST) == 0 && !$$DELTA_PREPARED(fsdata, df)) { return 0; }
+
+      lastblock = ((offset + size - 1) >> df->slog);
+      if(lastblock < df->limit) {
+         for(block = (offset >> df->slog); block <= lastblock; block++) {
+            if(df->slots[block] != 0) { return 0; }
+            ret = $b_saved_get(fsdata, &(df->mfd), block);
+            if(unlikely(ret < 0)) { return ret; }
+            if(ret == 0) { return 0; }
+         }
+      }
+   }
+
+   // See if it overwrites redirected blocks
+   if(__atomic_load_n(&(df->pending), __ATOMIC_SEQ_CST) == 0) { return 1; }
+   lastblock = ((offset + size - 1) >> df->slog);
+   if(lastblock >= df->nblocks) { lastblock = df->nblocks - 1; }
+   for(block = (offset >> df->slog); block <= lastblock; block++) {
+      if(df->slots[block] != 0) { return 0; }
+   }
+   return 1;
+}
+
+
+/** Redirects a write into the delta file of a main file if possible
+ *
+ * Call this with the lock of mfd->delta held for writing.
+ * If the write is not redirected, the redirected blocks it overwrites are merged,
+ * and the caller needs to write into the main file.
+ *
+ * Returns:
+ * * the number of bytes written - if the write has been redirected
+ * * 0 - if the main file needs to be written
+ * * -errno - on error
+ */
+static int $delta_write(struct $fsdata_t *fsdata, struct $mfd_t *mfd, const char *buf, size_t size, off_t offset)
+{
+   struct $delta_file_t *df;
+   struct $delta_header_t head;
+   struct iovec iov[2];
+   struct timespec times[2];
+   const char *data;
+   char *blockbuf = NULL;
+   int64_t blocknumber;
+   off_t block, lastblock, blockstart;
+   size_t bs, lo, hi;
+   unsigned long id;
+   ssize_t ret;
+   int redirect = 0;
+
+   df = mfd->delta;
+   if(size == 0) { return 0; }
+
+   // See if the write would save any blocks into the snapshot
+   do {
+      if(__atomic_load_n(&(fsdata->delta->paused), __ATOMIC_SEQ_CST) != 0 || df->listed == 0) { break; }
+      if(df->pending == 0 && unlikely((ret = $delta_prepare(fsdata, df)) != 0)) { return ret; }
+
+      block = (offset >> df->slog);
+      lastblock = ((offset + size - 1) >> df->slog);
+      if(lastblock >= df->limit) { break; }
+
+      for(; block <= lastblock; block++) {
+         if(df->slots[block] != 0) { break; }
+         ret = $b_saved_get(fsdata, &(df->mfd), block);
+         if(unlikely(ret < 0)) { return ret; }
+         if(ret == 0) { break; }
+      }
+      redirect = (block <= lastblock);
+   } while(0);
+
+   if(redirect == 0) {
+      if(df->pending == 0) { return 0; }
+      return $delta_merge(fsdata, df, (offset >> df->slog), ((offset + size - 1) >> df->slog) + 1);
+   }
+
+   // Start a new delta file, or write the header again, as the blocksize may have changed
+   if(df->nslots == 0) {
+      if(df->fd == -1) {
+         id = __atomic_fetch_add(&(fsdata->delta->next_id), 1, __ATOMIC_SEQ_CST);
+         if(snprintf(df->path, $$PATH_MAX, "%s" $$DIRSEP "%lu" $$DELTA_EXT, fsdata->delta->dir, id) >= $$PATH_MAX) { return -ENAMETOOLONG; }
+         df->fd = open(df->path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+         if(unlikely(df->fd == -1)) {
+            ret = errno;
+            $dlogi("ERROR delta: creating '%s' failed with %d = %s\n", df->path, (int)ret, strerror(ret));
+            return -ret;
+         }
+      }
+      memset(&head, 0, sizeof(struct $delta_header_t));
+      memcpy(head.signature, "ESFD", 4); // not 0-terminated
+      head.slog = df->slog;
+      strcpy(head.vpath, df->vpath);
+      ret = pwrite(df->fd, &head, sizeof(struct $delta_header_t), 0);
+      if(unlikely(ret != sizeof(struct $delta_header_t))) { return (ret == -1 ? -errno : -EIO); }
+   }
+
+   bs = (1 << df->slog);
+   ret = 0;
+
+   for(block = (offset >> df->slog); block <= lastblock; block++) {
+
+      blockstart = (block << df->slog);
+      lo = (offset > blockstart ? offset - blockstart : 0);
+      hi = (offset + size < blockstart + bs ? offset + size - blockstart : bs);
+      data = buf + (blockstart + lo - offset);
+
+      // Overwrite the block already redirected
+      if(df->slots[block] != 0) {
+         ret = pwrite(df->fd, data, hi - lo, $$DELTA_SLOT_POS(df->slog, df->slots[block] - 1) + sizeof(int64_t) + lo);
+         if(unlikely(ret != hi - lo)) {
+            ret = (ret == -1 ? -errno : -EIO);
+            break;
+         }
+         continue;
+      }
+
+      // Complete a block partly overwritten from the main file
+      if(lo != 0 || hi != bs) {
+         if(blockbuf == NULL && unlikely((blockbuf = $bufpool_get(fsdata)) == NULL)) {
+            ret = -ENOMEM;
+            break;
+         }
+         ret = pread(df->mfd.mainfd, blockbuf, bs, blockstart);
+         if(unlikely(ret != bs)) {
+            ret = (ret == -1 ? -errno : -EIO);
+            break;
+         }
+         memcpy(blockbuf + lo, data, hi - lo);
+         data = blockbuf;
+      }
+
+      blocknumber = block;
+      iov[0].iov_base = &blocknumber;
+      iov[0].iov_len = sizeof(int64_t);
+      iov[1].iov_base = (void *)data;
+      iov[1].iov_len = bs;
+      ret = pwritev(df->fd, iov, 2, $$DELTA_SLOT_POS(df->slog, df->nslots));
+      if(unlikely(ret != bs + sizeof(int64_t))) {
+         ret = (ret == -1 ? -errno : -EIO);
+         break;
+      }
+
+      df->nslots++;
+      df->slots[block] = df->nslots;
+      __atomic_add_fetch(&(df->pending), 1, __ATOMIC_SEQ_CST);
+
+   }
+
+   if(blockbuf != NULL) { $bufpool_put(fsdata, blockbuf); }
+
+   if(unlikely(ret < 0)) {
+      $dlogi("ERROR delta: redirecting a write into '%s' failed with %d = %s\n", df->vpath, (int)-ret, strerror(-ret));
+      return ret;
+   }
+
+   // The main file is not written, so its modification time is updated here
+   times[0].tv_nsec = UTIME_OMIT;
+   times[1].tv_nsec = UTIME_NOW;
+   futimens(df->mfd.mainfd, times);
+
+   return size;
+}
+
+
+/** Reads a main file, patching it with the redirected blocks
+ *
+ * Returns:
+ * * the number of bytes read - on success
+ * * -errno - on error
+ */
+static int $delta_read(struct $fsdata_t *fsdata, struct $mfd_t *mfd, char *buf, size_t size, off_t offset)
+{
+   struct $delta_file_t *df;
+   off_t block, blockstart;
+   size_t bs, lo, hi;
+   ssize_t ret, len;
+
+   df = mfd->delta;
+
+   pthread_rwlock_rdlock(&(df->rwlock));
+
+   do {
+
+      len = pread(mfd->mainfd, buf, size, offset);
+      if(unlikely(len == -1)) {
+         len = -errno;
+         break;
+      }
+      if(len == 0 || df->pending == 0) { break; }
+
+      bs = (1 << df->slog);
+
+      for(block = (offset >> df->slog); block <= ((offset + len - 1) >> df->slog) && block < df->nblocks; block++) {
+         if(df->slots[block] == 0) { continue; }
+         blockstart = (block << df->slog);
+         lo = (offset > blockstart ? offset - blockstart : 0);
+         hi = (offset + len < blockstart + bs ? offset + len - blockstart : bs);
+         ret = pread(df->fd, buf + (blockstart + lo - offset), hi - lo, $$DELTA_SLOT_POS(df->slog, df->slots[block] - 1) + sizeof(int64_t) + lo);
+         if(unlikely(ret != hi - lo)) {
+            len = (ret == -1 ? -errno : -EIO);
+            break;
+         }
+      }
+
+   } while(0);
+
+   pthread_rwlock_unlock(&(df->rwlock));
+
+   if(unlikely(len < 0)) {
+      $dlogi("ERROR delta: reading '%s' failed with %d = %s\n", df->vpath, (int)-len, strerror(-len));
+   }
+   return len;
+}
+
+
+/** Merges or drops the redirected blocks affected by truncating a main file to newsize
+ *
+ * Call this with the lock of the delta file held for writing, before the old blocks are saved.
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $delta_truncate(struct $fsdata_t *fsdata, struct $delta_file_t *df, off_t newsize)
+{
+   off_t block;
+   int ret;
+
+   block = (newsize >> df->slog);
+   if(df->limit > block) { df->limit = block; }
+
+   if(df->pending == 0) { return 0; }
+
+   // The block containing the new end of the file is kept in part
+   if((newsize & ((1 << df->slog) - 1)) != 0) {
+      if(unlikely((ret = $delta_merge(fsdata, df, block, block + 1)) != 0)) { return ret; }
+      block++;
+   }
+
+   // The rest can be dropped, as the old blocks are still in the main file
+   for(; block < df->nblocks && df->pending > 0; block++) {
+      if(df->slots[block] != 0 && unlikely((ret = $delta_drop(df, block)) != 0)) { return ret; }
+   }
+
+   return 0;
+}
+
+
+/** Calls $delta_truncate for the main file at vpath if it has a delta file
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $delta_truncate_path(struct $fsdata_t *fsdata, const char *vpath, off_t newsize)
+{
+   struct $delta_t *dt;
+   struct $delta_file_t *df;
+   unsigned long hash;
+   int ret;
+
+   dt = fsdata->delta;
+   if(dt == NULL) { return 0; }
+
+   hash = $djb2((const unsigned char *)vpath);
+
+   pthread_mutex_lock(&(dt->mutex));
+   df = *$delta_find(dt, vpath, hash);
+   if(df == NULL) {
+      pthread_mutex_unlock(&(dt->mutex));
+      return 0;
+   }
+   df->refs++;
+   pthread_mutex_unlock(&(dt->mutex));
+
+   pthread_rwlock_wrlock(&(df->rwlock));
+   ret = $delta_truncate(fsdata, df, newsize);
+   pthread_rwlock_unlock(&(df->rwlock));
+
+   pthread_mutex_lock(&(dt->mutex));
+   $delta_unref(fsdata, df);
+   pthread_mutex_unlock(&(dt->mutex));
+
+   return ret;
+}
+
+
+/** Returns the FD of the delta file of a main file for fsync to flush (see $gsync_sync), or -1
+ */
+static int $delta_sync_fd(struct $mfd_t *mfd)
+{
+   int fd;
+
+   if(mfd->delta == NULL) { return -1; }
+
+   pthread_rwlock_rdlock(&(mfd->delta->rwlock));
+   fd = mfd->delta->fd;
+   pthread_rwlock_unlock(&(mfd->delta->rwlock));
+
+   return fd;
+}
+
+
+/** Removes the delta file of a main file that has been unlinked from the hash table,
+ * so that a new file at the same path would get a new one.
+ * The blocks redirected are merged, and the handles still open stop redirecting writes.
+ */
+static void $delta_forget(struct $fsdata_t *fsdata, const char *vpath)
+{
+   struct $delta_t *dt;
+   struct $delta_file_t **link;
+   struct $delta_file_t *df;
+
+   dt = fsdata->delta;
+   if(dt == NULL) { return; }
+
+   pthread_mutex_lock(&(dt->mutex));
+   link = $delta_find(dt, vpath, $djb2((const unsigned char *)vpath));
+   df = *link;
+   if(df == NULL) {
+      pthread_mutex_unlock(&(dt->mutex));
+      return;
+   }
+   *link = df->next;
+   df->listed = 0;
+   df->refs++;
+   pthread_mutex_unlock(&(dt->mutex));
+
+   // Writes redirected in the meantime would be left in a delta file naming the new file
+   pthread_rwlock_wrlock(&(df->rwlock));
+   $delta_merge(fsdata, df, 0, df->nblocks); // errors are logged
+   pthread_rwlock_unlock(&(df->rwlock));
+
+   pthread_mutex_lock(&(dt->mutex));
+   $delta_unref(fsdata, df);
+   pthread_mutex_unlock(&(dt->mutex));
+}
@@ -41,6 +41,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h> // AT_FDCWD
+#include <stdint.h> // uint64_t
 #include <fuse.h>
 #include <libgen.h>
 #include <limits.h> // PATH_MAX
@@ -51,7 +52,13 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h> // utimens
+#include <sys/mman.h> // mmap
+#include <sys/uio.h> // pwritev
+#include <sys/ioctl.h> // ioctl
+#include <linux/fs.h> // FICLONERANGE
 #include <sys/select.h> // pselect
+#include <time.h> // clock_gettime
+#include <zlib.h> // compress2, uncompress
 #if $$DEBUG > 0
 #  include <sys/syscall.h> // for gettid only
 #endif
@@ -62,9 +69,15 @@
 #include "util_c.c"
 #include "mflock_c.c"
 #include "util_locking_c.c"
+#include "bcache_c.c"
+#include "bufpool_c.c"
+#include "dedup_c.c"
 #include "snapshot_c.c"
 #include "mfd_c.c"
 #include "block_c.c"
+#include "delta_c.c"
+#include "gsync_c.c"
+#include "prefetch_c.c"
 #include "fuse_fd_close_c.c"
 #include "fuse_fd_read_c.c"
 #include "fuse_fd_write_c.c"
@@ -125,6 +138,18 @@ void *$init(struct fuse_conn_info *conn)
 
    fsdata = ((struct $fsdata_t *) fuse_get_context()->private_data);
 
+#ifdef FUSE_CAP_SPLICE_WRITE
+   // Allow FUSE to splice the data returned by $read_buf into the kernel,
+   // and the data received by $write_buf from the kernel
+   conn->want |= (conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE | FUSE_CAP_SPLICE_READ));
+#endif
+
+   // Threads need to be started here as FUSE may have forked since main()
+   if($prefetch_init(fsdata) != 0) {
+      $dlogi("WARNING Failed to start the prefetch workers; continuing without prefetching\n");
+   }
+   $delta_start(fsdata);
+
    $dlogi("Initialised ESFS\n");
 
    return fsdata;
@@ -143,11 +168,26 @@ void $destroy(void *privdata)
    // TODO free all memory
 
    struct $fsdata_t *fsdata;
+#if $$DEBUG > 0
+   char *report;
+#endif
 
    fsdata = ((struct $fsdata_t *) privdata);
 
+   $prefetch_destroy(fsdata);
+   $delta_destroy(fsdata);
+   $gsync_destroy(fsdata);
+#if $$DEBUG > 0
+   if((report = malloc($$LOCKSTAT_MAX)) != NULL) {
+      $mflock_stats(fsdata, report, $$LOCKSTAT_MAX);
+      $dlogi("Lock contention:\n%s", report);
+      free(report);
+   }
+#endif
    $mflock_destroy(fsdata);
-   $b_destroy_block_buffer(fsdata);
+   $bufpool_destroy(fsdata);
+   $dedup_destroy(fsdata);
+   $bcache_destroy(fsdata);
 
    $dlogi("Bye!\n");
 
@@ -176,7 +216,13 @@ struct fuse_operations $oper = {
    .truncate = $truncate,
    .open    = $open,
    .read    = $read,
+#if FUSE_VERSION >= 29
+   .read_buf = $read_buf,
+#endif
    .write   = $write,
+#if FUSE_VERSION >= 29
+   .write_buf = $write_buf,
+#endif
    .statfs  = $statfs,
    .flush   = $flush,
    .release = $release,
@@ -201,7 +247,7 @@ struct fuse_operations $oper = {
 
 void $usage(void)
 {
-   fprintf(stderr, "USAGE:  esfs [ FUSE and mount options ] [--local-log] (RootDir) (MountPoint)\n\n");
+   fprintf(stderr, "USAGE:  esfs [ FUSE and mount options ] [--local-log] [--cache-size=MB] [--prefetch=BLOCKS] [--hugepages] [--dedup] [--compress] [--block-size=KB] [--save-pages] [--redirect-on-write] [--dat-prealloc=MB] (RootDir) (MountPoint)\n\n");
 }
 
 
@@ -209,6 +255,9 @@ int main(int argc, char *argv[])
 {
    int ret;
    int local_log = 0;
+   int hugepages = 0;
+   int dedup = 0;
+   int redirect = 0;
    struct $fsdata_t *fsdata;
 
    // The FS doesn't do any access checking on its own (the comment
@@ -269,9 +318,44 @@ int main(int argc, char *argv[])
    argv[argc - 1] = NULL;
    argc--;
 
-   // Pull the optional local-log argument out of the argument list
-   if(strcmp(argv[argc - 2], "--local-log") == 0) {
-      local_log = 1;
+   fsdata->bcache_size = 0;
+   fsdata->b_copy_unsupported = 0;
+   fsdata->compress = 0;
+   fsdata->bl_slog = $$BL_SLOG;
+   fsdata->save_pages = 0;
+   fsdata->dat_prealloc = ((off_t)$$DAT_PREALLOC) << 20;
+   fsdata->prefetch_blocks = $$PREFETCH_BLOCKS;
+
+   // Pull the optional ESFS arguments out of the argument list
+   while(argc > 2 && strncmp(argv[argc - 2], "--", 2) == 0) {
+      if(strcmp(argv[argc - 2], "--local-log") == 0) {
+         local_log = 1;
+      } else if(strncmp(argv[argc - 2], "--cache-size=", 13) == 0) {
+         fsdata->bcache_size = ((size_t)strtoul(argv[argc - 2] + 13, NULL, 10)) << 20;
+      } else if(strncmp(argv[argc - 2], "--prefetch=", 11) == 0) {
+         fsdata->prefetch_blocks = atoi(argv[argc - 2] + 11);
+      } else if(strcmp(argv[argc - 2], "--hugepages") == 0) {
+         hugepages = 1;
+      } else if(strcmp(argv[argc - 2], "--dedup") == 0) {
+         dedup = 1;
+      } else if(strcmp(argv[argc - 2], "--compress") == 0) {
+         fsdata->compress = 1;
+      } else if(strcmp(argv[argc - 2], "--save-pages") == 0) {
+         fsdata->save_pages = 1;
+      } else if(strcmp(argv[argc - 2], "--redirect-on-write") == 0) {
+         redirect = 1;
+      } else if(strncmp(argv[argc - 2], "--dat-prealloc=", 15) == 0) {
+         fsdata->dat_prealloc = ((off_t)strtoul(argv[argc - 2] + 15, NULL, 10)) << 20;
+      } else if(strncmp(argv[argc - 2], "--block-size=", 13) == 0) {
+         ret = atoi(argv[argc - 2] + 13);
+         for(fsdata->bl_slog = $$BL_SLOG_MIN; fsdata->bl_slog < $$BL_SLOG && (1 << fsdata->bl_slog) != (ret << 10); fsdata->bl_slog++) { }
+         if((1 << fsdata->bl_slog) != (ret << 10)) {
+            fprintf(stderr, "The block size must be a power of 2 between %d and %d KB. Aborting.\n", (1 << $$BL_SLOG_MIN) >> 10, $$BL_S >> 10);
+            return 1;
+         }
+      } else {
+         break;
+      }
       argv[argc - 2] = argv[argc - 1];
       argv[argc - 1] = NULL;
       argc--;
@@ -302,8 +386,13 @@ int main(int argc, char *argv[])
       return 1;
    }
 
-   if($b_init_block_buffer(fsdata) != 0){
-      fprintf(stderr, "Failed to initialise the global block buffer. Aborting.\n");
+   if($dedup_init(fsdata, dedup) != 0) {
+      fprintf(stderr, "Failed to open the deduplication store, please check the logs. Aborting.\n");
+      return 1;
+   }
+
+   if($bufpool_init(fsdata, hugepages) != 0){
+      fprintf(stderr, "Failed to initialise the block buffers. Aborting.\n");
       return 1;
    }
 
@@ -312,6 +401,21 @@ int main(int argc, char *argv[])
       return 1;
    }
 
+   if($bcache_init(fsdata) != 0) {
+      fprintf(stderr, "Failed to initialise the block cache. Aborting.\n");
+      return 1;
+   }
+
+   if($gsync_init(fsdata) != 0) {
+      fprintf(stderr, "Failed to initialise the group commit engine. Aborting.\n");
+      return 1;
+   }
+
+   if($delta_init(fsdata, redirect) != 0) {
+      fprintf(stderr, "Failed to merge the redirected blocks or open the delta store, please check the logs. Aborting.\n");
+      return 1;
+   }
+
    // turn over control to fuse
    // user_data   user data supplied in the context during the init() method
    // Returns: 0 on success, nonzero on failure
@@ -94,11 +94,15 @@ int $release(const char *path, struct fuse_file_info *fi)
 
       $dlogdbg("* release.main(path=\"%s\", fd=%d)\n", path, mfd->mainfd);
       ret = $mfd_close_sn(mfd, fsdata);
+      pthread_rwlock_destroy(&(mfd->sn_lock));
       if(unlikely(close(mfd->mainfd) != 0)) { ret = -errno; }
+      $mfd_open_count_del(fsdata, mfd->locklabel);
+      $delta_put(fsdata, mfd);
 
    } else if(mfd->is_main == $$mfd_sn_full) {
 
       $dlogdbg("* release.sn(path=\"%s\")\n", path);
+      $prefetch_forget(fsdata, mfd);
       ret = $mfd_destroy_sn_steps(mfd, fsdata);
 
    } else {
@@ -118,11 +122,15 @@ int $release(const char *path, struct fuse_file_info *fi)
  * If the datasync parameter is non-zero, then only the user data
  * should be flushed, not the meta data.
  *
+ * The files are flushed together with those of other fsync calls
+ * (see gsync.c), in the order: dat, deduplication store, map, delta and main file.
+ *
  * Changed in version 2.2
  */
 int $fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
-   int waserror = 0;
+   struct $gsync_req_t req;
+   int ret;
    $$DFSDATA_MFD
 
    $dlogdbg("* fsync(path=\"%s\", datasync=%d)\n", path, datasync);
@@ -132,24 +140,23 @@ int $fsync(const char *path, int datasync, struct fuse_file_info *fi)
       return -EBADE;
    }
 
-   if(datasync) {
-      // fdatasync()  is  similar  to  fsync(),  but  does  not flush modified metadata unless that metadata is needed
-      if(fdatasync(mfd->mainfd) != 0) { waserror = errno; }
-      if(mfd->is_main == $$mfd_main) {
-         if(unlikely(mfd->mapfd >= 0 && fdatasync(mfd->mapfd) != 0)) { waserror = errno; }
-         if(unlikely(mfd->datfd >= 0 && fdatasync(mfd->datfd) != 0)) { waserror = errno; }
-      }
-      return -waserror;
-   }
-
-   // fsync() transfers ("flushes") all modified in-core data of (i.e., modified buffer cache pages for)
-   // the file referred to by the file descriptor fd to the disk device
-   if(fsync(mfd->mainfd) != 0) { waserror = errno; }
-   if(mfd->is_main == $$mfd_main) {
-      if(unlikely(mfd->mapfd >= 0 && fsync(mfd->mapfd) != 0)) { waserror = errno; }
-      if(unlikely(mfd->datfd >= 0 && fsync(mfd->datfd) != 0)) { waserror = errno; }
-   }
-   return -waserror;
+   // fdatasync()  is  similar  to  fsync(),  but  does  not flush modified metadata unless that metadata is needed
+   req.datasync = (datasync != 0);
+   req.fds[$$GSYNC_DELTA] = $delta_sync_fd(mfd); // blocks redirected are in the delta file
+
+   // The dat and map files cannot be closed by $mfd_validate while we flush them.
+   // The lock of the delta file is not held here, as $_write_delta takes it first.
+   pthread_rwlock_rdlock(&(mfd->sn_lock));
+   req.fds[$$GSYNC_DAT] = (mfd->datfd >= 0 ? mfd->datfd : -1);
+   // blocks saved in the deduplication store are pointed to from the map file
+   req.fds[$$GSYNC_DEDUP_DAT] = (mfd->mapfd >= 0 && fsdata->dedup != NULL ? fsdata->dedup->datfd : -1);
+   req.fds[$$GSYNC_DEDUP_INDEX] = (mfd->mapfd >= 0 && fsdata->dedup != NULL ? fsdata->dedup->idxfd : -1);
+   req.fds[$$GSYNC_MAP] = (mfd->mapfd >= 0 ? mfd->mapfd : -1);
+   req.fds[$$GSYNC_MAIN] = mfd->mainfd;
+
+   ret = $gsync_sync(fsdata, &req);
+   $mfd_sn_release(mfd);
+   return ret;
 }
 
 
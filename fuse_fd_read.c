@@ -61,6 +61,8 @@ int $read(const char *path, char *buf, size_t size, off_t offset, struct fuse_fi
 
    if(mfd->is_main == $$mfd_main) {
 
+      if($$DELTA_PENDING(mfd)) { return $delta_read(fsdata, mfd, buf, size, offset); }
+
       ret = pread(mfd->mainfd, buf, size, offset);
       if(ret >= 0) {
          $dlogdbg("pread returned %d bytes\n", ret);
@@ -83,7 +85,9 @@ int $read(const char *path, char *buf, size_t size, off_t offset, struct fuse_fi
          return ret;
       }
 
-      return $b_read(buf, fsdata, mfd, size, offset);
+      ret = $b_read(buf, fsdata, mfd, size, offset);
+      if(ret > 0) { $prefetch_read(fsdata, mfd, offset, ret); }
+      return ret;
 
    }
 
@@ -93,6 +97,72 @@ int $read(const char *path, char *buf, size_t size, off_t offset, struct fuse_fi
 }
 
 
+#if FUSE_VERSION >= 29
+/** Store data from an open file in a buffer
+ *
+ * Similar to the read() method, but data is stored and
+ * returned in a generic buffer.
+ *
+ * No actual copying of data has to take place, the source
+ * file descriptor may simply be stored in the buffer for
+ * later data transfer.
+ *
+ * The buffer must be allocated dynamically and stored at the
+ * location pointed to by bufp.  If the buffer contains memory
+ * regions, they too must be allocated using malloc().  The
+ * allocated memory will be freed by the caller.
+ *
+ * Introduced in version 2.9
+ *
+ * ESFS: For main files, we return the file descriptor so that FUSE can
+ * splice the data without copying it through our memory (see $init).
+ * Files in the snapshots are assembled from many files, so these are
+ * read into memory using $read.
+ */
+int $read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+   int ret;
+   struct fuse_bufvec *src;
+   struct $mfd_t *mfd = $$MFD;
+#if $$DEBUG > 1
+   $$DFSDATA // only used for logging
+#endif
+
+   $dlogdbg("* read_buf(path=\"%s\", size=%d, offset=%lld)\n", path, (int)size, (long long int)offset);
+
+   src = malloc(sizeof(struct fuse_bufvec));
+   if(src == NULL) { return -ENOMEM; }
+   *src = FUSE_BUFVEC_INIT(size);
+
+   // Main files with redirected blocks are read into memory
+   if(mfd->is_main == $$mfd_main && !$$DELTA_PENDING(mfd)) {
+      src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      src->buf[0].fd = mfd->mainfd;
+      src->buf[0].pos = offset;
+      *bufp = src;
+      return 0;
+   }
+
+   src->buf[0].mem = malloc(size);
+   if(src->buf[0].mem == NULL) {
+      free(src);
+      return -ENOMEM;
+   }
+
+   ret = $read(path, src->buf[0].mem, size, offset, fi);
+   if(ret < 0) {
+      free(src->buf[0].mem);
+      free(src);
+      return ret;
+   }
+
+   src->buf[0].size = ret;
+   *bufp = src;
+   return 0;
+}
+#endif
+
+
 #define $$READDIR_F_DEFAULTS 0
 #define $$READDIR_F_SKIP_SNROOT 1
 
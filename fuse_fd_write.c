@@ -35,6 +35,83 @@
  */
 
 
+/** Helper function: Prepares writing to a main file by saving the blocks
+ * that will be overwritten into the latest snapshot
+ *
+ * Returns 0 or -errno.
+ */
+static inline int $_write_save(
+   const char *path,
+   struct $fsdata_t *fsdata,
+   struct $mfd_t *mfd,
+   size_t size,
+   off_t offset
+)
+{
+   int ret;
+
+   // Only allow writes on main FDs
+   if(mfd->is_main != $$mfd_main) { return -EACCES; }
+
+   // Verify that we're writing into the latest snapshot
+   if(unlikely((ret = $mfd_sn_hold(mfd, fsdata)) != 0)) {
+      $dlogi("ERROR write(%s): mfd_sn_hold failed with %d = %s\n", path, -ret, strerror(-ret));
+      return ret;
+   }
+
+   // Save blocks into snapshot
+   ret = $b_write(fsdata, mfd, size, offset, $$B_WRITE_DEFAULTS);
+   $mfd_sn_release(mfd);
+   if(unlikely(ret != 0)) {
+      $dlogi("ERROR write(%s): b_write failed with %d = %s\n", path, -ret, strerror(-ret));
+      return ret;
+   }
+
+   return 0;
+}
+
+
+/** Helper function: Writes to a main file, redirecting the write if possible (see delta.c)
+ *
+ * Returns the number of bytes written or -errno.
+ */
+static inline int $_write_delta(
+   const char *path,
+   struct $fsdata_t *fsdata,
+   struct $mfd_t *mfd,
+   const char *buf,
+   size_t size,
+   off_t offset
+)
+{
+   int ret;
+
+   pthread_rwlock_rdlock(&(mfd->delta->rwlock));
+
+   do {
+
+      if((ret = $delta_write_direct(fsdata, mfd->delta, size, offset)) < 0) { break; }
+      if(ret == 0) {
+         // Redirecting or merging needs the lock for writing. As the delta file
+         // can change before we get it, $delta_write decides again.
+         pthread_rwlock_unlock(&(mfd->delta->rwlock));
+         pthread_rwlock_wrlock(&(mfd->delta->rwlock));
+         if((ret = $delta_write(fsdata, mfd, buf, size, offset)) != 0) { break; }
+      }
+
+      // The write has not been redirected
+      if((ret = $_write_save(path, fsdata, mfd, size, offset)) != 0) { break; }
+
+      ret = pwrite(mfd->mainfd, buf, size, offset);
+      if(unlikely(ret < 0)) { ret = -errno; }
+
+   } while(0);
+
+   pthread_rwlock_unlock(&(mfd->delta->rwlock));
+   return ret;
+}
+
+
 /** Write data to an open file
  *
  * FUSE: Write should return exactly the number of bytes requested
@@ -57,22 +134,11 @@ int $write(
    int ret;
    $$DFSDATA_MFD
 
-   // Only allow writes on main FDs
-   if(mfd->is_main != $$mfd_main) { return -EACCES; }
+   $dlogdbg("* write(path=\"%s\", size=%d, offset=%lld)\n", path, (int)size, (long long int)offset);
 
-   $dlogdbg("* write(path=\"%s\", size=%d, offset=%lld, main fd=%d)\n", path, (int)size, (long long int)offset, mfd->mainfd);
+   if(mfd->is_main == $$mfd_main && mfd->delta != NULL) { return $_write_delta(path, fsdata, mfd, buf, size, offset); }
 
-   // Verify that we're writing into the latest snapshot
-   if(unlikely((ret = $mfd_validate(mfd, fsdata)) != 0)) {
-      $dlogi("ERROR write(%s): mfd_validate failed with %d = %s\n", path, -ret, strerror(-ret));
-      return ret;
-   }
-
-   // Save blocks into snapshot
-   if(unlikely((ret = $b_write(fsdata, mfd, size, offset, $$B_WRITE_DEFAULTS)) != 0)) {
-      $dlogi("ERROR write(%s): b_write failed with %d = %s\n", path, -ret, strerror(-ret));
-      return ret;
-   }
+   if((ret = $_write_save(path, fsdata, mfd, size, offset)) != 0) { return ret; }
 
    ret = pwrite(mfd->mainfd, buf, size, offset);
    if(ret >= 0) {
@@ -89,6 +155,59 @@ int $write(
 }
 
 
+#if FUSE_VERSION >= 29
+/** Write contents of buffer to an open file
+ *
+ * Similar to the write() method, but data is supplied in a
+ * generic buffer.  Use fuse_buf_copy() to transfer data to
+ * the destination.
+ *
+ * Introduced in version 2.9
+ *
+ * ESFS: After the old blocks have been saved, the data is transferred
+ * into the main file directly, which allows FUSE to splice it from
+ * the kernel (see $init). With redirect on write, the data is copied
+ * into memory first.
+ */
+int $write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+{
+   int ret;
+   size_t size;
+   struct fuse_bufvec dst;
+   char *mem;
+   $$DFSDATA_MFD
+
+   size = fuse_buf_size(buf);
+
+   $dlogdbg("* write_buf(path=\"%s\", size=%d, offset=%lld)\n", path, (int)size, (long long int)offset);
+
+   if(mfd->is_main == $$mfd_main && mfd->delta != NULL) {
+      mem = malloc(size);
+      if(mem == NULL) { return -ENOMEM; }
+      dst = FUSE_BUFVEC_INIT(size);
+      dst.buf[0].mem = mem;
+      ret = fuse_buf_copy(&dst, buf, 0);
+      if(ret >= 0) { ret = $_write_delta(path, fsdata, mfd, mem, ret, offset); }
+      free(mem);
+      return ret;
+   }
+
+   if((ret = $_write_save(path, fsdata, mfd, size, offset)) != 0) { return ret; }
+
+   dst = FUSE_BUFVEC_INIT(size);
+   dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+   dst.buf[0].fd = mfd->mainfd;
+   dst.buf[0].pos = offset;
+
+   ret = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+   if(unlikely(ret < 0)) {
+      $dlogdbg("WARNING fuse_buf_copy failed with %d = %s\n", -ret, strerror(-ret));
+   }
+   return ret;
+}
+#endif
+
+
 /**
  * Change the size of an open file
  *
@@ -104,23 +223,41 @@ int $write(
 int $ftruncate(const char *path, off_t newsize, struct fuse_file_info *fi)
 {
    int ret;
+   struct $delta_file_t *df;
    $$DFSDATA_MFD
 
    $dlogdbg("* ftruncate(path=\"%s\", newsize=%zu, FD = %d)\n", path, newsize, mfd->mainfd);
 
-   // Verify that we're writing into the latest snapshot
-   if(unlikely((ret = $mfd_validate(mfd, fsdata)) != 0)) {
-      $dlogi("ERROR ftruncate(%s): mfd_validate failed with %d = %s\n", path, -ret, strerror(-ret));
-      return ret;
-   }
+   df = (mfd->is_main == $$mfd_main ? mfd->delta : NULL);
+   if(df != NULL) { pthread_rwlock_wrlock(&(df->rwlock)); }
 
-   if(unlikely((ret = $b_truncate(fsdata, mfd, newsize, $$B_WRITE_DEFAULTS)) != 0)) {
-      $dlogi("ERROR ftruncate(%s): b_truncate failed with %d = %s\n", path, -ret, strerror(-ret));
-      return ret;
-   }
+   do {
 
-   if(unlikely(ftruncate(mfd->mainfd, newsize) != 0)) { return -errno; }
+      // Verify that we're writing into the latest snapshot
+      if(unlikely((ret = $mfd_sn_hold(mfd, fsdata)) != 0)) {
+         $dlogi("ERROR ftruncate(%s): mfd_sn_hold failed with %d = %s\n", path, -ret, strerror(-ret));
+         break;
+      }
 
-   return 0;
+      if(df != NULL && unlikely((ret = $delta_truncate(fsdata, df, newsize)) != 0)) {
+         $mfd_sn_release(mfd);
+         $dlogi("ERROR ftruncate(%s): delta_truncate failed with %d = %s\n", path, -ret, strerror(-ret));
+         break;
+      }
+
+      ret = $b_truncate(fsdata, mfd, newsize, $$B_WRITE_DEFAULTS);
+      $mfd_sn_release(mfd);
+      if(unlikely(ret != 0)) {
+         $dlogi("ERROR ftruncate(%s): b_truncate failed with %d = %s\n", path, -ret, strerror(-ret));
+         break;
+      }
+
+      if(unlikely(ftruncate(mfd->mainfd, newsize) != 0)) { ret = -errno; }
+
+   } while(0);
+
+   if(df != NULL) { pthread_rwlock_unlock(&(df->rwlock)); }
+
+   return ret;
 }
 
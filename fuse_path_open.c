@@ -35,18 +35,147 @@
  */
 
 
+#define $$OTC_DEFAULTS 0
+#define $$OTC_MOVE 1 // if the file is truncated to 0, it can be moved into the snapshot instead, and is then removed
+#define $$OTC_RECREATE 2 // an empty file is created in place of the file moved
+
+/** Helper function: Replaces the dat file of a file moved into the snapshot with an empty one
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static inline int $_move_to_snapshot_undo(const char *fdat, const char *ftmp)
+{
+   int fd;
+
+   if((fd = open(ftmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU)) == -1) { return -errno; }
+   close(fd);
+   if(rename(ftmp, fdat) != 0) {
+      fd = errno;
+      unlink(ftmp);
+      return -fd;
+   }
+   return 0;
+}
+
+
+/** Helper function: Moves a main file into the latest snapshot instead of saving its blocks
+ *
+ * This is done if no blocks of the file have been saved yet, and the file is not open.
+ * The main file is renamed to become the dat file, and $$MAP_WHOLE is set in the map file,
+ * so that the whole file is read from there (see $b_read_find).
+ * With $$OTC_RECREATE, an empty file with the same permissions is created in its place;
+ * this is not done if the file belongs to someone else, as its owner could not be kept.
+ * Should be called with the lock of the file and the lock of its path held.
+ *
+ * The main file is first linked to a temporary name in the snapshot, which is renamed
+ * over the dat file, and $$MAP_WHOLE is flushed before the main file is removed or replaced.
+ * Until then, the dat file and the main file are the same, so the snapshot can be read
+ * after a crash whether or not the flag has been saved.
+ *
+ * Returns:
+ * * 1 - if the file has been moved
+ * * 0 - if the file cannot be moved and its blocks need to be saved
+ * * -errno - on error
+ */
+static inline int $_move_to_snapshot(struct $fsdata_t *fsdata, struct $mfd_t *mfd, const char *fpath, int flags)
+{
+   struct stat mystat;
+   char fdat[$$PATH_MAX];
+   char ftmp[$$PATH_MAX];
+   char fnew[$$PATH_MAX];
+   int fd, ret;
+
+   if(mfd->datfd < 0 || __atomic_load_n(&(fsdata->open_counts[$mflock_hash(mfd->locklabel) & ($$OPEN_COUNTS - 1)]), __ATOMIC_SEQ_CST) != 0) { return 0; }
+
+   // See if any blocks have been saved
+   if(unlikely(fstat(mfd->mapfd, &mystat) != 0)) { return -errno; }
+   if(mystat.st_size > sizeof(struct $mapheader_t)) { return 0; }
+   if(__atomic_load_n(&(mfd->dattail->tail), __ATOMIC_RELAXED) != 0) { return 0; }
+
+   if(unlikely(lstat(fpath, &mystat) != 0)) { return (errno == ENOENT ? 0 : -errno); }
+   if(!S_ISREG(mystat.st_mode) || mystat.st_nlink != 1) { return 0; }
+   if((flags & $$OTC_RECREATE) && (mystat.st_uid != geteuid() || mystat.st_gid != getegid())) { return 0; }
+
+   if($get_dat_prefix_path(fdat, mfd->vpath, fsdata->sn_lat_dir, fsdata->sn_lat_dir_len) != 0) { return -ENAMETOOLONG; }
+   if($get_hid_path(ftmp, fdat) != 0) { return -ENAMETOOLONG; } // hidden by $sn_filter_name
+   if((flags & $$OTC_RECREATE) && $get_hid_path(fnew, fpath) != 0) { return -ENAMETOOLONG; }
+
+   // Link the main file into the snapshot. This replaces the empty dat file
+   unlink(ftmp); // left by a crash
+   if(link(fpath, ftmp) != 0) {
+      ret = errno;
+      $dlogdbg("_move_to_snapshot(%s): link failed with %d = %s\n", fpath, ret, strerror(ret));
+      return ((ret == EXDEV || ret == EPERM || ret == EMLINK) ? 0 : -ret);
+   }
+   if(rename(ftmp, fdat) != 0) {
+      ret = errno;
+      $dlogi("ERROR _move_to_snapshot(%s): rename failed with %d = %s\n", fpath, ret, strerror(ret));
+      unlink(ftmp);
+      return -ret;
+   }
+
+   mfd->mapheader.$version = $$MAP_VERSION_FLAGS;
+   mfd->mapheader.flags |= $$MAP_WHOLE;
+   ret = $mfd_save_mapheader(mfd, fsdata);
+   if(ret == 0 && unlikely(fdatasync(mfd->mapfd) != 0)) { ret = -errno; }
+   if(unlikely(ret != 0)) {
+      $dlogi("ERROR _move_to_snapshot(%s): saving the map header failed with %d = %s\n", fpath, -ret, strerror(-ret));
+      mfd->mapheader.flags &= ~$$MAP_WHOLE;
+      if($mfd_save_mapheader(mfd, fsdata) == 0) { $_move_to_snapshot_undo(fdat, ftmp); }
+      return ret;
+   }
+
+   // Remove the main file or replace it with an empty one
+   if(flags & $$OTC_RECREATE) {
+      fd = open(fnew, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+      if(fd == -1 || fchmod(fd, mystat.st_mode & 07777) != 0 || rename(fnew, fpath) != 0) { ret = errno; }
+      if(fd != -1) { close(fd); }
+      if(ret != 0) { unlink(fnew); }
+   } else if(unlink(fpath) != 0) {
+      ret = errno;
+   }
+   if(unlikely(ret != 0)) {
+      $dlogi("ERROR _move_to_snapshot(%s): removing the main file failed with %d = %s\n", fpath, ret, strerror(ret));
+      // The main file is unchanged, so it should not be read from the snapshot
+      mfd->mapheader.flags &= ~$$MAP_WHOLE;
+      if($mfd_save_mapheader(mfd, fsdata) == 0 && fdatasync(mfd->mapfd) == 0) { $_move_to_snapshot_undo(fdat, ftmp); }
+      return -ret;
+   }
+
+   $dlogdbg("_move_to_snapshot(%s): moved to '%s'\n", fpath, fdat);
+   return 1;
+}
+
+
 /* Helper function: Opens a file, saves the part to be truncated, closes it.
- * Returns 0 or -errno.
+ *
+ * Flags: $$OTC_DEFAULTS, or $$OTC_MOVE optionally with $$OTC_RECREATE (see $_move_to_snapshot)
+ *
+ * Returns 0, 1 if the file has been moved into the snapshot and removed, or -errno.
  */
-static inline int $_open_truncate_close(struct $fsdata_t *fsdata, const char *path, const char *fpath, off_t newsize)
+static inline int $_open_truncate_close(struct $fsdata_t *fsdata, const char *path, const char *fpath, off_t newsize, int flags)
 {
    struct $mfd_t myfd;
    struct $mfd_t *mfd;
+   $$LOCKLABEL_T pathlabel;
    int ret;
+   int lock, pathlock = -1;
+   int moved = 0;
    int waserror = 0; /* positive on error */
 
    mfd = &myfd;
 
+   // Blocks redirected after the new end of the file would be lost
+   if(unlikely((ret = $delta_truncate_path(fsdata, path, newsize)) != 0)) {
+      return ret;
+   }
+
+   if(unlikely((ret = $mfd_set_locklabel(mfd, fpath)) != 0)) {
+      return ret;
+   }
+
    if(unlikely((ret = $mfd_open_sn(mfd, path, fpath, fsdata)) != 0)) {
       return ret;
    }
@@ -63,6 +192,37 @@ static inline int $_open_truncate_close(struct $fsdata_t *fsdata, const char *pa
          break;
       }
 
+      // Try to move the whole file into the snapshot
+      if(newsize == 0 && (flags & $$OTC_MOVE) && !$$MAP_HAS_FLAG(&(mfd->mapheader), $$MAP_WHOLE)) {
+         // The lock of the file keeps it from being opened (see $mfd_open_count_add),
+         // and the lock of the path keeps its map file from being opened (see $mfd_open_sn).
+         // They are the same if the main file no longer exists.
+         if(unlikely((lock = $mflock_lock(fsdata, mfd->locklabel)) < 0)) {
+            waserror = -lock;
+            break;
+         }
+         pathlabel = $string2locklabel(fpath);
+         if(!$$LOCKLABEL_EQ(pathlabel, mfd->locklabel) && unlikely((pathlock = $mflock_lock(fsdata, pathlabel)) < 0)) {
+            $mflock_unlock(fsdata, lock);
+            waserror = -pathlock;
+            break;
+         }
+         ret = $_move_to_snapshot(fsdata, mfd, fpath, flags);
+         if(pathlock >= 0 && unlikely((pathlock = $mflock_unlock(fsdata, pathlock)) < 0) && ret >= 0) { ret = pathlock; }
+         if(unlikely((lock = $mflock_unlock(fsdata, lock)) < 0) && ret >= 0) { ret = lock; }
+         if(unlikely(ret < 0)) {
+            waserror = -ret;
+            $dlogi("ERROR _open_truncate_close(%s): _move_to_snapshot failed err %d = %s\n", fpath, waserror, strerror(waserror));
+            break;
+         }
+         if(ret == 1) {
+            // The delta file still refers to the file moved
+            $delta_forget(fsdata, path);
+            moved = ((flags & $$OTC_RECREATE) ? 0 : 1);
+            break;
+         }
+      }
+
       ret = open(fpath, O_RDONLY);
       if(unlikely(ret == -1)) {
          waserror = errno;
@@ -94,9 +254,8 @@ static inline int $_open_truncate_close(struct $fsdata_t *fsdata, const char *pa
       return ret;
    }
 
-   return -waserror;
-
-   // TODO add optimisation: set whole_saved if newsize==0
+   if(waserror != 0) { return -waserror; }
+   return moved;
 }
 
 
@@ -156,7 +315,15 @@ int $open(const char *path, struct fuse_file_info *fi)
          break;
       }
 
+      if(unlikely((snret = $b_index_build(fsdata, mfd)) != 0)) {
+         $dlogi("ERROR open.sn: b_index_build failed with %d = %s\n", -snret, strerror(-snret));
+         $mfd_destroy_sn_steps(mfd, fsdata);
+         free(mfd);
+         break;
+      }
+
       mfd->is_main = $$mfd_sn_full;
+      $prefetch_init_mfd(mfd);
 
       fi->fh = (intptr_t) mfd;
       fi->keep_cache = 1;
@@ -172,6 +339,17 @@ int $open(const char *path, struct fuse_file_info *fi)
    mfd = malloc(sizeof(struct $mfd_t));
    if(mfd == NULL) { return -ENOMEM; }
 
+   // Register the open file so that it would not be moved into a snapshot (see $_move_to_snapshot)
+   if(unlikely((fd = $mfd_set_locklabel(mfd, fpath)) != 0 || (fd = $mfd_open_count_add(fsdata, mfd->locklabel)) != 0)) {
+      free(mfd);
+      return fd;
+   }
+   if(unlikely((fd = $delta_get(fsdata, mfd, path)) != 0)) {
+      $mfd_open_count_del(fsdata, mfd->locklabel);
+      free(mfd);
+      return fd;
+   }
+
    do {
       flags = fi->flags;
 
@@ -212,6 +390,12 @@ int $open(const char *path, struct fuse_file_info *fi)
 
          mfd->mainfd = fd;
 
+         if(unlikely((fd = $mfd_check_locklabel(fsdata, mfd)) != 0)) {
+            waserror = -fd;
+            close(mfd->mainfd);
+            break;
+         }
+
       } while(0);
 
       if(waserror != 0) {
@@ -223,13 +407,16 @@ int $open(const char *path, struct fuse_file_info *fi)
    } while(0);
 
    if(waserror != 0) {
+      $delta_put(fsdata, mfd);
+      $mfd_open_count_del(fsdata, mfd->locklabel);
       free(mfd);
       return -waserror;
    }
 
-   $dlogdbg("  open success main fd=%d\n", fd);
+   $dlogdbg("  open success main fd=%d\n", mfd->mainfd);
 
    mfd->is_main = $$mfd_main;
+   $mfd_sn_lock_init(mfd);
 
    fi->fh = (intptr_t) mfd;
    fi->keep_cache = 1;
@@ -281,18 +468,42 @@ int $create(const char *path, mode_t mode, struct fuse_file_info *fi)
 
          // If there are snapshots and the file exists
          if(mfd->mapfd >= 0 && mfd->mapheader.exists == 1) {
-            // This is somewhat wasteful as it sets up a new mfd
+            // This is somewhat wasteful as it sets up a new mfd.
+            // We close ours as the file may be moved into the snapshot, and reopen it afterwards.
             $dlogdbg("Create: saving the file...\n");
-            if(unlikely((fd = $_open_truncate_close(fsdata, path, fpath, 0)) != 0)) { // fd only stores a success flag here
-               waserror = -fd;
-               $dlogi("ERROR create(%s): _open_truncate_close failed err %d = %s\n", fpath, waserror, strerror(waserror));
-               break;
+            if(unlikely((fd = $mfd_close_sn(mfd, fsdata)) != 0)) {
+               $dlogi("ERROR create(%s): mfd_close_sn failed err %d = %s\n", fpath, -fd, strerror(-fd));
+               free(mfd);
+               return fd;
             }
+            fd = $_open_truncate_close(fsdata, path, fpath, 0, $$OTC_MOVE | $$OTC_RECREATE);
+            if(fd == 0) { fd = $mfd_open_sn(mfd, path, fpath, fsdata); }
+            if(unlikely(fd != 0)) { // fd only stores a success flag here
+               $dlogi("ERROR create(%s): saving the file failed err %d = %s\n", fpath, -fd, strerror(-fd));
+               free(mfd);
+               return fd;
+            }
+         } else if(unlikely((fd = $delta_truncate_path(fsdata, path, 0)) != 0)) {
+            // Blocks still redirected would be merged into the truncated file (see $_open_truncate_close)
+            waserror = -fd;
+            break;
+         }
+
+         if(unlikely((fd = $mfd_set_locklabel(mfd, fpath)) != 0 || (fd = $mfd_open_count_add(fsdata, mfd->locklabel)) != 0)) {
+            waserror = -fd;
+            break;
+         }
+         if(unlikely((fd = $delta_get(fsdata, mfd, path)) != 0)) {
+            $mfd_open_count_del(fsdata, mfd->locklabel);
+            waserror = -fd;
+            break;
          }
 
          fd = open(fpath, fi->flags | O_CREAT | O_TRUNC, mode);
          if(fd < 0) {
             waserror = errno;
+            $delta_put(fsdata, mfd);
+            $mfd_open_count_del(fsdata, mfd->locklabel);
             $dlogdbg("WARNING open[create](%s) failed with %d = %s\n", fpath, waserror, strerror(waserror));
             break;
          }
@@ -300,6 +511,15 @@ int $create(const char *path, mode_t mode, struct fuse_file_info *fi)
          $dlogdbg("opened[created] '%s' fd=%d\n", fpath, fd);
          mfd->mainfd = fd;
 
+         // The file has just been created, or may have been moved and recreated
+         if(unlikely((fd = $mfd_check_locklabel(fsdata, mfd)) != 0)) {
+            waserror = -fd;
+            close(mfd->mainfd);
+            $delta_put(fsdata, mfd);
+            $mfd_open_count_del(fsdata, mfd->locklabel);
+            break;
+         }
+
       } while(0);
 
       if(waserror != 0) {
@@ -316,6 +536,7 @@ int $create(const char *path, mode_t mode, struct fuse_file_info *fi)
    }
 
    mfd->is_main = $$mfd_main;
+   $mfd_sn_lock_init(mfd);
 
    fi->fh = (intptr_t) mfd;
    fi->keep_cache = 1;
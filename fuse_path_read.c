@@ -241,10 +241,32 @@ int $readlink(const char *path, char *link, size_t size)
 }
 
 
-/** Get extended attributes (unsupported) */
+/** Get extended attributes
+ *
+ * Extended attributes are unsupported, except for $$LOCKSTAT_XATTR on the root,
+ * which reports lock contention (see $mflock_stats).
+ */
 int $getxattr(const char *path, const char *name, char *value, size_t size)
 {
-   return -ENOTSUP;
+   char *report;
+   int len;
+   $$DFSDATA
+
+   if(strcmp(path, "/") != 0 || strcmp(name, $$LOCKSTAT_XATTR) != 0) { return -ENOTSUP; }
+
+   if(unlikely((report = malloc($$LOCKSTAT_MAX)) == NULL)) { return -ENOMEM; }
+   len = $mflock_stats(fsdata, report, $$LOCKSTAT_MAX);
+   if(len >= $$LOCKSTAT_MAX) { len = $$LOCKSTAT_MAX - 1; } // truncated
+
+   if(size != 0) {
+      if((size_t)len > size) {
+         free(report);
+         return -ERANGE;
+      }
+      memcpy(value, report, len);
+   }
+   free(report);
+   return len;
 
    /*
    $$IF_PATH_MAIN_ONLY
@@ -63,11 +63,18 @@ int $mkdir(const char *path, mode_t mode)
    if(snpath->is_there != $$snpath_id) {
       $dlogi("ERROR mkdir: bad path given\n");
       snret = -EFAULT; // "Bad address" if wrong path was used
-   } else if($sn_create(fsdata, fpath) != 0) {
-      $dlogi("ERROR Could not create snapshot\n");
-      snret = -EIO; // If error occurred while trying to create snapshot; check logs.
    } else {
-      snret = 0;
+      // Blocks redirected need to be saved into the current latest snapshot first
+      if((ret = $delta_pause(fsdata)) != 0) {
+         $dlogi("ERROR Could not merge the redirected blocks before creating the snapshot; err %d = %s\n", -ret, strerror(-ret));
+         snret = -EIO;
+      } else if($sn_create(fsdata, fpath) != 0) {
+         $dlogi("ERROR Could not create snapshot\n");
+         snret = -EIO; // If error occurred while trying to create snapshot; check logs.
+      } else {
+         snret = 0;
+      }
+      $delta_resume(fsdata);
    }
 
    $$ELIF_PATH_MAIN
@@ -161,18 +168,20 @@ int $unlink(const char *path)
 
    $dlogdbg("* unlink(path=\"%s\")\n", path);
 
-   if(unlikely((ret = $_open_truncate_close(fsdata, path, fpath, 0)) != 0)) {
+   if(unlikely((ret = $_open_truncate_close(fsdata, path, fpath, 0, $$OTC_MOVE)) < 0)) {
       $dlogi("ERROR _open_truncate_close failed with '%s'\n", strerror(-ret));
       return ret;
    }
+   if(ret == 1) { return 0; } // the file has been moved into the snapshot
 
    // Actually do the unlink
-   if(unlink(fpath) == 0) { return 0; }
+   if(unlink(fpath) == 0) {
+      $delta_forget(fsdata, path);
+      return 0;
+   }
    ret = errno;
    $dlogdbg("WARNING unlink(%s): unlink failed err %d = %s\n", fpath, ret, strerror(ret));
    return -ret;
-
-   // TODO 2 Add optimisation: move file to snapshot if feasible
 }
 
 
@@ -185,7 +194,7 @@ int $truncate(const char *path, off_t newsize)
 
    $dlogdbg("* trunc(path=\"%s\" size=%zu)\n", path, newsize);
 
-   if(unlikely((ret = $_open_truncate_close(fsdata, path, fpath, newsize)) != 0)) {
+   if(unlikely((ret = $_open_truncate_close(fsdata, path, fpath, newsize, $$OTC_MOVE | $$OTC_RECREATE)) != 0)) {
       $dlogi("ERROR _open_truncate_close failed with '%s'\n", strerror(-ret));
       return ret;
    }
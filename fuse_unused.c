@@ -171,36 +171,6 @@ int $utime(const char *path, struct utimbuf *ubuf)
 //   int (*poll) (const char *, struct fuse_file_info *,
 //           struct fuse_pollhandle *ph, unsigned *reventsp);
 
-   /** Write contents of buffer to an open file
-    *
-    * Similar to the write() method, but data is supplied in a
-    * generic buffer.  Use fuse_buf_copy() to transfer data to
-    * the destination.
-    *
-    * Introduced in version 2.9
-    */
-//   int (*write_buf) (const char *, struct fuse_bufvec *buf, off_t off,
-//           struct fuse_file_info *);
-
-   /** Store data from an open file in a buffer
-    *
-    * Similar to the read() method, but data is stored and
-    * returned in a generic buffer.
-    *
-    * No actual copying of data has to take place, the source
-    * file descriptor may simply be stored in the buffer for
-    * later data transfer.
-    *
-    * The buffer must be allocated dynamically and stored at the
-    * location pointed to by bufp.  If the buffer contains memory
-    * regions, they too must be allocated using malloc().  The
-    * allocated memory will be freed by the caller.
-    *
-    * Introduced in version 2.9
-    */
-//   int (*read_buf) (const char *, struct fuse_bufvec **bufp,
-//          size_t size, off_t off, struct fuse_file_info *);
-
   /**
     * Perform BSD file locking operation
     *
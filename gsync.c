@@ -0,0 +1,197 @@
+/*
+  This file is part of ESFS, a FUSE-based filesystem that supports snapshots.
+  ESFS is Copyright (C) 2013 Elod Csirmaz
+  <http://www.epcsirmaz.com/> <https://github.com/csirmaz>.
+
+  ESFS is based on Big Brother File System (fuse-tutorial)
+  Copyright (C) 2012 Joseph J. Pfeiffer, Jr., Ph.D. <pfeiffer@cs.nmsu.edu>,
+  and was forked from it on 21 August 2013.
+  Big Brother File System can be distributed under the terms of
+  the GNU GPLv3. See the file COPYING.
+  See also <http://www.cs.nmsu.edu/~pfeiffer/fuse-tutorial/>.
+
+  Big Brother File System was derived from function prototypes found in
+  /usr/include/fuse/fuse.h
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+  fuse.h is licensed under the LGPLv2.
+
+  ESFS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  ESFS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * NOTE: A Perl script is used to replace $ with esfs_ and $$ with ESFS_
+ * in this file. To write $, use \$.
+ */
+
+/* This file contains the group commit engine used by fsync.
+ *
+ * Group commit
+ * ============
+ *
+ * Flushing a main file means flushing its dat and map files in the latest
+ * snapshot, the dat and index files of the deduplication store if there is one,
+ * its delta file if it is used, and the main file itself.
+ * Databases can call fsync thousands of times a second on many handles, so
+ * fsync requests are not flushed one by one. Requests arriving while a group
+ * is being flushed are queued, and the first of them to wake up becomes the
+ * leader of the next group and flushes all of them together. If the previous
+ * group had several requests, the leader first waits $$GSYNC_WINDOW microseconds
+ * for more to arrive; a lone fsync is not delayed.
+ *
+ * Within a group, the dat files are flushed first, then the files of the
+ * deduplication store, then the map files, then the delta and main files, so that
+ * when fsync returns, no pointer in a map file has reached the disk before the block
+ * it points to (or the store its reference count), and no new data before the
+ * old blocks it overwrote. The store is shared, so it is flushed once per group.
+ * If flushing a file fails, the later files of the requests including it are
+ * not flushed. Each FD is flushed once per group, with fsync if any of the
+ * requests including it need it, and fdatasync otherwise.
+ */
+
+
+/** Initialises the group commit engine
+ *
+ * Returns:
+ * * 0 on success
+ * * -errno on error
+ */
+static int $gsync_init(struct $fsdata_t *fsdata)
+{
+   struct $gsync_t *gs;
+
+   gs = malloc(sizeof(struct $gsync_t));
+   if(gs == NULL) { return -ENOMEM; }
+
+   pthread_mutex_init(&(gs->mutex), NULL);
+   pthread_cond_init(&(gs->done), NULL);
+   gs->queue = NULL;
+   gs->busy = 0;
+   gs->last = 0;
+
+   fsdata->gsync = gs;
+   return 0;
+}
+
+
+/** Frees the group commit engine.
+ * Should be called when the other threads have exited.
+ */
+static void $gsync_destroy(struct $fsdata_t *fsdata)
+{
+   struct $gsync_t *gs;
+
+   gs = fsdata->gsync;
+   if(gs == NULL) { return; }
+
+   pthread_cond_destroy(&(gs->done));
+   pthread_mutex_destroy(&(gs->mutex));
+   free(gs);
+   fsdata->gsync = NULL;
+}
+
+
+/** Flushes the files of a group of requests. See the description at the top
+ *
+ * Sets:
+ * * req->ret - for each request in the group
+ */
+static void $gsync_flush(struct $fsdata_t *fsdata, struct $gsync_req_t *group)
+{
+   struct $gsync_req_t *req, *other;
+   int i, fd, datasync, ret;
+
+   for(i = 0; i < $$GSYNC_FDS; i++) {
+      for(req = group; req != NULL; req = req->next) {
+
+         fd = req->fds[i];
+         if(fd < 0 || req->ret != 0) { continue; }
+
+         // See if the FD has already been flushed, and if any request needs its metadata
+         datasync = req->datasync;
+         for(other = group; other != req; other = other->next) {
+            if(other->fds[i] == fd && other->ret == 0) { break; }
+         }
+         if(other != req) { continue; }
+         for(other = req->next; other != NULL; other = other->next) {
+            if(other->fds[i] == fd && other->ret == 0 && !other->datasync) { datasync = 0; }
+         }
+
+         if((datasync ? fdatasync(fd) : fsync(fd)) == 0) { continue; }
+
+         ret = errno;
+         $dlogi("ERROR gsync_flush: flushing FD %d failed with %d = %s\n", fd, ret, strerror(ret));
+         for(other = req; other != NULL; other = other->next) {
+            if(other->fds[i] == fd && other->ret == 0) { other->ret = -ret; }
+         }
+
+      }
+   }
+}
+
+
+/** Flushes the files of an fsync request as part of a group
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $gsync_sync(struct $fsdata_t *fsdata, struct $gsync_req_t *req)
+{
+   struct $gsync_t *gs;
+   struct $gsync_req_t *group, *r;
+   struct timespec window;
+   int n;
+
+   gs = fsdata->gsync;
+   req->done = 0;
+   req->ret = 0;
+
+   pthread_mutex_lock(&(gs->mutex));
+   req->next = gs->queue;
+   gs->queue = req;
+
+   while(!req->done) {
+
+      if(gs->busy) {
+         pthread_cond_wait(&(gs->done), &(gs->mutex));
+         continue;
+      }
+
+      // Lead the next group
+      gs->busy = 1;
+      if(gs->last > 1) {
+         pthread_mutex_unlock(&(gs->mutex));
+         window.tv_sec = 0;
+         window.tv_nsec = $$GSYNC_WINDOW * 1000;
+         nanosleep(&window, NULL);
+         pthread_mutex_lock(&(gs->mutex));
+      }
+      group = gs->queue;
+      gs->queue = NULL;
+      pthread_mutex_unlock(&(gs->mutex));
+
+      $gsync_flush(fsdata, group);
+
+      pthread_mutex_lock(&(gs->mutex));
+      for(r = group, n = 0; r != NULL; r = r->next, n++) { r->done = 1; }
+      $dlogdbg("gsync_sync: flushed a group of %d requests\n", n);
+      gs->last = n;
+      gs->busy = 0;
+      pthread_cond_broadcast(&(gs->done));
+
+   }
+
+   pthread_mutex_unlock(&(gs->mutex));
+   return req->ret;
+}
@@ -123,6 +123,28 @@ static inline int $mfd_save_mapheader(const struct $mfd_t *mfd, const struct $fs
 }
 
 
+/** Checks the version and the signature of a map header
+ *
+ * Returns:
+ * * 0 on success
+ * * -errno on error
+ */
+static inline int $mfd_check_mapheader(const struct $mapheader_t *maphead, const struct $fsdata_t *fsdata)
+{
+   if((maphead->$version != $$MAP_VERSION && maphead->$version != $$MAP_VERSION_FLAGS) || strncmp(maphead->signature, "ESFS", 4) != 0) {
+      $dlogi("ERROR version or signature bad in map file. Broken FS?\n");
+      return -EFAULT;
+   }
+
+   if(unlikely($$MAP_BL_SLOG(maphead) < $$BL_SLOG_MIN || $$MAP_BL_SLOG(maphead) > $$BL_SLOG)) {
+      $dlogi("ERROR unsupported blocksize 2^%d in map file. Broken FS?\n", $$MAP_BL_SLOG(maphead));
+      return -EFAULT;
+   }
+
+   return 0;
+}
+
+
 /** Load the map header from the map file
  *
  * Returns:
@@ -144,16 +166,239 @@ static inline int $mfd_load_mapheader(struct $mapheader_t *maphead, int fd, cons
       return -EIO;
    }
 
-   // Check the version and the signature
-   if(maphead->$version != 12000 || strncmp(maphead->signature, "ESFS", 4) != 0) {
-      $dlogi("ERROR version or signature bad in map file. Broken FS?\n");
-      return -EFAULT;
+   return $mfd_check_mapheader(maphead, fsdata);
+}
+
+
+/** Maps the map file of a snapshot step into memory
+ *
+ * Only use this for map files in snapshots older than the latest one,
+ * as these do not change.
+ * If this fails, step->mapmem remains NULL, and the map file is read using pread.
+ */
+static inline void $mfd_mmap_step(struct $sn_steps_t *step, const struct $fsdata_t *fsdata)
+{
+   struct stat mystat;
+   void *mem;
+
+   step->mapmem = NULL;
+
+   if(unlikely(fstat(step->mapfd, &mystat) != 0)) {
+      $dlogi("WARNING mfd_mmap_step: fstat failed with %d = %s\n", errno, strerror(errno));
+      return;
    }
+   if(unlikely(mystat.st_size < sizeof(struct $mapheader_t))) { return; } // $mfd_load_mapheader will report this
+
+   mem = mmap(NULL, mystat.st_size, PROT_READ, MAP_SHARED, step->mapfd, 0);
+   if(unlikely(mem == MAP_FAILED)) {
+      $dlogi("WARNING mfd_mmap_step: mmap failed with %d = %s\n", errno, strerror(errno));
+      return;
+   }
+
+   step->mapmem = mem;
+   step->mapmemlen = mystat.st_size;
+}
+
+
+/** Reads block pointers from the map file of a snapshot step
+ *
+ * Uses the map file mapped into memory if there is one (see $mfd_mmap_step),
+ * and pread otherwise.
+ * Pointers beyond the end of the map file are returned as 0.
+ *
+ * Returns:
+ * * 0 on success
+ * * -errno on error
+ */
+static inline int $mfd_read_step_pointers(
+   const struct $sn_steps_t *step,
+   off_t blockoffset, /**< the first block */
+   size_t count, /**< the number of pointers to read */
+   $$BLP_T *pointers,
+   const struct $fsdata_t *fsdata
+)
+{
+   off_t mapoffset;
+   size_t len;
+   ssize_t ret;
+
+   mapoffset = (sizeof(struct $mapheader_t)) + blockoffset * $$BLP_S;
+   len = count * $$BLP_S;
+
+   if(step->mapmem != NULL) {
+
+      ret = 0;
+      if(mapoffset < step->mapmemlen) {
+         ret = step->mapmemlen - mapoffset;
+         if(ret > len) { ret = len; }
+         memcpy(pointers, step->mapmem + mapoffset, ret);
+      }
+
+   } else {
+
+      ret = pread(step->mapfd, pointers, len, mapoffset);
+      if(unlikely(ret == -1)) {
+         ret = errno;
+         $dlogi("ERROR mfd_read_step_pointers: pread on map failed with %zd = %s\n", ret, strerror(ret));
+         return -ret;
+      }
+
+   }
+
+   if(unlikely((ret % $$BLP_S) != 0)) {
+      $dlogi("ERROR mfd_read_step_pointers: map file ends inside a pointer. Broken FS?\n");
+      return -ENXIO;
+   }
+
+   if(ret < len) { memset(((char *)pointers) + ret, 0, len - ret); }
 
    return 0;
 }
 
 
+/** Registers a dat file opened for writing in the table of dat tails
+ *
+ * The size of each dat file open for writing is kept in memory, and shared by
+ * all the MFDs that have it open, so that blocks can be appended to it without
+ * finding its end first (see $mfd_dat_reserve). Entries are identified by the
+ * device and inode number of the dat file, as dat files can be replaced
+ * (see $_move_to_snapshot), and different files can share a lock label.
+ *
+ * Sets:
+ * * mfd->dattail
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $mfd_dattail_get(struct $fsdata_t *fsdata, struct $mfd_t *mfd)
+{
+   struct stat mystat;
+   struct $dattail_t *dt;
+   int bucket;
+
+   if(unlikely(fstat(mfd->datfd, &mystat) != 0)) { return -errno; }
+   bucket = (int)((mystat.st_ino ^ mystat.st_dev) & ($$DATTAIL_BUCKETS - 1));
+
+   pthread_mutex_lock(&(fsdata->dattails_mutex));
+
+   for(dt = fsdata->dattails[bucket]; dt != NULL; dt = dt->next) {
+      if(dt->ino == mystat.st_ino && dt->dev == mystat.st_dev) { break; }
+   }
+
+   if(dt == NULL) {
+      dt = malloc(sizeof(struct $dattail_t));
+      if(unlikely(dt == NULL)) {
+         pthread_mutex_unlock(&(fsdata->dattails_mutex));
+         return -ENOMEM;
+      }
+      dt->dev = mystat.st_dev;
+      dt->ino = mystat.st_ino;
+      dt->refs = 0;
+      dt->tail = mystat.st_size;
+      dt->alloc = mystat.st_size;
+      pthread_mutex_init(&(dt->mutex), NULL);
+      dt->next = fsdata->dattails[bucket];
+      fsdata->dattails[bucket] = dt;
+   }
+   dt->refs++;
+
+   pthread_mutex_unlock(&(fsdata->dattails_mutex));
+
+   mfd->dattail = dt;
+   return 0;
+}
+
+
+/** Unregisters the dat file of a main MFD about to be closed (see $mfd_dattail_get)
+ *
+ * When the last MFD using a dat file closes it, the space preallocated beyond
+ * its end is released (see $mfd_dat_reserve). Truncating a file to its own
+ * size does this on ext4. This is done with the table locked, so that the file
+ * cannot be opened and appended to in the meantime.
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static int $mfd_dattail_put(struct $fsdata_t *fsdata, struct $mfd_t *mfd)
+{
+   struct stat mystat;
+   struct $dattail_t *dt;
+   struct $dattail_t **link;
+   int ret = 0;
+
+   dt = mfd->dattail;
+   if(dt == NULL) { return 0; }
+   mfd->dattail = NULL;
+
+   pthread_mutex_lock(&(fsdata->dattails_mutex));
+
+   if(--(dt->refs) == 0) {
+      if(dt->alloc > dt->tail) {
+         if(unlikely(fstat(mfd->datfd, &mystat) != 0 || ftruncate(mfd->datfd, mystat.st_size) != 0)) {
+            ret = -errno;
+            $dlogi("ERROR mfd_dattail_put: trimming the dat file FD %d failed with %d = %s\n", mfd->datfd, -ret, strerror(-ret));
+         }
+      }
+      for(link = &(fsdata->dattails[(int)((dt->ino ^ dt->dev) & ($$DATTAIL_BUCKETS - 1))]); *link != dt; link = &((*link)->next)) { }
+      *link = dt->next;
+      pthread_mutex_destroy(&(dt->mutex));
+      free(dt);
+   }
+
+   pthread_mutex_unlock(&(fsdata->dattails_mutex));
+
+   return ret;
+}
+
+
+/** Reserves space at the end of the dat file of a main MFD
+ *
+ * The space is reserved atomically, so threads saving different blocks of
+ * the same file can append to the dat file in parallel (see $b_lock_label).
+ * Until the data is written, the dat file may be shorter than the space reserved.
+ *
+ * Dat files are preallocated in chunks of fsdata->dat_prealloc bytes, so that
+ * they are not fragmented by being extended a few blocks at a time. The space is
+ * allocated beyond the end of the file (FALLOC_FL_KEEP_SIZE), so the size of the
+ * file remains valid even after a crash, and the rest of the last chunk is
+ * released when the file is closed (see $mfd_dattail_put).
+ *
+ * Returns the offset of the space reserved.
+ */
+static inline off_t $mfd_dat_reserve(struct $fsdata_t *fsdata, const struct $mfd_t *mfd, size_t length)
+{
+   struct $dattail_t *dt = mfd->dattail;
+   off_t chunk, from, want;
+   int ret;
+
+   from = __atomic_fetch_add(&(dt->tail), (off_t)length, __ATOMIC_RELAXED);
+
+   chunk = __atomic_load_n(&(fsdata->dat_prealloc), __ATOMIC_RELAXED);
+   if(chunk == 0 || from + (off_t)length <= __atomic_load_n(&(dt->alloc), __ATOMIC_RELAXED)) { return from; }
+
+   pthread_mutex_lock(&(dt->mutex));
+   if(from + (off_t)length > dt->alloc) {
+      want = ((from + length + chunk - 1) / chunk) * chunk;
+      if(fallocate(mfd->datfd, FALLOC_FL_KEEP_SIZE, dt->alloc, want - dt->alloc) == 0) {
+         $dlogdbg("mfd_dat_reserve: preallocated %td bytes for dat FD %d\n", want - dt->alloc, mfd->datfd);
+         __atomic_store_n(&(dt->alloc), want, __ATOMIC_RELAXED);
+      } else {
+         // Appending will still work, and fail if the space is really missing
+         ret = errno;
+         if(ret == EOPNOTSUPP || ret == ENOSYS) {
+            $dlogi("mfd_dat_reserve: preallocation is not supported (%d = %s)\n", ret, strerror(ret));
+            __atomic_store_n(&(fsdata->dat_prealloc), 0, __ATOMIC_RELAXED);
+         }
+      }
+   }
+   pthread_mutex_unlock(&(dt->mutex));
+
+   return from;
+}
+
+
 // breaks below are not errors, but we want to skip opening/creating the dat file
 // if the file was empty or nonexistent when the snapshot was taken
 #define $$MFD_OPEN_DAT_FILE \
@@ -169,7 +414,7 @@ static inline int $mfd_load_mapheader(struct $mapheader_t *maphead, int fd, cons
                waserror = ENAMETOOLONG; \
                break; \
             } \
-            fd_dat = open(fdat, O_WRONLY | O_CREAT | O_APPEND | O_NOATIME, S_IRWXU); \
+            fd_dat = open(fdat, O_WRONLY | O_CREAT | O_NOATIME, S_IRWXU); /* not O_APPEND, so that blocks can be cloned into it */ \
             if(fd_dat == -1){ \
                fd_dat = errno; \
                $dlogi("ERROR mfd_open_sn: Failed to open .dat at '%s', error %d = %s (1)\n", fdat, fd_dat, strerror(fd_dat)); \
@@ -177,7 +422,14 @@ static inline int $mfd_load_mapheader(struct $mapheader_t *maphead, int fd, cons
                break; \
             } \
             $dlogdbg("mfd_open_sn: Opened dat file at '%s' FD '%d' (vpath='%s')\n", fdat, fd_dat, vpath); \
-            mfd->datfd = fd_dat;
+            mfd->datfd = fd_dat; \
+            if(unlikely((ret = $mfd_dattail_get(fsdata, mfd)) != 0)) { \
+               $dlogi("ERROR mfd_open_sn: mfd_dattail_get failed with %d = %s\n", -ret, strerror(-ret)); \
+               close(fd_dat); \
+               mfd->datfd = $$MFD_FD_NOSN; \
+               waserror = -ret; \
+               break; \
+            }
 
 
 /** Opens (and initialises) the snapshot-related parts of a main MFD
@@ -188,11 +440,12 @@ static inline int $mfd_load_mapheader(struct $mapheader_t *maphead, int fd, cons
  *
  * Sets:
  * * mfd->mapfd, the map file opened for RDWR or a negative value if unused -- see types.h
- * * mfd->datfd, the dat file opened for WR|APPEND or a negative value if unused -- see types.h
+ * * mfd->datfd, the dat file opened for WR or a negative value if unused -- see types.h
  * * mfd->mapheader
- * * mfd->locklabel
  * * mfd->sn_number
  *
+ * mfd->locklabel is not changed; it is set when the main file is opened (see $mfd_set_locklabel).
+ *
  * Saves:
  * * stats of the file into the map file, unless the map file already exists.
  *
@@ -216,6 +469,7 @@ static int $mfd_open_sn(
    int ret;
    int waserror = 0; // positive on error
    int mylock = -1;
+   $$LOCKLABEL_T pathlabel; // the map file is created holding the lock of its path
    struct $mapheader_t *maphead;
 
    // Calculate fpath if needed
@@ -232,8 +486,8 @@ static int $mfd_open_sn(
    // Default values
    mfd->sn_number = fsdata->sn_number; /* to see if a new snapshot was created */
    mfd->is_main = $$mfd_main; /* for safety's sake */
-   mfd->locklabel = $string2locklabel(fpath_use); // We use fpath and not vpath here as the same label needs to be generated from sn_steps
-   mfd->latest_written_block_cache = 0;
+   mfd->saved_map = NULL; // see $b_saved_get
+   mfd->dattail = NULL; // see $mfd_dattail_get
 
    strcpy(mfd->vpath, vpath); /* to be able to reinitialise the mfd in case there is a new snapshot */
 
@@ -263,9 +517,12 @@ static int $mfd_open_sn(
    // and two threads race to create a new map file, it might not be sure that the one creating it
    // will be the one getting the lock, and so we'd need additional checks to decide who
    // needs to initialise the mapheader.
-   $dlogdbg("mfd_open_sn: getting lock for label '%lu'... (vpath='%s', fpath='%s')\n", mfd->locklabel, vpath, fpath_use);
-   if(unlikely((mylock = $mflock_lock(fsdata, mfd->locklabel)) < 0)) {
-      $dlogi("ERROR mfd_open_sn: mflock_lock(%lu) failed with '%d'='%s'\n", mfd->locklabel, -mylock, strerror(-mylock));
+   // The map file belongs to the path, so the label of the main file cannot be used here,
+   // as it may not exist, or be replaced by another file at the same path (see $_move_to_snapshot).
+   pathlabel = $string2locklabel(fpath_use);
+   $dlogdbg("mfd_open_sn: getting lock for the path... (vpath='%s', fpath='%s')\n", vpath, fpath_use);
+   if(unlikely((mylock = $mflock_lock(fsdata, pathlabel)) < 0)) {
+      $dlogi("ERROR mfd_open_sn: mflock_lock(%s) failed with '%d'='%s'\n", fpath_use, -mylock, strerror(-mylock));
       return mylock;
    }
 
@@ -335,7 +592,14 @@ static int $mfd_open_sn(
             mfd->mapfd = fd;
 
             // Default values for a new mapheader
-            maphead->$version = 12000;
+            maphead->$version = $$MAP_VERSION;
+            maphead->flags = 0;
+            if(fsdata->compress) { maphead->flags |= $$MAP_COMPRESSED; }
+            if(fsdata->bl_slog != $$BL_SLOG) { maphead->flags |= (fsdata->bl_slog << $$MAP_BL_SLOG_SHIFT); }
+            // Compressed blocks are saved whole
+            if(fsdata->save_pages && !fsdata->compress && fsdata->bl_slog > $$BL_PAGE_SLOG) { maphead->flags |= $$MAP_PAGES; }
+            // Older versions of ESFS would not be able to read compressed blocks or use a different blocksize
+            if(maphead->flags != 0) { maphead->$version = $$MAP_VERSION_FLAGS; }
             strncpy(maphead->signature, "ESFS", 4);
             maphead->exists = 1;
 
@@ -354,7 +618,7 @@ static int $mfd_open_sn(
             }
 
             // mfd's are not currently allowed for directories
-            if(unlikely(S_ISDIR(maphead->fstat.st_mode))) {
+            if(unlikely(maphead->exists == 1 && S_ISDIR(maphead->fstat.st_mode))) {
                waserror = EISDIR;
                $dlogi("FAILED mfd_open_sn: mfds are not allowed for directories\n");
                break; // [C]
@@ -419,10 +683,105 @@ static inline void $mfd_open_sn_rdonly(
    mfd->mapfd = $$MFD_FD_RDONLY;
    mfd->datfd = $$MFD_FD_RDONLY;
    mfd->is_main = $$mfd_main; /* for safety's sake */
+   mfd->saved_map = NULL;
+   mfd->dattail = NULL;
+}
+
+
+/** Registers a main file about to be opened
+ *
+ * The number of open main files is counted for each lock label, so that
+ * we can know that a file is not open when it is moved into the snapshot
+ * (see $_move_to_snapshot). As labels are counted modulo $$OPEN_COUNTS,
+ * a file can appear to be open when it is not, but not the other way round.
+ * The lock of the file is acquired and released after the counter is increased,
+ * so that the file cannot be opened while it is being moved.
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static inline int $mfd_open_count_add(struct $fsdata_t *fsdata, $$LOCKLABEL_T label)
+{
+   int lock, ret;
+
+   __atomic_add_fetch(&(fsdata->open_counts[$mflock_hash(label) & ($$OPEN_COUNTS - 1)]), 1, __ATOMIC_SEQ_CST);
+
+   if(unlikely((lock = $mflock_lock(fsdata, label)) < 0)) {
+      __atomic_sub_fetch(&(fsdata->open_counts[$mflock_hash(label) & ($$OPEN_COUNTS - 1)]), 1, __ATOMIC_SEQ_CST);
+      return lock;
+   }
+   if(unlikely((ret = $mflock_unlock(fsdata, lock)) < 0)) {
+      __atomic_sub_fetch(&(fsdata->open_counts[$mflock_hash(label) & ($$OPEN_COUNTS - 1)]), 1, __ATOMIC_SEQ_CST);
+      return ret;
+   }
+   return 0;
+}
+
+
+/** Unregisters a main file that has been closed (see $mfd_open_count_add) */
+static inline void $mfd_open_count_del(struct $fsdata_t *fsdata, $$LOCKLABEL_T label)
+{
+   __atomic_sub_fetch(&(fsdata->open_counts[$mflock_hash(label) & ($$OPEN_COUNTS - 1)]), 1, __ATOMIC_SEQ_CST);
+}
+
+
+/** Sets the lock label of a main MFD from the main file at fpath
+ *
+ * Main files are identified by their device and inode number, which are
+ * collected once when the file is opened. If the main file does not exist,
+ * the label is derived from fpath.
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static inline int $mfd_set_locklabel(struct $mfd_t *mfd, const char *fpath)
+{
+   struct stat mystat;
+
+   if(lstat(fpath, &mystat) == 0) {
+      mfd->locklabel = $stat2locklabel(&mystat);
+      return 0;
+   }
+   if(unlikely(errno != ENOENT)) { return -errno; }
+   mfd->locklabel = $string2locklabel(fpath);
+   return 0;
+}
+
+
+/** Updates the lock label of a main MFD once the main file is open
+ *
+ * The label is set from the path before the main file is opened, so that
+ * the file can be registered as open first (see $mfd_open_count_add),
+ * but the file may have been created or replaced in the meantime.
+ * If so, it is registered again under the label of the file opened.
+ *
+ * Returns:
+ * * 0 - on success
+ * * -errno - on error
+ */
+static inline int $mfd_check_locklabel(struct $fsdata_t *fsdata, struct $mfd_t *mfd)
+{
+   struct stat mystat;
+   $$LOCKLABEL_T label;
+   int ret;
+
+   if(unlikely(fstat(mfd->mainfd, &mystat) != 0)) { return -errno; }
+   label = $stat2locklabel(&mystat);
+   if($$LOCKLABEL_EQ(label, mfd->locklabel)) { return 0; }
+
+   if(unlikely((ret = $mfd_open_count_add(fsdata, label)) != 0)) { return ret; }
+   $mfd_open_count_del(fsdata, mfd->locklabel);
+   mfd->locklabel = label;
+   return 0;
 }
 
 
 /** Closes the snapshot-related parts of a main MFD
+ *
+ * This frees the dat tail and the bitmap of saved blocks, so no other thread
+ * may be using the mfd (see $mfd_sn_hold).
  *
  * Returns:
  * * 0 on success
@@ -430,9 +789,14 @@ static inline void $mfd_open_sn_rdonly(
  */
 static inline int $mfd_close_sn(struct $mfd_t *mfd, struct $fsdata_t *fsdata)
 {
+   int ret;
    int waserror = 0;
 
+   free(mfd->saved_map);
+   mfd->saved_map = NULL;
+
    if(mfd->datfd >= 0) {
+      if(unlikely((ret = $mfd_dattail_put(fsdata, mfd)) != 0)) { waserror = -ret; }
       if(unlikely(close(mfd->datfd) != 0)) {
          waserror = errno;
          $dlogi("ERROR mfd_close_sn: close(datfd=%d) failed with '%d'='%s'\n", mfd->datfd, waserror, strerror(waserror));
@@ -487,29 +851,86 @@ static inline int $mfd_validate(
    struct $fsdata_t *fsdata
 )
 {
-   int ret;
+   int ret = 0;
 
-   if(fsdata->sn_number == mfd->sn_number) { return 0; }
+   // Wait for the writes using the current snapshot part to finish (see $mfd_sn_hold)
+   pthread_rwlock_wrlock(&(mfd->sn_lock));
 
-   // We won't use the snapshot if the main file is opened for read only
-   if(mfd->mapfd == $$MFD_FD_RDONLY) { return 0; }
+   do {
 
-   $dlogdbg("! Reinitialising the mfd\n");
+      // Another thread may have reinitialised the mfd while we waited
+      if(fsdata->sn_number == mfd->sn_number) { break; }
 
-   if((ret = $mfd_close_sn(mfd, fsdata)) != 0) {
-      $dlogi("ERROR mfd_close_sn failed with err %d = %s\n", -ret, strerror(-ret));
-      return ret;
-   }
-   if((ret = $mfd_open_sn(mfd, mfd->vpath, NULL, fsdata)) != 0) {
-      $dlogi("ERROR mfd_open_sn failed with err %d = %s\n", -ret, strerror(-ret));
-      return ret;
-   }
+      // We won't use the snapshot if the main file is opened for read only
+      if(mfd->mapfd == $$MFD_FD_RDONLY) { break; }
 
-   mfd->sn_number = fsdata->sn_number;
+      $dlogdbg("! Reinitialising the mfd\n");
+
+      if((ret = $mfd_close_sn(mfd, fsdata)) != 0) {
+         $dlogi("ERROR mfd_close_sn failed with err %d = %s\n", -ret, strerror(-ret));
+         break;
+      }
+      if((ret = $mfd_open_sn(mfd, mfd->vpath, NULL, fsdata)) != 0) {
+         $dlogi("ERROR mfd_open_sn failed with err %d = %s\n", -ret, strerror(-ret));
+         break;
+      }
+
+      mfd->sn_number = fsdata->sn_number;
+
+   } while(0);
+
+   pthread_rwlock_unlock(&(mfd->sn_lock));
+   return ret;
+}
+
+
+/** Initialises the lock of the snapshot part of a main mfd. See $mfd_sn_hold */
+static inline void $mfd_sn_lock_init(struct $mfd_t *mfd)
+{
+   pthread_rwlockattr_t attr;
+
+   // Writes can keep a busy file locked for reading all the time; reinitialising should not wait for a gap
+   pthread_rwlockattr_init(&attr);
+   pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+   pthread_rwlock_init(&(mfd->sn_lock), &attr);
+   pthread_rwlockattr_destroy(&attr);
+}
+
+
+/** Makes sure a main mfd writes into the latest snapshot, and keeps its snapshot part
+ * from being reinitialised until $mfd_sn_release is called
+ *
+ * Several threads can write through the same mfd. The first of them to notice a new
+ * snapshot reinitialises the mfd in $mfd_validate once the others have released it,
+ * as reinitialising closes the dat and map files and frees the dat tail and the bitmap
+ * of saved blocks they may be using.
+ * If another snapshot is taken in the meantime, the write goes into the previous one.
+ *
+ * Returns:
+ * * 0 - on success, holding the lock
+ * * -errno - on error, not holding the lock
+ */
+static int $mfd_sn_hold(struct $mfd_t *mfd, struct $fsdata_t *fsdata)
+{
+   int ret;
+
+   pthread_rwlock_rdlock(&(mfd->sn_lock));
+   if(likely(mfd->sn_number == fsdata->sn_number)) { return 0; }
+
+   pthread_rwlock_unlock(&(mfd->sn_lock));
+   if(unlikely((ret = $mfd_validate(mfd, fsdata)) != 0)) { return ret; }
+   pthread_rwlock_rdlock(&(mfd->sn_lock));
    return 0;
 }
 
 
+/** Releases the snapshot part of a main mfd held by $mfd_sn_hold */
+static inline void $mfd_sn_release(struct $mfd_t *mfd)
+{
+   pthread_rwlock_unlock(&(mfd->sn_lock));
+}
+
+
 /** Ensures that a snapshot has not been created since the in-snapshot mfd was initialised.
  * For now, only returns an error if there is a new snapshot.
  *
@@ -553,6 +974,8 @@ static int $mfd_destroy_sn_steps(struct $mfd_t *mfd, const struct $fsdata_t *fsd
    if(mfd->sn_first_file >= 0) {
       for(i = mfd->sn_current; i >= 0; i--) {
 
+         if(mfd->sn_steps[i].mapmem != NULL && munmap(mfd->sn_steps[i].mapmem, mfd->sn_steps[i].mapmemlen) != 0) { waserror = -errno; }
+
          j = mfd->sn_steps[i].mapfd;
          if(j >= 0 && close(j) != 0) { waserror = -errno; }
 
@@ -564,6 +987,7 @@ static int $mfd_destroy_sn_steps(struct $mfd_t *mfd, const struct $fsdata_t *fsd
    }
 
    free(mfd->sn_steps);
+   free(mfd->sn_index);
 
    return waserror;
 }
@@ -587,6 +1011,8 @@ static int $mfd_destroy_sn_steps(struct $mfd_t *mfd, const struct $fsdata_t *fsd
  * * mfd->mapheader.fstat - from a main file or a directory
  * * mfd->locklabel
  * * mfd->sn_number
+ * * mfd->sn_index - to NULL; see $b_index_build
+ * * mfd->sn_bl_slog
  *
  * Returns:
  * * 0 - on success
@@ -611,6 +1037,8 @@ static int $mfd_get_sn_steps(
 
    // Default values
    mfd->sn_number = fsdata->sn_number;
+   mfd->sn_index = NULL; // see $b_index_build
+   mfd->sn_bl_slog = fsdata->bl_slog; // see $b_read
 
    // Get the roots of the snapshots and the main space
    if(unlikely((ret = $sn_get_paths_to(mfd, snpath, fsdata)) != 0)) {
@@ -631,8 +1059,12 @@ static int $mfd_get_sn_steps(
    mfd->sn_first_file = -1;
    for(sni = mfd->sn_current; sni >= 0; sni--) {
       mfd->sn_steps[sni].mapfd = $$SN_STEPS_NOTOPEN;
+      mfd->sn_steps[sni].mapmem = NULL;
       mfd->sn_steps[sni].datfd = $$SN_STEPS_NOTOPEN;
       mfd->sn_steps[sni].dirfd = NULL;
+      mfd->sn_steps[sni].bl_slog = $$BL_SLOG;
+      mfd->sn_steps[sni].pages = 0;
+      mfd->sn_steps[sni].whole = 0;
    }
 
    for(sni = mfd->sn_current; sni >= 0; sni--) {
@@ -659,7 +1091,7 @@ static int $mfd_get_sn_steps(
                // Try treating this as a file
                knowntype = 'f';
             } else {
-               $dlogi("ERROR mfd_get_sn_steps: lstat on '%s' failed with %d = %s/n", mfd->sn_steps[sni].path, ret, strerror(ret));
+               $dlogi("ERROR mfd_get_sn_steps: lstat on '%s' failed with %d = %s\n", mfd->sn_steps[sni].path, ret, strerror(ret));
                waserror = -ret;
                break;
             }
@@ -744,14 +1176,34 @@ static int $mfd_get_sn_steps(
             // We save this here so that mfd_destroy_sn_steps would close it on error
             mfd->sn_steps[sni].mapfd = fd;
 
+            // If we are opening the file for reading, map the map files of
+            // immutable snapshots into memory. See $mfd_read_step_pointers
+            if(sni > 1 && !(flags & $$SN_STEPS_F_SKIPOPENDAT)) {
+               $mfd_mmap_step(&(mfd->sn_steps[sni]), fsdata);
+            }
+
             do {
 
-               if(unlikely((ret = $mfd_load_mapheader(&maphead, fd, fsdata)) != 0)) {
+               if(mfd->sn_steps[sni].mapmem != NULL) {
+                  memcpy(&maphead, mfd->sn_steps[sni].mapmem, sizeof(struct $mapheader_t));
+                  ret = $mfd_check_mapheader(&maphead, fsdata);
+               } else {
+                  ret = $mfd_load_mapheader(&maphead, fd, fsdata);
+               }
+               if(unlikely(ret != 0)) {
                   $dlogi("ERROR mfd_get_sn_steps: mfd_load_mapheader failed with err %d = %s\n", -ret, strerror(-ret));
                   waserror = ret;
                   break;
                }
 
+               // Blocks are read in the smallest blocksize used, or in pages
+               // if some blocks may be partially saved
+               mfd->sn_steps[sni].bl_slog = $$MAP_BL_SLOG(&maphead);
+               mfd->sn_steps[sni].pages = ($$MAP_HAS_FLAG(&maphead, $$MAP_PAGES) ? 1 : 0);
+               mfd->sn_steps[sni].whole = ($$MAP_HAS_FLAG(&maphead, $$MAP_WHOLE) ? 1 : 0);
+               if(mfd->sn_steps[sni].bl_slog < mfd->sn_bl_slog) { mfd->sn_bl_slog = mfd->sn_steps[sni].bl_slog; }
+               if(mfd->sn_steps[sni].pages && $$BL_PAGE_SLOG < mfd->sn_bl_slog) { mfd->sn_bl_slog = $$BL_PAGE_SLOG; }
+
                /*
                 * Check here if we need to use a different path one level up
                 * and modify mypath.
@@ -772,31 +1224,47 @@ static int $mfd_get_sn_steps(
                fd = open(mysnpath, O_RDONLY);
                if(fd == -1) {
                   ret = errno;
-                  if(ret == ENOENT) {
-                     mfd->sn_steps[sni].datfd = $$SN_STEPS_UNUSED;
-                     continue;
-                  } else {
+                  if(ret != ENOENT) {
                      $dlogi("ERROR mfd_get_sn_steps: open on '%s' failed with %d = %s/n", mysnpath, ret, strerror(ret));
                      waserror = -ret;
                      break;
                   }
+                  // There is no dat file if the file was empty or did not exist when
+                  // the snapshot was taken, but the map file still describes the file,
+                  // so we must not skip to the next snapshot.
+                  fd = $$SN_STEPS_UNUSED;
                }
 
                // We save this here so that mfd_destroy_sn_steps would close it on error
                mfd->sn_steps[sni].datfd = fd;
 
+               // Identify the dat file for the block cache
+               if(fd >= 0 && fsdata->bcache != NULL) {
+                  if(unlikely(fstat(fd, &mystat) != 0)) {
+                     waserror = -errno;
+                     $dlogi("ERROR mfd_get_sn_steps: fstat on dat failed with %d = %s/n", -waserror, strerror(-waserror));
+                     break;
+                  }
+                  mfd->sn_steps[sni].bckey.dev = mystat.st_dev;
+                  mfd->sn_steps[sni].bckey.ino = mystat.st_ino;
+                  mfd->sn_steps[sni].bckey.gen = fsdata->bcache_gen;
+                  mfd->sn_steps[sni].bckey.pointer = 0;
+               }
+
             }
 
          } else { // a main file
 
             mfd->sn_steps[sni].mapfd = $$SN_STEPS_MAIN;
 
-            // Initialise the lock label
-            mfd->locklabel = $string2locklabel(mfd->sn_steps[sni].path);
-
+            // Initialise the lock label the same way as for the main file opened (see $mfd_set_locklabel)
             if(flags & $$SN_STEPS_F_SKIPOPENDAT) {
 
                mfd->sn_steps[sni].datfd = $$SN_STEPS_NOTOPEN;
+               if(unlikely((waserror = $mfd_set_locklabel(mfd, mfd->sn_steps[sni].path)) != 0)) {
+                  $dlogi("ERROR mfd_get_sn_steps: lstat on '%s' failed with %d = %s\n", mfd->sn_steps[sni].path, -waserror, strerror(-waserror));
+                  break;
+               }
 
             } else {
 
@@ -805,19 +1273,31 @@ static int $mfd_get_sn_steps(
                fd = open(mfd->sn_steps[sni].path, O_RDONLY);
                if(fd == -1) {
                   ret = errno;
-                  if(ret == ENOENT) {
-                     mfd->sn_steps[sni].datfd = $$SN_STEPS_UNUSED;
-                     continue;
-                  } else {
+                  if(ret != ENOENT) {
                      $dlogi("ERROR mfd_get_sn_steps: open on '%s' failed with %d = %s/n", mysnpath, ret, strerror(ret));
                      waserror = -ret;
                      break;
                   }
+                  // There is no dat file if the file was empty or did not exist when
+                  // the snapshot was taken, but the map file still describes the file,
+                  // so we must not skip to the next snapshot.
+                  fd = $$SN_STEPS_UNUSED;
                }
 
                // We save this here so that mfd_destroy_sn_steps would close it on error
                mfd->sn_steps[sni].datfd = fd;
 
+               if(fd >= 0) {
+                  if(unlikely(fstat(fd, &mystat) != 0)) {
+                     waserror = -errno;
+                     $dlogi("ERROR mfd_get_sn_steps: fstat on main failed with %d = %s\n", -waserror, strerror(-waserror));
+                     break;
+                  }
+                  mfd->locklabel = $stat2locklabel(&mystat);
+               } else {
+                  mfd->locklabel = $string2locklabel(mfd->sn_steps[sni].path);
+               }
+
             }
 
          }
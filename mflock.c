@@ -34,113 +34,60 @@
  * in this file. To write $, use \$.
  */
 
-/* We implement a mutex-based locking mechanism here that allows
- * $$LOCK_NUM files to be written in parallel by different threads,
- * while only one thread may write a file at any time.
+/* We implement a locking mechanism here that allows any number of files
+ * to be written in parallel by different threads, while only one thread
+ * may write a file (or a group of its blocks, see $b_lock_label) at any time.
  *
  * We need this restriction to ensure that when a block is saved in the dat file,
  * only one thread is writing that file. This applies even if the dat file
  * is a journal storing possibly more changes to the same block, and
  * if it's opened with O_APPEND.
  *
- * We set up a limited number of locks here to save the overhead of a hash
- * storage (from files(e.g. inodes) to a mutex). Mutexes here are organised in a table
- * and can be labelled. We need to protect changes to the table
- * so that a label and a mutex would function as a unit, but instead of
- * locking the whole table whenever it changes, we use MOD mutexes
- * which only lock changes related to certain labels. There are $$LOCK_NUM
- * MOD mutexes, and MOD mutex i is used when label % $$LOCK_NUM == i.
+ * Files are identified by labels: main files by their device and inode number
+ * (see $mfd_set_locklabel), other things by a name (see $string2locklabel).
+ * Locks are looked up comparing the whole label, so files never share a lock
+ * because their labels collide. Labels being locked or waited for have a lock
+ * in a hash table; other labels take up no space.
+ * A lock records whether it is held and how many threads are waiting for it.
+ * It can be held exclusively ($mflock_lock), or shared by threads that only
+ * read the blocks it protects ($mflock_lock_shared). Threads waiting to hold
+ * it exclusively keep new threads from sharing it, so that they are not starved.
+ * Waiting threads block on the condition variable of the lock, and the thread
+ * releasing it last wakes them, so no thread polls. When a lock is released
+ * and no one is waiting for it, it is removed from the table and freed.
  *
- * Moreover, to save the overhead or re-labelling mutexes, there is a system
- * where mutexes can be handed over to other threads if they are waiting
- * for the mutex on the same label. This is done using the 'want' member.
+ * The hash buckets are protected by $$LOCK_STRIPES mutexes, bucket i by
+ * stripe i % $$LOCK_STRIPES. As the number of buckets is always a multiple of
+ * the number of stripes, the stripe of a label does not depend on it.
+ * When there are more locks in the table than buckets, the number of buckets
+ * is doubled, holding all the stripes.
  *
- * Rules of thumb:
- * - Reverse procedures should be symmetrical
- * - Re-check expected condition after getting mutex
+ * Locks are allocated in chunks that are never moved or freed while ESFS
+ * is running, so the ID of a lock returned to the caller (an int, as the
+ * callers expect) remains valid until the lock is released.
  *
+ * Contention is counted all the time, so that it can be inspected without
+ * rebuilding ESFS with debug messages. Each stripe counts acquisitions, waits,
+ * wakeups and a histogram of the time spent waiting for the labels in it;
+ * these are updated holding the stripe, and the clock is only read when a thread
+ * has to wait. Each lock also counts its own waits, and when it is freed, they
+ * are kept in a short list of the most contended labels. See $mflock_stats.
  */
 
-/* GET LOCK:
- *
- * START:
- * if(label is in table -> i){
- *    want i++
- *    get mutex i
- *    want i--
- *    recheck: if(label i != label){
- *       goto START
- *    }
- *    return i
- * }
- *
- * // label is not in table
- * get MOD mutex
- * recheck if(label is in table -> i){
- *    release MOD mutex
- *    want i++
- *    get mutex i
- *    want i--
- *    recheck: if(label i != label){
- *       goto START
- *    }
- *    return i
- * }
- *
- * FIND:
- * try all non-labelled mutexes in a loop until able to get one -> i
- * recheck: if(label no longer empty){
- *    // we must be in the middle of a handover
- *    release mutex i
- *    goto FIND: - OR - release MOD mutex; goto START:
- * }
- * label := new label
- * release MOD mutex
- * return i
- *
- * RELEASE LOCK:
- * if(want==0){
- *    get MOD mutex
- *    recheck if (want==0){
- *       label := 0
- *       release mutex
- *       release MOD mutex
- *       return
- *    }
- *    release MOD mutex
- * }
- * release mutex
- * return
- *
- *
- * Consequences:
- * - an label can only be added to / removed from the table if its MOD mutex is held,
- *    AND the mutex being labelled is held
- *
- * A labels the mutex and hands it over to B:
- *
- * MOD   -----AAAAAAAAAAAA--|--------------|--BBBBBBBBBB-----
- * LABEL ------------+++++++|++++++++++++++|+++++------------
- * MUTEX ---------AAAAAAAAAA|AAAAAAAA--BBBB|BBBBBBBB---------
- * WANT  -------------------|---111111111--|-----------------
- *
- * Handover fails because want is set too late by B. B starts over.
- *
- * MOD   -----AAAAAAAAAAAA--|-B--AAAAAAA-----
- * LABEL ------------+++++++|++++++----------
- * MUTEX ---------AAAAAAAAAA|AAAAAAAA--------
- * WANT  -------------------|----------111---
- *
- * A and B try to add the same label, but A gets the MOD mutex first,
- * so it becomes a handover:
- *
- * MOD    --AAAAAAAAAA--BB-----------
- * LABEL1 -------++++++++++++++++++++
- * MUTEX1 -----AAAAAAAAAAAAAAA-BBBBBB
- * WANT1  ------------------11111----
- *
- *
- */
+
+/** Returns a lock from its ID */
+#define $$MFLOCK(table, id) (&((table)->chunks[(id) / $$LOCK_CHUNK][(id) % $$LOCK_CHUNK]))
+
+
+/** Mixes the bits of a label to get its hash */
+static inline unsigned long $mflock_hash($$LOCKLABEL_T label)
+{
+   uint64_t h;
+
+   h = label.ino ^ (label.dev * 0xC2B2AE3D27D4EB4FULL) ^ (label.part * 0x165667B19E3779F9ULL);
+   return (unsigned long)((h * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
 
 /** Allocates memory and initialises the mutexes.
  *
@@ -151,134 +98,331 @@
 static int $mflock_init(struct $fsdata_t *fsdata)
 {
    int i;
+   struct $mflock_table_t *table;
    pthread_mutexattr_t mutexattr;
 
+   table = malloc(sizeof(struct $mflock_table_t));
+   if(table == NULL) { return -ENOMEM; }
+
+   table->buckets = malloc(sizeof(int) * $$LOCK_BUCKETS);
+   if(table->buckets == NULL) {
+      free(table);
+      return -ENOMEM;
+   }
+
+   fsdata->open_counts = calloc($$OPEN_COUNTS, sizeof(int));
+   if(fsdata->open_counts == NULL) {
+      free(table->buckets);
+      free(table);
+      return -ENOMEM;
+   }
+
+   fsdata->dattails = calloc($$DATTAIL_BUCKETS, sizeof(struct $dattail_t *));
+   if(fsdata->dattails == NULL) {
+      free(fsdata->open_counts);
+      free(table->buckets);
+      free(table);
+      return -ENOMEM;
+   }
+
    pthread_mutexattr_init(&mutexattr);
    pthread_mutexattr_settype(&mutexattr, $$MUTEXT_TYPE);
 
-   fsdata->mflocks = malloc(sizeof(struct $mflock_t) * $$LOCK_NUM);
-   if(fsdata->mflocks == NULL) { return -ENOMEM; }
-
-   for(i = 0; i < $$LOCK_NUM; i++) {
-      pthread_mutex_init(&(fsdata->mflocks[i].mutex), &mutexattr);
-      pthread_mutex_init(&(fsdata->mflocks[i].mod_mutex), &mutexattr);
-      fsdata->mflocks[i].label = 0;
-      fsdata->mflocks[i].want = 0;
+   for(i = 0; i < $$LOCK_STRIPES; i++) {
+      pthread_mutex_init(&(table->stripes[i]), &mutexattr);
+   }
+   for(i = 0; i < $$LOCK_BUCKETS; i++) {
+      table->buckets[i] = -1;
    }
+   table->nbuckets = $$LOCK_BUCKETS;
+   table->used = 0;
+   pthread_mutex_init(&(table->alloc_mutex), &mutexattr);
+   table->free = -1;
+   table->nchunks = 0;
+   table->enolck = 0;
+   table->grows = 0;
+   memset(table->stats, 0, sizeof(table->stats));
+   pthread_mutex_init(&(table->hot_mutex), &mutexattr);
+   table->nhot = 0;
+
+   pthread_mutex_init(&(fsdata->dattails_mutex), &mutexattr);
 
    pthread_mutexattr_destroy(&mutexattr);
+   fsdata->mflocks = table;
    return 0;
 }
 
 
 static int $mflock_destroy(struct $fsdata_t *fsdata)
 {
-   int i;
+   int i, j;
+   struct $mflock_table_t *table;
 
-   for(i = 0; i < $$LOCK_NUM; i++) {
-      pthread_mutex_destroy(&(fsdata->mflocks[i].mutex));
-      pthread_mutex_destroy(&(fsdata->mflocks[i].mod_mutex));
+   table = fsdata->mflocks;
+   for(i = 0; i < table->nchunks; i++) {
+      for(j = 0; j < $$LOCK_CHUNK; j++) {
+         pthread_cond_destroy(&(table->chunks[i][j].cond));
+      }
+      free(table->chunks[i]);
    }
-   free(fsdata->mflocks);
+   for(i = 0; i < $$LOCK_STRIPES; i++) {
+      pthread_mutex_destroy(&(table->stripes[i]));
+   }
+   pthread_mutex_destroy(&(table->alloc_mutex));
+   pthread_mutex_destroy(&(table->hot_mutex));
+   free(table->buckets);
+   free(table);
+   free(fsdata->open_counts);
+   pthread_mutex_destroy(&(fsdata->dattails_mutex));
+   free(fsdata->dattails);
    return 0;
 }
 
 
-/** Gets a lock for a particular label
- *
- * label==0 means that the lock is not in use, so it cannot be used here
+/** Gets a free lock, allocating a new chunk of locks if needed
  *
  * Returns:
- * * lock number on success (>=0)
+ * * the ID of the lock on success (>=0)
  * * -errno on error
  */
-static int $mflock_lock(struct $fsdata_t *fsdata, $$LOCKLABEL_T label)
+static int $mflock_alloc(struct $mflock_table_t *table)
 {
-   int i;
-   int ret;
-   int ml = -1;
-   struct $mflock_t *mylock;
-   pthread_mutex_t *modmutex = NULL;
-   struct timespec delay = { 0, 10000000 }; // nanoseconds: 1 000 000 000
+   struct $mflock_t *chunk;
+   int i, id;
 
-   while(1) { // START:
+   pthread_mutex_lock(&(table->alloc_mutex));
 
-      mylock = NULL;
-      for(i = 0; i < $$LOCK_NUM; i++) {
-         if(fsdata->mflocks[i].label == label) {
-            ml = i;
-            mylock = &(fsdata->mflocks[i]);
-            break;
-         }
+   if(table->free == -1) {
+      if(unlikely(table->nchunks == $$LOCK_CHUNKS)) {
+         table->enolck++;
+         pthread_mutex_unlock(&(table->alloc_mutex));
+         return -ENOLCK;
+      }
+      chunk = malloc(sizeof(struct $mflock_t) * $$LOCK_CHUNK);
+      if(unlikely(chunk == NULL)) {
+         pthread_mutex_unlock(&(table->alloc_mutex));
+         return -ENOMEM;
+      }
+      for(i = 0; i < $$LOCK_CHUNK; i++) {
+         pthread_cond_init(&(chunk[i].cond), NULL);
+         chunk[i].next = (i + 1 < $$LOCK_CHUNK ? table->nchunks * $$LOCK_CHUNK + i + 1 : -1);
       }
+      table->chunks[table->nchunks] = chunk;
+      table->free = table->nchunks * $$LOCK_CHUNK;
+      table->nchunks++;
+   }
 
-      if(mylock != NULL) { // if label is in the table
-         if(unlikely(modmutex != NULL)) {
-            // recheck failed; release the modmutex and carry on as usual
-            pthread_mutex_unlock(modmutex);
-            modmutex = NULL;
-         }
-         (mylock->want)++; // request handover
-         pthread_mutex_lock(&(mylock->mutex));
-         (mylock->want)--;
-         if(likely(mylock->label == label)) { // recheck
-            // We have (successfully taken over) the mutex and it's labelled with the label
-            $dlogdbg("_lock: got lock '%d' for label '%lu' (takeover)\n", ml, label);
-            return ml;
+   id = table->free;
+   table->free = $$MFLOCK(table, id)->next;
+
+   pthread_mutex_unlock(&(table->alloc_mutex));
+   return id;
+}
+
+
+/** Puts a lock on the free list */
+static void $mflock_free(struct $mflock_table_t *table, int id)
+{
+   pthread_mutex_lock(&(table->alloc_mutex));
+   $$MFLOCK(table, id)->next = table->free;
+   table->free = id;
+   pthread_mutex_unlock(&(table->alloc_mutex));
+}
+
+
+/** Doubles the number of hash buckets if there are more locks than buckets.
+ * Failing to allocate memory is not an error; the buckets just get longer.
+ */
+static void $mflock_grow(struct $mflock_table_t *table)
+{
+   int *newbuckets;
+   int i, id, next, nbuckets;
+   unsigned long h;
+
+   for(i = 0; i < $$LOCK_STRIPES; i++) { pthread_mutex_lock(&(table->stripes[i])); }
+
+   if(table->used > table->nbuckets) {
+      nbuckets = table->nbuckets * 2;
+      newbuckets = malloc(sizeof(int) * nbuckets);
+      if(newbuckets != NULL) {
+         for(i = 0; i < nbuckets; i++) { newbuckets[i] = -1; }
+         for(i = 0; i < table->nbuckets; i++) {
+            for(id = table->buckets[i]; id != -1; id = next) {
+               next = $$MFLOCK(table, id)->next;
+               h = $mflock_hash($$MFLOCK(table, id)->label) & (nbuckets - 1);
+               $$MFLOCK(table, id)->next = newbuckets[h];
+               newbuckets[h] = id;
+            }
          }
-         // If recheck fails, retry from start
-         $$SLEEP
-         continue;
+         free(table->buckets);
+         table->buckets = newbuckets;
+         table->nbuckets = nbuckets;
+         table->grows++;
       }
+   }
+
+   for(i = $$LOCK_STRIPES - 1; i >= 0; i--) { pthread_mutex_unlock(&(table->stripes[i])); }
+}
+
+
+/** Returns the time in microseconds for measuring waits */
+static inline unsigned long long $mflock_now_us(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long long)ts.tv_sec * 1000000ULL + (unsigned long long)ts.tv_nsec / 1000;
+}
+
+
+/** Counts a wait for a lock. Should be called holding the stripe of the lock. */
+static void $mflock_count_wait(struct $lockstat_t *stats, struct $mflock_t *mylock, unsigned long long us)
+{
+   int i;
+
+   for(i = 0; i < $$LOCKSTAT_HIST - 1 && (us >> i) != 0; i++) { }
+   stats->hist[i]++;
+   stats->contended++;
+   stats->wait_us += us;
+   if(us > stats->max_wait_us) { stats->max_wait_us = us; }
+   mylock->contended++;
+   mylock->wait_us += us;
+}
+
+
+/** Keeps the counters of a label whose lock has been freed if it is among
+ * the $$LOCKSTAT_HOT labels that waited the longest
+ */
+static void $mflock_keep_hot(struct $mflock_table_t *table, const struct $lockstat_label_t *ls)
+{
+   int i, min = 0;
+
+   pthread_mutex_lock(&(table->hot_mutex));
+
+   for(i = 0; i < table->nhot; i++) {
+      if($$LOCKLABEL_EQ(table->hot[i].label, ls->label)) { break; }
+      if(table->hot[i].wait_us < table->hot[min].wait_us) { min = i; }
+   }
+
+   if(i < table->nhot) { // the label has been contended before
+      table->hot[i].acquired += ls->acquired;
+      table->hot[i].contended += ls->contended;
+      table->hot[i].wait_us += ls->wait_us;
+   } else if(table->nhot < $$LOCKSTAT_HOT) {
+      table->hot[table->nhot++] = *ls;
+   } else if(table->hot[min].wait_us < ls->wait_us) {
+      table->hot[min] = *ls;
+   }
+
+   pthread_mutex_unlock(&(table->hot_mutex));
+}
+
 
-      // label is not in the table:
-      // get the modmutex and re-check that the label is still not in the table
+/** Gets a lock for a particular label, exclusively or shared (see $mflock_lock and $mflock_lock_shared)
+ *
+ * Returns:
+ * * lock ID on success (>=0)
+ * * -errno on error
+ */
+static int $mflock_get(struct $fsdata_t *fsdata, $$LOCKLABEL_T label, int shared /**< 0 or 1 */)
+{
+   struct $mflock_table_t *table;
+   struct $mflock_t *mylock;
+   struct $lockstat_t *stats;
+   pthread_mutex_t *stripe;
+   unsigned long long start = 0;
+   unsigned long h;
+   int id, grow = 0, waited = 0;
+
+   table = fsdata->mflocks;
+   h = $mflock_hash(label);
+   stripe = &(table->stripes[h & ($$LOCK_STRIPES - 1)]);
+   stats = &(table->stats[h & ($$LOCK_STRIPES - 1)]);
 
-      if(modmutex == NULL) { // If we don't yet have the modmutex
-         modmutex = &(fsdata->mflocks[label & ($$LOCK_NUM - 1)].mod_mutex);
-         if(unlikely((ret = pthread_mutex_lock(modmutex)) != 0)) { return -ret; }
-         continue; // Start over for a re-check.
+   pthread_mutex_lock(stripe);
+
+   for(id = table->buckets[h & (table->nbuckets - 1)]; id != -1; id = $$MFLOCK(table, id)->next) {
+      if($$LOCKLABEL_EQ($$MFLOCK(table, id)->label, label)) { break; }
+   }
+
+   if(id == -1) { // label is not in the table
+      if(unlikely((id = $mflock_alloc(table)) < 0)) {
+         pthread_mutex_unlock(stripe);
+         $dlogi("ERROR _lock: could not allocate a lock, error %d = %s\n", -id, strerror(-id));
+         return id;
       }
+      mylock = $$MFLOCK(table, id);
+      mylock->label = label;
+      mylock->held = 0;
+      mylock->waiters = 0;
+      mylock->xwaiters = 0;
+      mylock->acquired = 0;
+      mylock->contended = 0;
+      mylock->wait_us = 0;
+      mylock->next = table->buckets[h & (table->nbuckets - 1)];
+      table->buckets[h & (table->nbuckets - 1)] = id;
+      grow = (__atomic_add_fetch(&(table->used), 1, __ATOMIC_RELAXED) > table->nbuckets);
+   } else {
+      mylock = $$MFLOCK(table, id);
+   }
 
-      // We have the modmutex and label is not in the table
-      // try all non-labelled locks in the table
-      while(1) { // FIND:
-         ml = -1;
-         for(i = 0; i < $$LOCK_NUM; i++) {
-            if(likely(fsdata->mflocks[i].label == 0)) {
-               ret = pthread_mutex_trylock(&(fsdata->mflocks[i].mutex));
-               if(likely(ret == 0)) { // got the lock
-                  ml = i;
-                  break;
-               } else if(ret == EBUSY) { // lock is busy
-                  continue;
-               } else { // error
-                  return -ret;
-               }
-            }
-         }
+   if(shared) {
+      while(mylock->held < 0 || mylock->xwaiters > 0) {
+         if(!waited) { start = $mflock_now_us(); waited = 1; }
+         mylock->waiters++;
+         pthread_cond_wait(&(mylock->cond), stripe);
+         mylock->waiters--;
+         stats->wakeups++;
+      }
+      mylock->held++;
+      stats->shared++;
+   } else {
+      while(mylock->held != 0) {
+         if(!waited) { start = $mflock_now_us(); waited = 1; }
+         mylock->waiters++;
+         mylock->xwaiters++;
+         pthread_cond_wait(&(mylock->cond), stripe);
+         mylock->xwaiters--;
+         mylock->waiters--;
+         stats->wakeups++;
+      }
+      mylock->held = -1;
+      stats->acquired++;
+   }
+   mylock->acquired++;
+   if(unlikely(waited)) { $mflock_count_wait(stats, mylock, $mflock_now_us() - start); }
 
-         if(ml > -1) { // managed to get a mutex
-            // recheck if the mutex is still unlabelled
-            if(likely(fsdata->mflocks[ml].label == 0)) {
-               // Success
-               fsdata->mflocks[ml].label = label;
-               if(unlikely((ret = pthread_mutex_unlock(modmutex)) != 0)) { return -ret; }
-               $dlogdbg("_lock: got lock '%d' for label '%lu'\n", ml, label);
-               return ml;
-            }
-            // if recheck fails, release the mutex and continue from FIND
-            // (this must be the middle of a handover)
-            if(unlikely((ret = pthread_mutex_unlock(&(fsdata->mflocks[i].mutex))) != 0)) { return -ret; }
-         }
+   pthread_mutex_unlock(stripe);
 
-         $$SLEEP
+   if(unlikely(grow)) { $mflock_grow(table); }
 
-      } // end FIND
+   $dlogdbg("_lock: got lock '%d' for label '%llu:%llu:%llu' shared=%d\n", id, (unsigned long long)label.dev, (unsigned long long)label.ino, (unsigned long long)label.part, shared);
+   return id;
+}
+
+
+/** Gets a lock for a particular label exclusively
+ *
+ * Returns:
+ * * lock ID on success (>=0)
+ * * -errno on error
+ */
+static inline int $mflock_lock(struct $fsdata_t *fsdata, $$LOCKLABEL_T label)
+{
+   return $mflock_get(fsdata, label, 0);
+}
 
-   } // end START
 
-   return -EIO; // unreachable
+/** Gets a lock for a particular label, sharing it with other threads that do not
+ * hold it exclusively. Release it with $mflock_unlock.
+ *
+ * Returns:
+ * * lock ID on success (>=0)
+ * * -errno on error
+ */
+static inline int $mflock_lock_shared(struct $fsdata_t *fsdata, $$LOCKLABEL_T label)
+{
+   return $mflock_get(fsdata, label, 1);
 }
 
 
@@ -290,27 +434,138 @@ static int $mflock_lock(struct $fsdata_t *fsdata, $$LOCKLABEL_T label)
  */
 static int $mflock_unlock(struct $fsdata_t *fsdata, int lockid)
 {
-   int ret;
+   struct $mflock_table_t *table;
    struct $mflock_t *mylock;
-   pthread_mutex_t *modmutex;
+   struct $lockstat_label_t hot;
+   pthread_mutex_t *stripe;
+   unsigned long h;
+   int *link;
 
    $dlogdbg("_lock: releasing lock '%d'\n", lockid);
 
-   mylock = &(fsdata->mflocks[lockid]);
+   table = fsdata->mflocks;
+   mylock = $$MFLOCK(table, lockid);
+   h = $mflock_hash(mylock->label); // the label cannot change while we hold the lock
+   stripe = &(table->stripes[h & ($$LOCK_STRIPES - 1)]);
 
-   if(mylock->want == 0) { // no one wants a handover
-      modmutex = &(fsdata->mflocks[mylock->label & ($$LOCK_NUM - 1)].mod_mutex);
-      if(unlikely((ret = pthread_mutex_lock(modmutex)) != 0)) { return -ret; }
-      if(mylock->want == 0) { // recheck
-         mylock->label = 0;
-         if(unlikely((ret = pthread_mutex_unlock(&(mylock->mutex))) != 0)) { return -ret; }
-         if(unlikely((ret = pthread_mutex_unlock(modmutex)) != 0)) { return -ret; }
-         return 0;
-      }
-      // oops - they want a handover
-      if(unlikely((ret = pthread_mutex_unlock(modmutex)) != 0)) { return -ret; }
+   pthread_mutex_lock(stripe);
+
+   if(mylock->held > 0) { mylock->held--; } else { mylock->held = 0; }
+   if(mylock->held > 0) { // still shared by other threads
+      pthread_mutex_unlock(stripe);
+      return 0;
+   }
+   if(mylock->waiters > 0) {
+      // Wake all, as several threads may share the lock next
+      pthread_cond_broadcast(&(mylock->cond));
+      pthread_mutex_unlock(stripe);
+      return 0;
    }
-   // handover - release lock without removing label
-   if(unlikely((ret = pthread_mutex_unlock(&(mylock->mutex))) != 0)) { return -ret; }
+
+   // No one is waiting; remove the lock from the table
+   for(link = &(table->buckets[h & (table->nbuckets - 1)]); *link != lockid; link = &($$MFLOCK(table, *link)->next)) { }
+   *link = mylock->next;
+   __atomic_sub_fetch(&(table->used), 1, __ATOMIC_RELAXED);
+   hot.label = mylock->label;
+   hot.acquired = mylock->acquired;
+   hot.contended = mylock->contended;
+   hot.wait_us = mylock->wait_us;
+
+   pthread_mutex_unlock(stripe);
+
+   $mflock_free(table, lockid);
+   if(unlikely(hot.contended > 0)) { $mflock_keep_hot(table, &hot); }
    return 0;
 }
+
+
+/** Writes a report of lock contention into buf, like snprintf
+ *
+ * The report lists the totals and the counters of each stripe, the histogram
+ * of the time spent waiting, the labels that waited the longest among those
+ * whose locks have been freed, and the contended labels that are still locked.
+ * Labels are shown as device:inode:part (see $locklabel_t).
+ *
+ * Returns:
+ * * the length of the report, which may be more than size-1 if it has been truncated
+ */
+static int $mflock_stats(struct $fsdata_t *fsdata, char *buf, size_t size)
+{
+   struct $mflock_table_t *table;
+   struct $lockstat_t stats[$$LOCK_STRIPES];
+   struct $lockstat_t total;
+   struct $lockstat_label_t live[$$LOCKSTAT_HOT];
+   struct $lockstat_label_t hot[$$LOCKSTAT_HOT];
+   struct $mflock_t *mylock;
+   size_t len = 0;
+   int i, j, id, nlive = 0, nhot;
+
+#define $$LOCKSTAT_PRINT(...) do{ \
+      int _r = snprintf(buf + (len < size ? len : size), (len < size ? size - len : 0), __VA_ARGS__); \
+      if(_r > 0) { len += _r; } \
+   }while(0)
+
+   table = fsdata->mflocks;
+
+   memset(&total, 0, sizeof(total));
+   for(i = 0; i < $$LOCK_STRIPES; i++) {
+      pthread_mutex_lock(&(table->stripes[i]));
+      stats[i] = table->stats[i];
+      // The number of buckets cannot change while we hold a stripe
+      for(j = i; j < table->nbuckets; j += $$LOCK_STRIPES) {
+         for(id = table->buckets[j]; id != -1 && nlive < $$LOCKSTAT_HOT; id = mylock->next) {
+            mylock = $$MFLOCK(table, id);
+            if(mylock->contended == 0) { continue; }
+            live[nlive].label = mylock->label;
+            live[nlive].acquired = mylock->acquired;
+            live[nlive].contended = mylock->contended;
+            live[nlive].wait_us = mylock->wait_us;
+            nlive++;
+         }
+      }
+      pthread_mutex_unlock(&(table->stripes[i]));
+
+      total.acquired += stats[i].acquired;
+      total.shared += stats[i].shared;
+      total.contended += stats[i].contended;
+      total.wakeups += stats[i].wakeups;
+      total.wait_us += stats[i].wait_us;
+      if(stats[i].max_wait_us > total.max_wait_us) { total.max_wait_us = stats[i].max_wait_us; }
+      for(j = 0; j < $$LOCKSTAT_HIST; j++) { total.hist[j] += stats[i].hist[j]; }
+   }
+
+   pthread_mutex_lock(&(table->hot_mutex));
+   nhot = table->nhot;
+   memcpy(hot, table->hot, sizeof(struct $lockstat_label_t) * nhot);
+   pthread_mutex_unlock(&(table->hot_mutex));
+
+   pthread_mutex_lock(&(table->alloc_mutex));
+   $$LOCKSTAT_PRINT("locks: used %d chunks %d enolck %llu\n", __atomic_load_n(&(table->used), __ATOMIC_RELAXED), table->nchunks, table->enolck);
+   pthread_mutex_unlock(&(table->alloc_mutex));
+
+   for(i = -1; i < $$LOCK_STRIPES; i++) {
+      struct $lockstat_t *s = (i < 0 ? &total : &(stats[i]));
+      if(i < 0) { $$LOCKSTAT_PRINT("total:"); } else { $$LOCKSTAT_PRINT("stripe %d:", i); }
+      $$LOCKSTAT_PRINT(" acquired %llu shared %llu contended %llu wakeups %llu wait_us %llu max_wait_us %llu\n",
+         s->acquired, s->shared, s->contended, s->wakeups, s->wait_us, s->max_wait_us);
+   }
+
+   for(i = 0; i < $$LOCKSTAT_HIST; i++) {
+      if(i < $$LOCKSTAT_HIST - 1) {
+         $$LOCKSTAT_PRINT("wait_us < %llu: %llu\n", 1ULL << i, total.hist[i]);
+      } else {
+         $$LOCKSTAT_PRINT("wait_us >= %llu: %llu\n", 1ULL << (i - 1), total.hist[i]);
+      }
+   }
+
+   for(i = 0; i < nhot + nlive; i++) {
+      struct $lockstat_label_t *l = (i < nhot ? &(hot[i]) : &(live[i - nhot]));
+      $$LOCKSTAT_PRINT("label %llu:%llu:%llu %s acquired %llu contended %llu wait_us %llu\n",
+         (unsigned long long)l->label.dev, (unsigned long long)l->label.ino, (unsigned long long)l->label.part,
+         (i < nhot ? "freed" : "locked"), l->acquired, l->contended, l->wait_us);
+   }
+
+#undef $$LOCKSTAT_PRINT
+
+   return (int)len;
+}
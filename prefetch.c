@@ -0,0 +1,265 @@
+/*
+  This file is part of ESFS, a FUSE-based filesystem that supports snapshots.
+  ESFS is Copyright (C) 2013 Elod Csirmaz
+  <http://www.epcsirmaz.com/> <https://github.com/csirmaz>.
+
+  ESFS is based on Big Brother File System (fuse-tutorial)
+  Copyright (C) 2012 Joseph J. Pfeiffer, Jr., Ph.D. <pfeiffer@cs.nmsu.edu>,
+  and was forked from it on 21 August 2013.
+  Big Brother File System can be distributed under the terms of
+  the GNU GPLv3. See the file COPYING.
+  See also <http://www.cs.nmsu.edu/~pfeiffer/fuse-tutorial/>.
+
+  Big Brother File System was derived from function prototypes found in
+  /usr/include/fuse/fuse.h
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+  fuse.h is licensed under the LGPLv2.
+
+  ESFS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  ESFS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * NOTE: A Perl script is used to replace $ with esfs_ and $$ with ESFS_
+ * in this file. To write $, use \$.
+ */
+/* This file contains the pool of threads reading snapshot files ahead of their readers.
+ *
+ * Prefetching
+ * ===========
+ *
+ * Reading a file in a snapshot may require checking the map files of several
+ * snapshots for each block, and as FUSE requests are processed synchronously,
+ * streaming a snapshot file is limited by the latency of reading single blocks.
+ *
+ * To help with this, $prefetch_read is called after each successful read of
+ * a snapshot file. If the handle has been read sequentially for $$PREFETCH_TRIGGER
+ * reads, the next fsdata->prefetch_blocks blocks are queued, and one of the
+ * workers reads them using $b_prefetch into the block cache (or the page cache).
+ * As the queued requests refer to the mfds, $prefetch_forget must be called
+ * before an mfd is freed.
+ *
+ * The workers are started in $init, as FUSE may fork before that.
+ * If prefetching is disabled (--prefetch=0) or the workers cannot be started,
+ * fsdata->prefetch is NULL.
+ */
+
+
+/** The main function of the worker threads */
+static void *$prefetch_worker(void *privdata)
+{
+   struct $fsdata_t *fsdata;
+   struct $prefetch_t *pf;
+   struct $prefetch_job_t job;
+   char *buffer;
+   int ret;
+
+   fsdata = (struct $fsdata_t *)privdata;
+   pf = fsdata->prefetch;
+
+   buffer = malloc($$BL_S * 2);
+
+   pthread_mutex_lock(&(pf->mutex));
+
+   while(1) {
+
+      while(pf->stop == 0 && pf->used == 0) { pthread_cond_wait(&(pf->wake), &(pf->mutex)); }
+      if(pf->stop != 0) { break; }
+
+      memcpy(&job, &(pf->queue[pf->first]), sizeof(struct $prefetch_job_t));
+      pf->first = (pf->first + 1) % $$PREFETCH_QUEUE;
+      pf->used--;
+
+      if(job.mfd == NULL) { continue; } // cancelled by $prefetch_forget
+
+      pthread_mutex_unlock(&(pf->mutex));
+
+      // Do not bother if the handle can no longer be read
+      if(buffer != NULL && $mfd_in_sn_validate(job.mfd, fsdata) == 0) {
+         $dlogdbg("prefetch: reading blockoffset='%zu' blocknumber='%zu'\n", job.blockoffset, job.blocknumber);
+         if(unlikely((ret = $b_prefetch(fsdata, job.mfd, job.blockoffset, job.blocknumber, buffer)) != 0)) {
+            $dlogi("ERROR prefetch: b_prefetch failed with %d = %s\n", -ret, strerror(-ret));
+         }
+      }
+
+      pthread_mutex_lock(&(pf->mutex));
+      job.mfd->pf_jobs--;
+      pthread_cond_broadcast(&(pf->done));
+
+   }
+
+   pthread_mutex_unlock(&(pf->mutex));
+
+   free(buffer);
+   return NULL;
+}
+
+
+/** Stops the workers and frees the prefetch pool
+ */
+static void $prefetch_destroy(struct $fsdata_t *fsdata)
+{
+   struct $prefetch_t *pf;
+   int i;
+
+   pf = fsdata->prefetch;
+   if(pf == NULL) { return; }
+
+   pthread_mutex_lock(&(pf->mutex));
+   pf->stop = 1;
+   pthread_cond_broadcast(&(pf->wake));
+   pthread_mutex_unlock(&(pf->mutex));
+
+   for(i = 0; i < pf->threads; i++) {
+      pthread_join(pf->thread[i], NULL);
+   }
+
+   pthread_cond_destroy(&(pf->wake));
+   pthread_cond_destroy(&(pf->done));
+   pthread_mutex_destroy(&(pf->mutex));
+   free(pf);
+   fsdata->prefetch = NULL;
+}
+
+
+/** Starts the prefetch workers based on fsdata->prefetch_blocks
+ *
+ * Returns:
+ * * 0 on success
+ * * -errno on error
+ */
+static int $prefetch_init(struct $fsdata_t *fsdata)
+{
+   struct $prefetch_t *pf;
+   int ret;
+
+   fsdata->prefetch = NULL;
+
+   if(fsdata->prefetch_blocks <= 0) { return 0; }
+
+   pf = calloc(1, sizeof(struct $prefetch_t));
+   if(pf == NULL) { return -ENOMEM; }
+
+   pthread_mutex_init(&(pf->mutex), NULL);
+   pthread_cond_init(&(pf->wake), NULL);
+   pthread_cond_init(&(pf->done), NULL);
+   fsdata->prefetch = pf;
+
+   for(pf->threads = 0; pf->threads < $$PREFETCH_THREADS; pf->threads++) {
+      if(unlikely((ret = pthread_create(&(pf->thread[pf->threads]), NULL, $prefetch_worker, fsdata)) != 0)) {
+         $prefetch_destroy(fsdata);
+         return -ret;
+      }
+   }
+
+   return 0;
+}
+
+
+/** Initialises the prefetch fields of an mfd
+ */
+static inline void $prefetch_init_mfd(struct $mfd_t *mfd)
+{
+   mfd->pf_next = -1;
+   mfd->pf_seq = 0;
+   mfd->pf_until = 0;
+   mfd->pf_jobs = 0;
+}
+
+
+/** Detects sequential reads, and queues blocks for prefetching
+ *
+ * Call this after size bytes have been read from offset in a snapshot file.
+ */
+static inline void $prefetch_read(struct $fsdata_t *fsdata, struct $mfd_t *mfd, off_t offset, size_t size)
+{
+   struct $prefetch_t *pf;
+   struct $prefetch_job_t *job;
+   off_t blockoffset, blockend, blocks;
+   int slog;
+
+   pf = fsdata->prefetch;
+   if(pf == NULL || size == 0) { return; }
+
+   pthread_mutex_lock(&(pf->mutex));
+
+   do {
+
+      if(offset == mfd->pf_next) {
+         mfd->pf_seq++;
+      } else {
+         mfd->pf_seq = 0;
+         mfd->pf_until = 0;
+      }
+      mfd->pf_next = offset + size;
+
+      if(mfd->pf_seq < $$PREFETCH_TRIGGER) { break; }
+
+      // The blocks to read ahead. The file is read in blocks of mfd->sn_bl_slog,
+      // but the distance is counted in blocks of $$BL_S.
+      slog = mfd->sn_bl_slog;
+      blocks = ((off_t)fsdata->prefetch_blocks << ($$BL_SLOG - slog));
+      blockoffset = (mfd->pf_next >> slog);
+      blockend = blockoffset + blocks;
+      if((blockend << slog) > mfd->mapheader.fstat.st_size) {
+         blockend = ((mfd->mapheader.fstat.st_size + (1 << slog) - 1) >> slog);
+      }
+      if(mfd->pf_until > blockoffset) { blockoffset = mfd->pf_until; }
+
+      // Queue larger requests instead of one for each read
+      if(blockend - blockoffset < (blocks + 1) / 2 && (blockend << slog) < mfd->mapheader.fstat.st_size) { break; }
+      if(blockend <= blockoffset) { break; }
+
+      if(pf->used == $$PREFETCH_QUEUE) { break; } // the workers are busy
+
+      job = &(pf->queue[(pf->first + pf->used) % $$PREFETCH_QUEUE]);
+      job->mfd = mfd;
+      job->blockoffset = blockoffset;
+      job->blocknumber = blockend - blockoffset;
+      pf->used++;
+      mfd->pf_jobs++;
+      mfd->pf_until = blockend;
+
+      pthread_cond_signal(&(pf->wake));
+
+   } while(0);
+
+   pthread_mutex_unlock(&(pf->mutex));
+}
+
+
+/** Cancels the prefetch requests of an mfd and waits for the ones in progress
+ *
+ * Call this before freeing an mfd that has been read.
+ */
+static void $prefetch_forget(struct $fsdata_t *fsdata, struct $mfd_t *mfd)
+{
+   struct $prefetch_t *pf;
+   int i;
+
+   pf = fsdata->prefetch;
+   if(pf == NULL) { return; }
+
+   pthread_mutex_lock(&(pf->mutex));
+
+   for(i = 0; i < pf->used; i++) {
+      if(pf->queue[(pf->first + i) % $$PREFETCH_QUEUE].mfd == mfd) {
+         pf->queue[(pf->first + i) % $$PREFETCH_QUEUE].mfd = NULL;
+         mfd->pf_jobs--;
+      }
+   }
+
+   while(mfd->pf_jobs > 0) { pthread_cond_wait(&(pf->done), &(pf->mutex)); }
+
+   pthread_mutex_unlock(&(pf->mutex));
+}
@@ -45,6 +45,9 @@
  * if there is at least one snapshot.
  * Also, there's a pointer from each snapshot to the earlier one in /snapshots/<ID>.hid
  * All these pointers contain the real paths to the snapshot roots: "ROOT/snapshots/<ID>"
+ *
+ * The deduplication store, if used, is in ROOT/snapshots/.dedup.hid (see dedup.c).
+ * The delta store, if used, is in ROOT/snapshots/.delta.hid (see delta.c).
  */
 
 
@@ -347,6 +350,16 @@ static int $sn_create(
 
    $dlogi("Creating new snapshot at '%s'\n", path);
 
+   // The pointer file of this snapshot would clash with the deduplication store
+   if(strcmp(path + strlen(fsdata->sn_dir), $$DEDUP_ID) == 0) {
+      $dlogi("ERROR The snapshot ID '%s' is reserved\n", $$DEDUP_ID);
+      return -EEXIST;
+   }
+   if(strcmp(path + strlen(fsdata->sn_dir), $$DELTA_ID) == 0) {
+      $dlogi("ERROR The snapshot ID '%s' is reserved\n", $$DELTA_ID);
+      return -EEXIST;
+   }
+
    // Create root of snapshot
    if(unlikely(mkdir(path, S_IRWXU) != 0)) {
       ret = errno;
@@ -459,11 +472,25 @@ static int $sn_destroy(struct $fsdata_t *fsdata)
       if((ret = $get_dir_hid_path(prevpointerpath, fsdata->sn_dir)) != 0) { return ret; }
       if(unlink(prevpointerpath) != 0) { return -errno; }
 
+      // Make open files stop saving blocks into the snapshot (see $mfd_validate)
+      fsdata->sn_is_any = 0;
+      fsdata->sn_number++;
+
+      // The inode numbers of its dat files can be reused once it is removed,
+      // and the slots it frees in the deduplication store once they are released,
+      // so cached blocks must not be found by new handles. The generation is
+      // increased before any slot can be reused (see $b_bckey).
+      $bcache_invalidate(fsdata);
+
+      // Release the blocks it refers to in the deduplication store.
+      // As the snapshot is already unlinked, we continue on errors; blocks may leak then.
+      if((ret = $dedup_release_sn(fsdata, snpath)) != 0) {
+         $dlogi("ERROR Releasing the deduplicated blocks of '%s' failed with %d = %s\n", snpath, -ret, strerror(-ret));
+      }
+
       // Remove the snapshot
       if((ret = $recursive_remove(fsdata, snpath)) != 0) { return ret; }
 
-      fsdata->sn_is_any = 0;
-
       return 0;
    }
 
@@ -472,6 +499,14 @@ static int $sn_destroy(struct $fsdata_t *fsdata)
    // Remove the "previous" pointer from the second earliest snapshot
    if(unlink(prevpointerpath) != 0) { return -errno; }
 
+   // Invalidate the cache before slots can be reused, as above
+   $bcache_invalidate(fsdata);
+
+   // Release the blocks it refers to in the deduplication store
+   if((ret = $dedup_release_sn(fsdata, snpath)) != 0) {
+      $dlogi("ERROR Releasing the deduplicated blocks of '%s' failed with %d = %s\n", snpath, -ret, strerror(-ret));
+   }
+
    // Remove the earliest snapshot
    if((ret = $recursive_remove(fsdata, snpath)) != 0) { return ret; }
 
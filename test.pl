@@ -59,6 +59,25 @@ sub append {
    close($fh);
 }
 
+sub write_at {
+   my $filename = shift;
+   my $offset = shift;
+   my $contents = shift;
+
+   my $fh;
+   open( $fh, '+<', $filename ) || die "Cannot open \'$filename\': $!";
+   seek( $fh, $offset, 0 ) || die "Cannot seek in \'$filename\': $!";
+   print $fh $contents;
+   close($fh);
+}
+
+sub truncate_file {
+   my $filename = shift;
+   my $size = shift;
+
+   truncate( $filename, $size ) || die "Cannot truncate \'$filename\': $!";
+}
+
 sub delete_file {
    my $filename = shift;
 
@@ -74,7 +93,11 @@ sub test_contents {
    open( $fh, '<', $filename ) || die "Cannot open \'$filename\': $!";
    while(<$fh>) { $fcont .= $_; }
    close($fh);
+   $fcont = '' unless defined $fcont;
    if( $fcont ne $contents ) {
+      if( length($contents) > 100 ) {
+         die "Testing \'$filename\' for contents of length " . length($contents) . " failed";
+      }
       die "Testing \'$filename\' for contents \'$contents\' failed";
    }
 }
@@ -97,6 +120,19 @@ sub delete_snapshot {
    rmdir 'snapshots' || die "Cannot delete snapshot: $!";
 }
 
+sub mount_esfs {
+   my $options = shift;
+
+   print `./esfs $options test/data test/mnt`;
+   chdir 'test/mnt' || die "Cannot chdir";
+}
+
+sub unmount_esfs {
+   sleep 3;
+   chdir '../..' || die "Cannot chdir";
+   `fusermount -u test/mnt`;
+}
+
 # Setup
 #######
 
@@ -106,8 +142,7 @@ if( -e 'test' ) {
 mkdir 'test'      || die "Setup failed";
 mkdir 'test/data' || die "Setup failed";
 mkdir 'test/mnt'  || die "Setup failed";
-print `./esfs test/data test/mnt`;
-chdir 'test/mnt' || die "Cannot chdir";
+mount_esfs('');
 
 # Test
 ######
@@ -151,13 +186,101 @@ test_contents( 'file2',              'Two' );
 delete_snapshot();
 delete_snapshot();
 
+unmount_esfs();
+
+# Test moving files into the snapshots and saving blocks with each option
+##########################################################################
+
+# 320000 bytes: more than two 128K blocks, some of them identical
+my $big = '0123456789abcdef' x 20000;
+my $big2 = $big;
+substr( $big2, 5000, 100 ) = 'X' x 100;
+substr( $big2, 200000, 70000 ) = 'Y' x 70000;
+my $big3 = $big2;
+substr( $big3, 5050, 10 ) = 'Z' x 10;
+
+foreach my $options (
+   '',
+   '--dedup',
+   '--compress',
+   '--block-size=4',
+   '--dedup --compress --block-size=16',
+   '--save-pages',
+   '--redirect-on-write',
+) {
+
+   print "Testing with options \'$options\'\n";
+   `rm -rf test/data`;
+   mkdir 'test/data' || die "Setup failed";
+   mount_esfs($options);
+
+   create_write( 'unlinked',  'Unlinked' );
+   create_write( 'truncated', 'Truncated' );
+   create_write( 'replaced',  'Replaced' );
+   create_write( 'big',       $big );
+
+   create_snapshot('s1');
+
+   # Files not modified since the snapshot are moved into it
+   delete_file('unlinked');
+   truncate_file( 'truncated', 0 );
+   create_write( 'replaced', 'New' );
+   write_at( 'big', 5000,   'X' x 100 );
+   write_at( 'big', 200000, 'Y' x 70000 );
+
+   test_contents( 'snapshots/s1/unlinked',  'Unlinked' );
+   test_contents( 'snapshots/s1/truncated', 'Truncated' );
+   test_contents( 'snapshots/s1/replaced',  'Replaced' );
+   test_contents( 'snapshots/s1/big',       $big );
+   test_nonexistent('unlinked');
+   test_contents( 'truncated', '' );
+   test_contents( 'replaced',  'New' );
+   test_contents( 'big',       $big2 );
+
+   create_snapshot('s2');
+
+   create_write( 'truncated', 'Refilled' );
+   append( 'replaced', ' again' );
+   write_at( 'big', 5050, 'Z' x 10 );
+
+   test_contents( 'snapshots/s1/truncated', 'Truncated' );
+   test_contents( 'snapshots/s1/replaced',  'Replaced' );
+   test_contents( 'snapshots/s1/big',       $big );
+   test_contents( 'snapshots/s2/truncated', '' );
+   test_contents( 'snapshots/s2/replaced',  'New' );
+   test_contents( 'snapshots/s2/big',       $big2 );
+   test_nonexistent('snapshots/s2/unlinked');
+   test_contents( 'truncated', 'Refilled' );
+   test_contents( 'replaced',  'New again' );
+   test_contents( 'big',       $big3 );
+
+   # Everything is read back the same after mounting again
+   unmount_esfs();
+   mount_esfs($options);
+
+   test_contents( 'snapshots/s1/unlinked',  'Unlinked' );
+   test_contents( 'snapshots/s1/big',       $big );
+   test_contents( 'snapshots/s2/replaced',  'New' );
+   test_contents( 'snapshots/s2/big',       $big2 );
+   test_contents( 'big',                    $big3 );
+
+   # Removing the earliest snapshot keeps the blocks the later one refers to
+   delete_snapshot();
+
+   test_nonexistent('snapshots/s1');
+   test_contents( 'snapshots/s2/truncated', '' );
+   test_contents( 'snapshots/s2/replaced',  'New' );
+   test_contents( 'snapshots/s2/big',       $big2 );
+   test_contents( 'big',                    $big3 );
+
+   delete_snapshot();
+
+   unmount_esfs();
+}
+
 # Cleanup
 #########
 
-sleep 3;
-
-chdir '../..' || die "Cannot chdir";
-`fusermount -u test/mnt`;
 rmdir 'test/mnt' || die "Error: test/mnt is not empty";
 `rm -rf test`;
 
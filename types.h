@@ -69,10 +69,32 @@
 #define $$PATH_LEN_T size_t // type to store path lengths in
 #define $$FILESIZE_T unsigned long // type to store file size in
 
-#define $$BL_S 131072 // blocksize in bytes. 128K = 2^17 // TODO Determine this based on stat.st_blksize
+#define $$BL_S 131072 // default and largest blocksize in bytes. 128K = 2^17. Map files can use a smaller one; see $$MAP_BL_SLOG
 #define $$BL_SLOG 17 // log2(blocksize)
+#define $$BL_SLOG_MIN 12 // log2 of the smallest blocksize, 4K
 #define $$BLP_T off_t // block pointer type. Note: filesizes are stored in off_t
 #define $$BLP_S (sizeof($$BLP_T)) // block pointer size in bytes
+#define $$BLP_ZERO -1 // pointer saved in the map for blocks that only contain zeros, which are not saved in the dat file
+
+// Pointers to blocks saved at any byte offset in the dat file, possibly compressed (see $$MAP_COMPRESSED).
+// Bits 0-43 hold the offset, bits 44-61 the length saved, and bit 62 is set.
+// Blocks saved with a length of $$BL_S are not compressed.
+#define $$BLP_COMP_FLAG ((($$BLP_T)1) << 62)
+#define $$BLP_COMP_MAXOFFSET ((($$BLP_T)1) << 44)
+#define $$BLP_COMP(offset, length) ($$BLP_COMP_FLAG | ((($$BLP_T)(length)) << 44) | ($$BLP_T)(offset))
+#define $$BLP_IS_COMP(pointer) ((pointer) > 0 && ((pointer) & $$BLP_COMP_FLAG) != 0)
+#define $$BLP_COMP_OFFSET(pointer) ((pointer) & ($$BLP_COMP_MAXOFFSET - 1))
+#define $$BLP_COMP_LENGTH(pointer) ((size_t)(((pointer) >> 44) & 0x3FFFF))
+
+// Pointers to partially saved blocks (see $$MAP_PAGES). Bits 0-28 hold the number of the block in the dat file,
+// bits 29-60 a bitmap of the pages saved, and bit 61 is set. The pages not saved are holes in the dat file.
+#define $$BL_PAGE_SLOG 12 // log2 of the size of the pages blocks can be partially saved in. 4K
+#define $$BLP_PART_FLAG ((($$BLP_T)1) << 61)
+#define $$BLP_PART_MAXINDEX ((($$BLP_T)1) << 29)
+#define $$BLP_PART(index, mask) ($$BLP_PART_FLAG | ((($$BLP_T)(mask)) << 29) | ($$BLP_T)(index))
+#define $$BLP_IS_PART(pointer) ((pointer) > 0 && ((pointer) & ($$BLP_COMP_FLAG | $$BLP_PART_FLAG)) == $$BLP_PART_FLAG) // bit 61 can be set in $$BLP_COMP pointers
+#define $$BLP_PART_INDEX(pointer) ((pointer) & ($$BLP_PART_MAXINDEX - 1))
+#define $$BLP_PART_MASK(pointer) ((uint32_t)(((pointer) >> 29) & 0xFFFFFFFF))
 
 #define $$MAX_SNAPSHOTS 1024*1024 // this is currently only used to detect infinite loops // TODO 2 Review this
 
@@ -94,18 +116,258 @@
 
 
 // Locking
-#define $$LOCK_NUM 64 // Number of locks; this determines the number of concurrent files that can be written
-#define $$LOCKLABEL_T unsigned long // ==, & used on it. 0 is a special value
+#define $$LOCK_BUCKETS 64 // Initial number of hash buckets in the lock table; it grows as more files are locked. See mflock.c
+#define $$LOCK_STRIPES 16 // Number of mutexes protecting the hash buckets; a power of 2 not above $$LOCK_BUCKETS
+#define $$LOCK_CHUNK 64 // Number of locks allocated at once
+#define $$LOCK_CHUNKS 1024 // Maximum number of chunks of locks, which limits the number of files locked at the same time
+#define $$LOCKLABEL_T struct $locklabel_t // compared using $$LOCKLABEL_EQ
+#define $$LOCKLABEL_NODEV ((uint64_t)-1) // the device in labels derived from a path or a name. See $string2locklabel
+#define $$LOCK_GROUP_SLOG 21 // log2 of the size of the parts of a file whose blocks are locked together. See $b_lock_label
+
+#define $$LOCKSTAT_HIST 24 // Number of buckets in the histogram of the time spent waiting for locks; bucket i counts waits shorter than 2^i microseconds, the last one all longer waits
+#define $$LOCKSTAT_HOT 16 // Number of the most contended labels whose counters are kept after their locks are freed
+#define $$LOCKSTAT_XATTR "user.esfs.lockstats" // the extended attribute of the root that reports lock contention. See $mflock_stats
+#define $$LOCKSTAT_MAX 16384 // the maximum length of the report of lock contention
 
 #define $$LOCKLABEL_RMDIR "*rmdir"
 
-/** An element in the table used for file-based locking
+#define $$OPEN_COUNTS 1024 // Size of the table counting the open main files. See $mfd_open_count_add
+#define $$DATTAIL_BUCKETS 64 // Number of hash buckets in the table of dat files open for writing. See $mfd_dattail_get
+#define $$DAT_PREALLOC 4 // Default size of the chunks dat files are preallocated in, in MB. See $mfd_dat_reserve
+
+/** A dat file open for writing, shared by all the main MFDs that have it open. See $mfd_dattail_get
+ */
+struct $dattail_t {
+   struct $dattail_t *next; /**< the next entry in the same hash bucket */
+   dev_t dev; /**< the device of the dat file */
+   ino_t ino; /**< the inode number of the dat file */
+   int refs; /**< the number of MFDs using the entry */
+   off_t tail; /**< the end of the space reserved in the dat file, where the next blocks are appended. Changed atomically */
+   off_t alloc; /**< the end of the space preallocated for the dat file. Changed holding mutex */
+   pthread_mutex_t mutex; /**< serialises preallocation */
+};
+
+/** Identifies what a lock is for. See mflock.c
+ *
+ * Main files are identified by their device and inode number
+ * (see $mfd_set_locklabel), so that unrelated files never share a lock.
+ */
+struct $locklabel_t {
+   uint64_t dev; /**< the device of the main file, or $$LOCKLABEL_NODEV */
+   uint64_t ino; /**< the inode number of the main file, or the hash of a path or a name */
+   uint64_t part; /**< 0 for the whole file, or 1 + the number of a group of blocks (see $b_lock_label) */
+};
+
+#define $$LOCKLABEL_EQ(a, b) ((a).ino == (b).ino && (a).dev == (b).dev && (a).part == (b).part)
+
+/** A lock in the table used for file-based locking. See mflock.c
  */
 struct $mflock_t {
+   $$LOCKLABEL_T label; /**< the label locked */
+   int next; /**< the next lock in the same hash bucket or in the free list, or -1 */
+   int held; /**< 0 if the lock is free, -1 if a thread holds it exclusively, or the number of threads sharing it */
+   int waiters; /**< the number of threads waiting for the lock */
+   int xwaiters; /**< the number of threads waiting to hold the lock exclusively; new threads do not share it then */
+   pthread_cond_t cond; /**< broadcast when the lock becomes free and there are waiters */
+   unsigned long long acquired; /**< the number of times the lock was acquired since it was put in the table */
+   unsigned long long contended; /**< the number of those times a thread had to wait */
+   unsigned long long wait_us; /**< the total time threads waited for the lock in microseconds */
+};
+
+/** Contention counters of locks. See $mflock_stats
+ */
+struct $lockstat_t {
+   unsigned long long acquired; /**< the number of times locks were acquired exclusively */
+   unsigned long long shared; /**< the number of times locks were acquired shared */
+   unsigned long long contended; /**< the number of acquisitions that had to wait */
+   unsigned long long wakeups; /**< the number of times waiting threads were woken; those beyond one per contended acquisition found the lock still taken */
+   unsigned long long wait_us; /**< the total time spent waiting in microseconds */
+   unsigned long long max_wait_us; /**< the longest wait in microseconds */
+   unsigned long long hist[$$LOCKSTAT_HIST]; /**< the histogram of waits, see $$LOCKSTAT_HIST */
+};
+
+/** The counters of a label kept after its lock is freed. See $mflock_stats
+ */
+struct $lockstat_label_t {
    $$LOCKLABEL_T label;
-   pthread_mutex_t mutex;
-   pthread_mutex_t mod_mutex;
-   unsigned int want;
+   unsigned long long acquired; /**< see $mflock_t */
+   unsigned long long contended; /**< see $mflock_t */
+   unsigned long long wait_us; /**< see $mflock_t */
+};
+
+/** The table of file-based locks. See mflock.c
+ */
+struct $mflock_table_t {
+   pthread_mutex_t stripes[$$LOCK_STRIPES]; /**< stripe i protects the buckets, and the locks in them, with index i modulo $$LOCK_STRIPES */
+   int *buckets; /**< the first lock in each hash bucket, or -1 */
+   int nbuckets; /**< the number of hash buckets; a power of 2. Can only be changed holding all the stripes */
+   int used; /**< the number of locks in the hash buckets */
+   pthread_mutex_t alloc_mutex; /**< protects the free list and the chunks */
+   int free; /**< the first free lock, or -1 */
+   int nchunks; /**< the number of chunks of locks allocated */
+   struct $mflock_t *chunks[$$LOCK_CHUNKS]; /**< the locks; the ID of a lock is its index in a chunk plus $$LOCK_CHUNK times the index of the chunk */
+   unsigned long long enolck; /**< the number of times no lock could be allocated; protected by alloc_mutex */
+   unsigned long long grows; /**< the number of times the buckets were doubled; protected by all the stripes */
+   struct $lockstat_t stats[$$LOCK_STRIPES]; /**< contention counters; stats[i] is protected by stripe i and counts the labels in it */
+   pthread_mutex_t hot_mutex; /**< protects hot and nhot */
+   struct $lockstat_label_t hot[$$LOCKSTAT_HOT]; /**< the labels that waited the longest in total among those whose locks have been freed */
+   int nhot; /**< the number of entries used in hot */
+};
+
+
+// Block cache
+#define $$BCACHE_SHARDS 16 // Number of independently locked parts of the block cache
+
+/** Identifies a block saved in a dat file. See bcache.c
+ */
+struct $bcache_key_t {
+   dev_t dev; /**< the device of the dat file */
+   ino_t ino; /**< the inode number of the dat file */
+   unsigned long gen; /**< fsdata->bcache_gen when the dat file was opened */
+   $$BLP_T pointer; /**< the pointer to the block in the dat file */
+};
+
+/** A block in the block cache
+ */
+struct $bcache_entry_t {
+   struct $bcache_key_t key;
+   struct $bcache_entry_t *hash_next; /**< the next entry in the same hash bucket */
+   struct $bcache_entry_t *lru_prev; /**< the more recently used entry */
+   struct $bcache_entry_t *lru_next; /**< the less recently used entry */
+   size_t length; /**< the number of bytes in data; can be less than $$BL_S for the last block */
+   char data[]; /**< the contents of the block */
+};
+
+/** A part of the block cache with its own lock
+ */
+struct $bcache_shard_t {
+   pthread_mutex_t mutex; /**< protects everything in the shard */
+   struct $bcache_entry_t **hash; /**< the hash table */
+   size_t buckets; /**< the size of the hash table; a power of 2 */
+   struct $bcache_entry_t *lru_first; /**< the most recently used entry */
+   struct $bcache_entry_t *lru_last; /**< the least recently used entry */
+   size_t used; /**< the number of bytes cached */
+   size_t limit; /**< the maximum number of bytes to cache */
+};
+
+
+// Group commit
+#define $$GSYNC_DAT 0 // Indexes of the files flushed by fsync in $gsync_req_t.fds, in the order they are flushed
+#define $$GSYNC_DEDUP_DAT 1
+#define $$GSYNC_DEDUP_INDEX 2
+#define $$GSYNC_MAP 3
+#define $$GSYNC_DELTA 4
+#define $$GSYNC_MAIN 5
+#define $$GSYNC_FDS 6
+#define $$GSYNC_WINDOW 200 // Microseconds to wait for more fsync requests before flushing a group, if the previous one had several
+
+/** An fsync request waiting to be flushed as part of a group. See gsync.c
+ */
+struct $gsync_req_t {
+   struct $gsync_req_t *next; /**< the next request in the same group */
+   int fds[$$GSYNC_FDS]; /**< the files to flush, or -1 */
+   int datasync; /**< whether only the data needs to be flushed, 0 or 1 */
+   int done; /**< set to 1 when the request has been flushed */
+   int ret; /**< 0 or -errno; set when done */
+};
+
+/** The group commit engine
+ */
+struct $gsync_t {
+   pthread_mutex_t mutex; /**< protects everything below */
+   pthread_cond_t done; /**< signalled when a group has been flushed */
+   struct $gsync_req_t *queue; /**< the requests to flush in the next group */
+   int busy; /**< whether a group is being flushed, 0 or 1 */
+   int last; /**< the number of requests in the last group */
+};
+
+
+// Prefetching
+#define $$PREFETCH_THREADS 2 // Number of threads reading ahead
+#define $$PREFETCH_QUEUE 64 // Maximum number of queued prefetch requests
+#define $$PREFETCH_BLOCKS 8 // Default number of blocks to read ahead
+#define $$PREFETCH_TRIGGER 2 // Number of sequential reads on a handle before prefetching starts
+
+/** A request to read blocks of a snapshot file in advance. See prefetch.c
+ */
+struct $prefetch_job_t {
+   struct $mfd_t *mfd; /**< the file to read, or NULL if the request has been cancelled */
+   off_t blockoffset; /**< the first block to read */
+   size_t blocknumber; /**< the number of blocks to read */
+};
+
+/** The prefetch worker pool
+ */
+struct $prefetch_t {
+   pthread_mutex_t mutex; /**< protects the queue and the prefetch fields of the mfds */
+   pthread_cond_t wake; /**< signalled when a request is queued or the workers need to stop */
+   pthread_cond_t done; /**< signalled when a request has been completed */
+   struct $prefetch_job_t queue[$$PREFETCH_QUEUE]; /**< a ring buffer of requests */
+   int first; /**< the index of the first request in the queue */
+   int used; /**< the number of requests in the queue */
+   int stop; /**< set to 1 to stop the workers */
+   int threads; /**< the number of threads started */
+   pthread_t thread[$$PREFETCH_THREADS];
+};
+
+
+#define $$BUFPOOL_BUFSIZE ($$BL_S * 16) // Size of the buffers used for copy on write. See $$B_WRITE_RUN
+#define $$BUFPOOL_CACHE 2 // Number of buffers each thread keeps for itself
+
+/** Values of $bufpool_t.hugepages */
+#define $$BUFPOOL_NOHUGE 0 // huge pages are not used
+#define $$BUFPOOL_HUGETLB 1 // try to map buffers from huge pages
+#define $$BUFPOOL_THP 2 // ask for transparent huge pages (no huge pages were available)
+
+/** The pool of buffers used for copy on write. See bufpool.c
+ */
+struct $bufpool_t {
+   pthread_mutex_t mutex; /**< protects the free list */
+   char *free; /**< the global free list, linked through the first bytes of the buffers */
+   pthread_key_t key; /**< the per-thread caches of buffers */
+   int hugepages; /**< $$BUFPOOL_NOHUGE, $$BUFPOOL_HUGETLB or $$BUFPOOL_THP */
+};
+
+/** The buffers kept by a thread
+ */
+struct $bufpool_cache_t {
+   struct $bufpool_t *pool;
+   int used; /**< the number of buffers kept */
+   char *buf[$$BUFPOOL_CACHE];
+};
+
+
+// Deduplication store
+#define $$DEDUP_ID "/.dedup" // a snapshot cannot have this ID, as the store uses its pointer file name
+#define $$DEDUP_DIR $$DEDUP_ID $$EXT_HID // the directory of the store inside the snapshots directory
+#define $$DEDUP_POINTER(slot) (-2 - ($$BLP_T)(slot)) // pointer saved in the map for a block in the store
+#define $$DEDUP_SLOT(pointer) (-2 - (int64_t)(pointer)) // the slot of a block in the store from its pointer
+#define $$DEDUP_RELEASE_CHUNK 4096 // Number of pointers read at once when a snapshot is removed
+
+/** A block in the deduplication store, as saved in its index file. See dedup.c
+ */
+struct $dedup_rec_t {
+   uint64_t hash; /**< the hash of the block; see $dedup_hash */
+   int64_t refs; /**< the number of pointers to the block; 0 if the slot is free */
+};
+
+/** The deduplication store. See dedup.c
+ */
+struct $dedup_t {
+   pthread_mutex_t mutex; /**< protects everything below and the index file; blocks are read and written in dat without it */
+   int datfd; /**< the file holding the blocks */
+   int idxfd; /**< the file holding the records */
+   int write; /**< whether new blocks are saved in the store, 0 or 1 */
+   struct $bcache_key_t bckey; /**< the device and inode number of the dat file of the store (see $b_bckey) */
+   struct $dedup_rec_t *recs; /**< the records of the slots, as in the index file apart from pins */
+   int64_t *next; /**< for each slot, the next slot in the same hash bucket or the free list, or -1 */
+   int64_t *pins; /**< for each slot, the references taken by $dedup_store while the block is compared or written; included in refs but not saved */
+   char *writing; /**< for each slot, 1 while a new block is written into it; such slots are not in the hash table yet */
+   int64_t slots; /**< the number of slots used or freed */
+   int64_t allocated; /**< the number of slots allocated in recs, next, pins and writing */
+   int64_t *buckets; /**< the first slot in each hash bucket, or -1 */
+   int64_t nbuckets; /**< the number of hash buckets; a power of 2 */
+   int64_t free; /**< the first free slot, or -1 */
 };
 
 
@@ -120,9 +382,24 @@ struct $fsdata_t {
    char sn_lat_dir[$$PATH_MAX]; /**< caches the real path to the root of the latest snapshot */
    $$PATH_LEN_T sn_lat_dir_len; /**< the length of the latest snapshot dir string */
    int sn_is_any; /**< whether there are any snapshots, 1 or 0 */
-   struct $mflock_t *mflocks; /**< file-based locks */
-   // CACHE
-   char *block_buffer; /**< A buffer that can be used for copy on write without having to allocate/free memory. Useful especially if ESFS handles a single file */
+   struct $mflock_table_t *mflocks; /**< file-based locks. See mflock.c */
+   int *open_counts; /**< the number of open main files by lock label. See $mfd_open_count_add */
+   struct $dattail_t **dattails; /**< the hash table of dat files open for writing. See $mfd_dattail_get */
+   pthread_mutex_t dattails_mutex; /**< protects the dattails table and the reference counts in it */
+   off_t dat_prealloc; /**< the size of the chunks dat files are preallocated in (set from the command line); 0 if disabled. See $mfd_dat_reserve */
+   struct $bcache_shard_t *bcache; /**< the block cache, or NULL if disabled. See bcache.c */
+   size_t bcache_size; /**< the size of the block cache in bytes (set from the command line); 0 if disabled */
+   unsigned long bcache_gen; /**< the generation of the block cache; see $bcache_invalidate */
+   struct $prefetch_t *prefetch; /**< the prefetch worker pool, or NULL if disabled. See prefetch.c */
+   struct $gsync_t *gsync; /**< batches fsync requests. See gsync.c */
+   int prefetch_blocks; /**< the number of blocks to read ahead (set from the command line); 0 if disabled */
+   struct $bufpool_t *bufpool; /**< buffers for copy on write. See bufpool.c */
+   struct $dedup_t *dedup; /**< the deduplication store, or NULL if there is none. See dedup.c */
+   int compress; /**< whether blocks in new map files are compressed, 0 or 1 (set from the command line) */
+   int bl_slog; /**< log2 of the blocksize used in new map files (set from the command line) */
+   int save_pages; /**< whether blocks in new map files can be partially saved, 0 or 1 (set from the command line) */
+   struct $delta_t *delta; /**< the delta store, or NULL if redirect on write is not used (set from the command line). See delta.c */
+   int b_copy_unsupported; /**< the ways of copying blocks in the kernel that the underlying filesystem does not support. See $b_copy_run */
 };
 
 
@@ -151,11 +428,27 @@ struct $snpath_t {
  * as it is cached in memory with each filehandle.
  */
 struct $mapheader_t {
-   int $version;
+   int $version; /**< $$MAP_VERSION, or $$MAP_VERSION_FLAGS if flags is used */
    int exists; /**< whether the file exists, 0 or 1 */
    struct stat fstat; /**< saved parameters of the file (only if exists==1) */
    char signature[4];
+   int flags; /**< $$MAP_* flags; only valid if $version is $$MAP_VERSION_FLAGS. This used to be padding */
 };
+
+#define $$MAP_VERSION 12000 // version of map files without flags
+#define $$MAP_VERSION_FLAGS 12001 // version of map files using flags
+
+/** Map file flags */
+#define $$MAP_COMPRESSED 1 // blocks are saved compressed in the dat file; see $$BLP_COMP
+#define $$MAP_PAGES 2 // blocks can be partially saved; see $$BLP_PART
+#define $$MAP_WHOLE 4 // the main file has been moved into the snapshot as the dat file; pointers are not used. See $_move_to_snapshot
+#define $$MAP_BL_SLOG_SHIFT 8 // bits 8-15 of the flags hold log2(blocksize) if it is not $$BL_SLOG
+
+/** Whether the flags in a map header are valid and contain a flag */
+#define $$MAP_HAS_FLAG(maphead, flag) ((maphead)->$version == $$MAP_VERSION_FLAGS && ((maphead)->flags & (flag)) != 0)
+
+/** log2 of the blocksize used in a map file and the corresponding dat file */
+#define $$MAP_BL_SLOG(maphead) ($$MAP_HAS_FLAG(maphead, 0xFF << $$MAP_BL_SLOG_SHIFT) ? (((maphead)->flags >> $$MAP_BL_SLOG_SHIFT) & 0xFF) : $$BL_SLOG)
 // TODO To make FS files portable, the types used here should be reviewed, and proper (de)serialisation implemented.
 
 
@@ -178,6 +471,20 @@ struct $sn_steps_t {
    int mapfd; /**< filehandle to the map file[C,D] */
    int datfd; /**< filehandle to the dat file[C] or the main file */
    DIR *dirfd; /**< handle to the open directory, or NULL */
+   char *mapmem; /**< the map file mapped into memory, or NULL. See $mfd_mmap_step */
+   size_t mapmemlen; /**< the length of mapmem */
+   struct $bcache_key_t bckey; /**< identifies the dat file in the block cache (pointer is unused). Only set if the block cache is enabled */
+   int bl_slog; /**< log2 of the blocksize used in the map file. See $$MAP_BL_SLOG */
+   int pages; /**< whether the map file can hold partially saved blocks, 0 or 1. See $$MAP_PAGES */
+   int whole; /**< whether the dat file holds the whole file, 0 or 1. See $$MAP_WHOLE */
+};
+
+
+/** An entry in the resolved block index of a file in a snapshot. See $b_index_build
+ */
+struct $b_index_t {
+   int sni; /**< the snapshot step holding the block, or 0 if it is not held by any of the immutable snapshots */
+   $$BLP_T pointer; /**< the pointer read from the map file of step sni */
 };
 
 
@@ -212,7 +519,7 @@ enum $$mfd_types {
 struct $mfd_t {
    enum $$mfd_types is_main; /**< what this node is */
    struct $mapheader_t mapheader; /**< The whole mapheader loaded into memory for main files, and from the first map file for snapshot files */
-   $$LOCKLABEL_T locklabel;
+   $$LOCKLABEL_T locklabel; /**< identifies the main file for locking and counting it as open. See $mfd_set_locklabel */
    int sn_number; /**< a number identifying the current snapshot; compared to fsdata->sn_number */
 
    // MAIN FILE PART: (used when dealing with a file in the main space)
@@ -220,15 +527,85 @@ struct $mfd_t {
    DIR *maindir; /**< dir handle for a directory in the main space, or /snapshots/ if is_main==$$MFD_SNROOT */
    int mapfd; /**< filehandle to the map file[A] in the latest snapshot (with write directives followed). See $mfd_open_sn */
    int datfd; /**< filehandle to the dat file[A,B] in the latest snapshot. See $mfd_open_sn */
+   struct $dattail_t *dattail; /**< the size of the dat file, or NULL if datfd < 0. See $mfd_dattail_get */
+   pthread_rwlock_t sn_lock; /**< held for reading while the snapshot part is used to write, and for writing to reinitialise it. See $mfd_sn_hold */
    // USED FOR REINITIALISATION
    char vpath[$$PATH_MAX]; /**< the in-FS path of the file opened; needed in case the map/dat files must be reinitalised due to a new snapshot. This is the original vpath even if we have followed a write directive */
    // CACHE
-   $$BLP_T latest_written_block_cache; /**< Used to cache the index+1 of the latest block written (not the position+1 in the dat file). 0 if there is nothing cached. */
+   unsigned long *saved_map; /**< bitmap of the blocks known to be saved in the latest snapshot, or NULL if not yet allocated; freed only when sn_lock is held for writing. See $b_saved_get */
+   struct $delta_file_t *delta; /**< the blocks of the main file redirected on write, or NULL if not used. See $delta_get */
 
    // SNAPSHOT FILE PART: (used when dealing with a file in the snapshot space)
    int sn_current; /**< the largest index in sn_steps, representing the snapshot being read */
    int sn_first_file; /**< the largest index where the node can actually be found, or -1 if not found anywhere */
    struct $sn_steps_t *sn_steps; /**< data about each snapshot step, from the main file [0], the first snapshot [1], to the snapshot being read [sn_current] */
+   struct $b_index_t *sn_index; /**< where each block can be found in the immutable snapshots, or NULL. See $b_index_build */
+   $$BLP_T sn_index_len; /**< the number of blocks in sn_index */
+   int sn_bl_slog; /**< log2 of the size of the blocks the file is read in: the smallest blocksize used by the map files. See $b_read */
+   // PREFETCHING (protected by fsdata->prefetch->mutex)
+   off_t pf_next; /**< the offset following the last read */
+   int pf_seq; /**< the number of sequential reads so far */
+   off_t pf_until; /**< the block before which blocks have already been queued for prefetching */
+   int pf_jobs; /**< the number of prefetch requests queued or in progress for this file */
+};
+
+
+// Redirect on write
+#define $$DELTA_ID "/.delta" // a snapshot cannot have this ID, as the store uses its pointer file name
+#define $$DELTA_DIR $$DELTA_ID $$EXT_HID // the directory of the delta store inside the snapshots directory
+#define $$DELTA_EXT ".dlt" // extension of the delta files
+#define $$DELTA_BUCKETS 64 // Number of buckets in the hash table of the delta files
+#define $$DELTA_MERGE_INTERVAL 1 // Number of seconds between the rounds of the merger
+#define $$DELTA_MERGE_BATCH 16 // Number of blocks merged while holding the lock of a delta file
+#define $$DELTA_DEAD -1 // block number of a slot that has been merged or dropped
+
+/** Whether the main file of an mfd has blocks redirected that are not merged yet */
+#define $$DELTA_PENDING(mfd) ((mfd)->delta != NULL && __atomic_load_n(&((mfd)->delta->pending), __ATOMIC_SEQ_CST) > 0)
+
+/** The position of a slot in a delta file. Each slot is a block number (int64_t) followed by the block */
+#define $$DELTA_SLOT_POS(slog, slot) ((off_t)sizeof(struct $delta_header_t) + (off_t)(slot) * ((1 << (slog)) + (off_t)sizeof(int64_t)))
+
+/** The header of a delta file. See delta.c
+ */
+struct $delta_header_t {
+   char signature[4];
+   int slog; /**< log2 of the blocksize of the slots */
+   char vpath[$$PATH_MAX]; /**< the main file the blocks belong to */
+};
+
+/** The new blocks of a main file that have been redirected. See delta.c
+ */
+struct $delta_file_t {
+   struct $delta_file_t *next; /**< the next file in the same hash bucket */
+   char vpath[$$PATH_MAX]; /**< the in-FS path of the main file */
+   unsigned long hash; /**< the hash of vpath */
+   int refs; /**< the number of mfds and threads using this; protected by the mutex of the store */
+   int listed; /**< whether it is in the hash table, 0 or 1; protected by the mutex of the store */
+   pthread_rwlock_t rwlock; /**< merges and writes redirected or overwriting redirected blocks hold this for writing; other writes and reads of the main file for reading (see $delta_write_direct) */
+   int fd; /**< the delta file, or -1 if not created yet */
+   char path[$$PATH_MAX]; /**< the path of the delta file */
+   int slog; /**< log2 of the blocksize of the slots; the blocksize of the map file */
+   int *slots; /**< for each block, the slot holding it + 1, or 0 */
+   off_t nblocks; /**< the number of blocks in slots */
+   off_t limit; /**< blocks from here are not redirected; -1 if it needs to be recalculated */
+   int nslots; /**< the number of slots used in the delta file */
+   int pending; /**< the number of blocks in the delta file that are not merged */
+   int mfd_open; /**< whether mfd has been opened, 0 or 1 */
+   struct $mfd_t mfd; /**< the main file and the latest snapshot, used to merge the blocks */
+};
+
+/** The delta store. See delta.c
+ */
+struct $delta_t {
+   pthread_mutex_t mutex; /**< protects the hash table and the refs of the files */
+   pthread_cond_t wake; /**< signalled when the merger needs to stop */
+   struct $delta_file_t *buckets[$$DELTA_BUCKETS];
+   char dir[$$PATH_MAX]; /**< the directory of the delta files */
+   unsigned long next_id; /**< the number used to name the next delta file */
+   int paused; /**< if non-0, no new blocks are redirected. See $delta_pause */
+   int stop; /**< set to 1 to stop the merger */
+   int started; /**< whether the merger has been started, 0 or 1 */
+   pthread_t thread;
 };
 
 
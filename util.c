@@ -131,12 +131,6 @@ static void log_close(FILE *logfile)
 #define $$DFSDATA_MFD struct $fsdata_t *fsdata; struct $mfd_t *mfd; fsdata = $$FSDATA; mfd = $$MFD;
 
 
-/** Sleeps. Needs struct timespec delay */
-#define $$SLEEP pselect(0, NULL, NULL, NULL, &delay, NULL);
-
-
-
-
 /** Checks if (virtual) path is in the snapshot space */
 #define $$_IS_PATH_IN_SN(path) (unlikely(strncmp(path, $$SNDIR, $$SNDIR_LEN) == 0 && (path[$$SNDIR_LEN] == $$DIRSEPCH || path[$$SNDIR_LEN] == '\0')))
 
@@ -416,16 +410,32 @@ static inline unsigned long $djb2(const unsigned char *s)
 }
 
 
-/** Helper function to get a suitable lock label from a string
+/** Helper function to get a lock label from a string
  *
+ * This is used for locks that are not for a main file, and for main files
+ * that do not exist. Different strings may get the same label.
  */
 static inline $$LOCKLABEL_T $string2locklabel(const char *s)
 {
-   unsigned long key;
+   $$LOCKLABEL_T label;
 
-   key = $djb2((unsigned char *) s);
-   if(key != 0) { return key; } // 0 is a special value in the lock system
-   return 1;
+   label.dev = $$LOCKLABEL_NODEV;
+   label.ino = $djb2((unsigned char *) s);
+   label.part = 0;
+   return label;
+}
+
+
+/** Helper function to get the lock label of a main file from its stats
+ */
+static inline $$LOCKLABEL_T $stat2locklabel(const struct stat *st)
+{
+   $$LOCKLABEL_T label;
+
+   label.dev = st->st_dev;
+   label.ino = st->st_ino;
+   label.part = 0;
+   return label;
 }
 
 
@@ -493,6 +503,11 @@ static int $check_params(void)
    if(sizeof(off_t) * 8.0 > ($$BL_SLOG + ((double)$$BLP_S) * 8.0)) { return -11; }
    if((1 << $$BL_SLOG) != $$BL_S) { return -12; }
 
+   // The stripe of a lock must not depend on the number of hash buckets (see mflock.c)
+   if(($$LOCK_STRIPES & ($$LOCK_STRIPES - 1)) != 0 || ($$LOCK_BUCKETS % $$LOCK_STRIPES) != 0) { return -13; }
+   // Blocks cannot straddle groups locked together (see $b_lock_label)
+   if($$LOCK_GROUP_SLOG < $$BL_SLOG) { return -14; }
+
    return 0;
 }
 